@@ -0,0 +1,26 @@
+#-------------------------------------------------
+#
+# Loopback benchmark: server engine and simulated clients in one
+# process
+#
+#-------------------------------------------------
+
+QT       += core \
+        network
+QT       -= gui
+
+TARGET = filetrans-bench
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+
+SOURCES += main.cpp \
+        bench.cpp \
+        benchclient.cpp
+
+HEADERS  += bench.h \
+        benchclient.h
+
+include(../Server/engine.pri)
+include(../Client/engine.pri)
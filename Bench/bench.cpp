@@ -0,0 +1,542 @@
+#include "bench.h"
+#include "benchclient.h"
+#include "clientengine.h"
+#include "transferserver.h"
+#include "shareddirs.h"
+#include "dirindex.h"
+#include "bufferpool.h"
+#include "filehash.h"
+#include "delta.h"
+#include <QDebug>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QHostAddress>
+#include <QtMath>
+#include <algorithm>
+
+#ifdef Q_OS_UNIX
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#define KIB     (1024LL)
+#define MIB     (1024LL * KIB)
+#define GIB     (1024LL * MIB)
+
+/* bytes generated per write */
+#define GENERATE_BLOCK      (1024 * 1024)
+/* file of the sparse workload, past the 32 bit offsets */
+#define SPARSE_SIZE         (5 * GIB)
+/* where its middle data block sits, straddling this offset */
+#define SPARSE_BOUNDARY     (4 * GIB)
+/* delta workload: one delta block in this many is changed in a copy */
+#define DELTA_CHANGE_EVERY  100
+
+BenchOptions::BenchOptions() :
+    dir(QDir::temp().absoluteFilePath("filetrans-bench")),
+    scale(1.0),
+    clients(32),
+    streams(DEFAULT_STREAMS),
+    workers(0),
+    chunk_size(SEND_CHUNK_SIZE),
+    zero_copy(true),
+    compression(true),
+    keep(false),
+    timeout(3600)
+{
+}
+
+ClientWaiter::ClientWaiter(int count, QEventLoop *loop) :
+    QObject(0),
+    left(count),
+    loop(loop)
+{
+}
+
+void ClientWaiter::client_finished(int id)
+{
+    finished.insert(id);
+    if (--left == 0)
+        loop->quit();
+}
+
+static qint64 scaled(qint64 value, double scale)
+{
+    return qMax((qint64)1, (qint64)(value * scale));
+}
+
+QList<Workload> Bench::workloads(const BenchOptions &options)
+{
+    double scale = options.scale;
+    QList<Workload> list;
+
+    /* one big file: raw streaming throughput */
+    Workload large = { "large", 1, scaled(10 * GIB, scale),
+                       scaled(10 * GIB, scale), 1, 1, false,
+                       WORKLOAD_DATA };
+    /* many tiny files: per-file overhead */
+    Workload small = { "small", (int)scaled(100000, scale), 4 * KIB,
+                       4 * KIB, 1000, 1, false, WORKLOAD_DATA };
+    /* a tree of everything in between */
+    Workload mixed = { "mixed", (int)scaled(2000, scale), KIB, 16 * MIB,
+                       100, 1, false, WORKLOAD_DATA };
+    /* the same share for many clients at once */
+    Workload concurrent = { "concurrent", (int)scaled(1000, scale),
+                            64 * KIB, 64 * KIB, 100, options.clients, false,
+                            WORKLOAD_DATA };
+    /* 64 connections interleaving their requests, every copy checked */
+    Workload stress = { "stress", (int)scaled(500, scale), KIB, 256 * KIB,
+                        50, STRESS_CLIENTS, true, WORKLOAD_DATA };
+
+    /*
+     * mostly holes, data only at the start, across the 4 GiB boundary
+     * and at the end; not scaled, the boundary is the point
+     */
+    Workload sparse = { "sparse", 1, SPARSE_SIZE, SPARSE_SIZE, 1, 1, true,
+                        WORKLOAD_SPARSE };
+
+    /* an old copy with 1% of its blocks changed: bytes on the wire */
+    qint64 delta_size = qMax(scaled(GIB, scale), (qint64)DELTA_MIN_SIZE);
+    Workload delta = { "delta", 1, delta_size, delta_size, 1, 1, true,
+                       WORKLOAD_DELTA };
+
+    list << large << small << mixed << concurrent << stress << sparse
+         << delta;
+    return list;
+}
+
+Bench::Bench(const BenchOptions &options) :
+    options(options)
+{
+}
+
+static quint64 xorshift(quint64 *state)
+{
+    quint64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/* size of file i of w, the same on every run */
+static qint64 file_size(const Workload &w, int i)
+{
+    if (w.min_size == w.max_size)
+        return w.min_size;
+
+    quint64 state = BENCH_SEED ^ ((quint64)i * 0x9E3779B97F4A7C15ULL);
+    double u = (xorshift(&state) >> 11) * (1.0 / 9007199254740992.0);
+    return (qint64)(w.min_size * qPow((double)w.max_size / w.min_size, u));
+}
+
+static QString file_name(const Workload &w, int i)
+{
+    return QString("d%1/f%2").arg(i / w.fanout, 4, 10, QChar('0'))
+            .arg(i, 7, 10, QChar('0'));
+}
+
+/* len pseudo-random bytes at offset of file */
+static bool write_random(QFile *file, qint64 offset, qint64 len,
+                         quint64 *state, QByteArray *block)
+{
+    if (!file->seek(offset))
+        return false;
+
+    while (len > 0) {
+        quint64 *words = reinterpret_cast<quint64 *>(block->data());
+        for (int n = 0; n < GENERATE_BLOCK / 8; n++)
+            words[n] = xorshift(state);
+
+        qint64 chunk = qMin(len, (qint64)GENERATE_BLOCK);
+        if (file->write(block->constData(), chunk) != chunk)
+            return false;
+        len -= chunk;
+    }
+    return true;
+}
+
+/*
+ * A sparse file of size bytes: holes but for a data block at the start,
+ * one across SPARSE_BOUNDARY and one at the end.
+ */
+static bool write_sparse(QFile *file, qint64 size, quint64 *state,
+                         QByteArray *block)
+{
+    if (!file->resize(size))
+        return false;
+
+    qint64 len = qMin(size, (qint64)GENERATE_BLOCK);
+    if (!write_random(file, 0, len, state, block))
+        return false;
+    if (size > SPARSE_BOUNDARY + GENERATE_BLOCK &&
+            !write_random(file, SPARSE_BOUNDARY - GENERATE_BLOCK / 2,
+                          GENERATE_BLOCK, state, block))
+        return false;
+    return write_random(file, size - len, len, state, block);
+}
+
+/*
+ * Write the files of w below root, unless a previous run left exactly
+ * them behind. Contents are pseudo-random so compression does not turn
+ * the run into a memory benchmark.
+ */
+bool Bench::generate(const Workload &w, const QString &root, qint64 *bytes,
+                     QString *error)
+{
+    *bytes = 0;
+    for (int i = 0; i < w.files; i++)
+        *bytes += file_size(w, i);
+
+    QString stamp = QString("%1 %2 %3 %4").arg(w.files).arg(*bytes)
+            .arg(BENCH_SEED).arg(w.mode);
+    QFile marker(root + ".done");
+    if (marker.open(QFile::ReadOnly) && marker.readAll() == stamp.toUtf8())
+        return true;
+    marker.close();
+
+    qDebug() << "Generating " << w.name << ": " << w.files << " files, "
+             << *bytes << " bytes";
+    QDir(root).removeRecursively();
+
+    QByteArray block(GENERATE_BLOCK, 0);
+    for (int i = 0; i < w.files; i++) {
+        QString name = root + "/" + file_name(w, i);
+        QDir().mkpath(QFileInfo(name).absolutePath());
+
+        QFile file(name);
+        if (!file.open(QFile::WriteOnly)) {
+            *error = name + ": " + file.errorString();
+            return false;
+        }
+
+        quint64 state = BENCH_SEED ^ ((quint64)(i + 1) << 32);
+        bool written = w.mode == WORKLOAD_SPARSE ?
+                    write_sparse(&file, file_size(w, i), &state, &block) :
+                    write_random(&file, 0, file_size(w, i), &state, &block);
+        if (!written) {
+            *error = name + ": " + file.errorString();
+            return false;
+        }
+    }
+
+    if (!marker.open(QFile::WriteOnly) || marker.write(stamp.toUtf8()) < 0) {
+        *error = marker.fileName() + ": " + marker.errorString();
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Give every client of a delta workload an old copy of the share: the
+ * files with one delta block in DELTA_CHANGE_EVERY, at a random place
+ * in each run of that many, overwritten, and an older mtime.
+ */
+static bool seed_copies(const Workload &w, const QString &data_root,
+                        const QString &copies_root, QString *error)
+{
+    QByteArray block(GENERATE_BLOCK, 0);
+
+    for (int c = 0; c < w.clients; c++) {
+        for (int i = 0; i < w.files; i++) {
+            QString source = data_root + "/" + file_name(w, i);
+            QString name = QString("%1/client-%2/%3").arg(copies_root).arg(c)
+                    .arg(file_name(w, i));
+            QDir().mkpath(QFileInfo(name).absolutePath());
+            if (!QFile::copy(source, name)) {
+                *error = name + ": copy failed";
+                return false;
+            }
+
+            QFile file(name);
+            if (!file.open(QFile::ReadWrite)) {
+                *error = name + ": " + file.errorString();
+                return false;
+            }
+
+            qint64 size = file.size();
+            qint64 block_size = delta_block_size(size);
+            qint64 run = block_size * DELTA_CHANGE_EVERY;
+            quint64 state = BENCH_SEED ^ ((quint64)(c + 1) << 48) ^
+                    (quint64)(i + 1);
+            for (qint64 start = 0; start < size; start += run) {
+                qint64 blocks = qMin(run, size - start) / block_size;
+                if (blocks == 0)
+                    break;
+                qint64 offset = start +
+                        (qint64)(xorshift(&state) % blocks) * block_size;
+                if (!write_random(&file, offset, block_size, &state,
+                                  &block)) {
+                    *error = name + ": " + file.errorString();
+                    return false;
+                }
+            }
+
+            QDateTime mtime = QFileInfo(source).lastModified().addDays(-1);
+            file.setFileTime(mtime, QFileDevice::FileModificationTime);
+        }
+    }
+    return true;
+}
+
+/*
+ * Compare the copy of every client with the share: same size and the
+ * SHA-256 the index has for the file. Returns the files that differ.
+ */
+static int verify_copies(const Workload &w, DirIndex *index,
+                         const QVector<DirIndex::Entry> &entries,
+                         const QString &copies_root)
+{
+    int bad = 0;
+
+    for (int c = 0; c < w.clients; c++) {
+        QString local_dir = QString("%1/client-%2").arg(copies_root).arg(c);
+        for (int i = 0; i < entries.size(); i++) {
+            const DirIndex::Entry &entry = entries.at(i);
+            if (entry.is_dir)
+                continue;
+
+            QString name = local_dir + "/" + entry.path;
+            QFileInfo copy(name);
+            if (copy.isFile() && copy.size() == entry.size &&
+                    hash_file_prefix(name, entry.size) ==
+                    index->hash(entry.path, entry.size, entry.mtime))
+                continue;
+
+            qDebug() << "Client " << c << ": " << entry.path << " differs";
+            bad++;
+        }
+    }
+    return bad;
+}
+
+/* forget the peak RSS so far, where the kernel allows it */
+static void reset_peak_rss()
+{
+#ifdef Q_OS_LINUX
+    QFile file("/proc/self/clear_refs");
+    if (file.open(QFile::WriteOnly))
+        file.write("5");
+#endif
+}
+
+static qint64 peak_rss_kib()
+{
+#ifdef Q_OS_LINUX
+    QFile file("/proc/self/status");
+    if (file.open(QFile::ReadOnly)) {
+        QList<QByteArray> lines = file.readAll().split('\n');
+        for (int i = 0; i < lines.size(); i++) {
+            if (lines.at(i).startsWith("VmHWM:"))
+                return lines.at(i).mid(6).trimmed().split(' ').at(0)
+                        .toLongLong();
+        }
+    }
+#endif
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+/* user and system CPU seconds of the whole process */
+static void cpu_times(double *user, double *sys)
+{
+    *user = 0;
+    *sys = 0;
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        *user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        *sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    }
+#endif
+}
+
+/* p50, p99 and max of values, which is sorted on return */
+static QJsonObject percentiles(QVector<qint64> *values)
+{
+    QJsonObject result;
+
+    std::sort(values->begin(), values->end());
+    int n = values->size();
+    result["samples"] = n;
+    if (n == 0)
+        return result;
+
+    result["p50"] = (double)values->at(qMin(n - 1, n / 2));
+    result["p99"] = (double)values->at(qMin(n - 1, n * 99 / 100));
+    result["max"] = (double)values->last();
+    return result;
+}
+
+QJsonObject Bench::run(const Workload &w)
+{
+    QJsonObject result;
+    QString error;
+    qint64 bytes;
+
+    result["name"] = w.name;
+    result["files"] = w.files;
+    result["clients"] = w.clients;
+
+    QString data_root = QDir(options.dir).absoluteFilePath("data/" + w.name);
+    QString copies_root = QDir(options.dir).absoluteFilePath("copies/" +
+                                                             w.name);
+    if (!generate(w, data_root, &bytes, &error)) {
+        result["error"] = error;
+        return result;
+    }
+    result["bytes"] = (double)bytes;
+    QDir(copies_root).removeRecursively();
+    if (w.mode == WORKLOAD_DELTA &&
+            !seed_copies(w, data_root, copies_root, &error)) {
+        result["error"] = error;
+        return result;
+    }
+
+    SharedDirs shared_dirs;
+    shared_dirs.insert("bench", data_root);
+
+    /* a long running server has its index built and its hashes cached */
+    QElapsedTimer clock;
+    clock.start();
+    QSharedPointer<DirIndex> index = shared_dirs.index("bench");
+    QVector<DirIndex::Entry> entries;
+    while (!index->snapshot(&entries))
+        QThread::msleep(10);
+    result["index_ms"] = (double)clock.elapsed();
+
+    clock.restart();
+    for (int i = 0; i < entries.size(); i++) {
+        const DirIndex::Entry &entry = entries.at(i);
+        if (!entry.is_dir)
+            index->hash(entry.path, entry.size, entry.mtime);
+    }
+    result["hash_ms"] = (double)clock.elapsed();
+
+    TransferServer *server = new TransferServer(&shared_dirs,
+                                                options.workers);
+    server->set_chunk_size(options.chunk_size);
+    server->set_zero_copy(options.zero_copy);
+    server->set_compression(options.compression);
+    if (!server->listen(QHostAddress::LocalHost, 0)) {
+        result["error"] = server->errorString();
+        delete server;
+        return result;
+    }
+
+    QEventLoop loop;
+    ClientWaiter waiter(w.clients, &loop);
+    QList<QThread *> threads;
+    QList<BenchClient *> clients;
+
+    /* a client that hangs must not hang the run */
+    QTimer watchdog;
+    watchdog.setSingleShot(true);
+    QObject::connect(&watchdog, SIGNAL(timeout()), &loop, SLOT(quit()));
+    watchdog.start(options.timeout * 1000);
+
+    reset_peak_rss();
+    qint64 allocations_start = BufferPool::allocations();
+    double user_start, sys_start;
+    cpu_times(&user_start, &sys_start);
+    clock.restart();
+
+    for (int i = 0; i < w.clients; i++) {
+        QString local_dir = QString("%1/client-%2").arg(copies_root).arg(i);
+        BenchClient *client = new BenchClient(i, "bench", local_dir,
+                                              server->serverPort(),
+                                              options.streams);
+        QThread *thread = new QThread;
+        client->moveToThread(thread);
+        QObject::connect(thread, SIGNAL(started()), client, SLOT(start()));
+        QObject::connect(thread, SIGNAL(finished()),
+                         client, SLOT(deleteLater()));
+        QObject::connect(client, SIGNAL(finished(int)),
+                         &waiter, SLOT(client_finished(int)));
+        clients.append(client);
+        threads.append(thread);
+        thread->start();
+    }
+
+    loop.exec();
+
+    double seconds = clock.nsecsElapsed() / 1e9;
+    double user_end, sys_end;
+    cpu_times(&user_end, &sys_end);
+    qint64 peak_rss = peak_rss_kib();
+    /* server and client buffers, both live in this process */
+    qint64 allocations = BufferPool::allocations() - allocations_start;
+
+    QVector<qint64> latencies;
+    QVector<qint64> completions;
+    int failures = 0;
+    int unfinished = 0;
+    for (int i = 0; i < threads.size(); i++) {
+        /* written before finished() was emitted, not read otherwise */
+        BenchClient *client = clients.at(i);
+        if (!waiter.finished.contains(i)) {
+            qDebug() << "Client " << i << ": no finish after "
+                     << options.timeout << " s";
+            unfinished++;
+            failures++;
+        } else {
+            latencies += client->latencies_us;
+            completions.append(client->elapsed_us);
+            failures += client->failures;
+            if (!client->ok && !client->failures)
+                failures++;
+        }
+
+        threads[i]->quit();
+        threads[i]->wait();
+        delete threads[i];
+    }
+    /* frames, file data and listings, after compression and deltas */
+    qint64 wire_bytes = server->get_stats()->total_bytes_sent();
+    delete server;
+
+    if (w.verify) {
+        int bad = verify_copies(w, index.data(), entries, copies_root);
+        result["verify_failures"] = bad;
+        failures += bad;
+    }
+
+    double total_bytes = (double)bytes * w.clients;
+    double total_files = (double)w.files * w.clients;
+    result["streams"] = options.streams;
+    result["seconds"] = seconds;
+    result["throughput_mib_s"] = total_bytes / MIB / seconds;
+    result["files_per_s"] = total_files / seconds;
+    result["latency_us"] = percentiles(&latencies);
+    result["completion_us"] = percentiles(&completions);
+    result["cpu_user_s"] = user_end - user_start;
+    result["cpu_sys_s"] = sys_end - sys_start;
+    result["peak_rss_kib"] = (double)peak_rss;
+    result["buffer_allocations"] = (double)allocations;
+    result["buffer_allocations_per_gib"] = total_bytes > 0 ?
+                allocations / (total_bytes / GIB) : 0.0;
+    result["wire_bytes"] = (double)wire_bytes;
+    if (w.mode == WORKLOAD_DELTA) {
+        /* what sending the whole files would have cost */
+        result["full_bytes"] = total_bytes;
+        result["wire_ratio"] = total_bytes > 0 ?
+                    wire_bytes / total_bytes : 0.0;
+    }
+    result["unfinished"] = unfinished;
+    result["failures"] = failures;
+
+    if (!options.keep)
+        QDir(copies_root).removeRecursively();
+    return result;
+}
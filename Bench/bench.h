@@ -0,0 +1,101 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <QString>
+#include <QStringList>
+#include <QJsonObject>
+#include <QObject>
+#include <QSet>
+
+class QEventLoop;
+
+/* seed of the generated file contents, runs see the same bytes */
+#define BENCH_SEED      0x46545244
+/* connections of the stress workload, whatever --clients says */
+#define STRESS_CLIENTS  64
+
+/* how the files of a workload are written, see Bench::generate() */
+#define WORKLOAD_DATA       0
+#define WORKLOAD_SPARSE     1
+/* as DATA, the clients start with an old copy, see seed_copies() */
+#define WORKLOAD_DELTA      2
+
+/*
+ * A standard workload: a tree of generated files served as one share
+ * and downloaded by several simulated clients at once.
+ */
+struct Workload
+{
+    QString name;
+    int files;
+    /* sizes are spread log-uniform over [min_size, max_size] */
+    qint64 min_size;
+    qint64 max_size;
+    /* files per directory, the tree is two levels deep */
+    int fanout;
+    int clients;
+    /* compare every copy with the share after the run */
+    bool verify;
+    int mode;
+};
+
+struct BenchOptions
+{
+    BenchOptions();
+
+    /* generated data and the client copies live below dir */
+    QString dir;
+    double scale;
+    int clients;
+    int streams;
+    int workers;
+    int chunk_size;
+    bool zero_copy;
+    bool compression;
+    /* keep the client copies after a run */
+    bool keep;
+    /* seconds a run may take, unfinished clients count as failures */
+    int timeout;
+};
+
+/*
+ * Runs workloads over loopback: a TransferServer on a free port and
+ * one BenchClient thread per simulated client, in this process.
+ */
+class Bench
+{
+public:
+    explicit Bench(const BenchOptions &options);
+
+    /* the standard workloads scaled by options.scale */
+    static QList<Workload> workloads(const BenchOptions &options);
+    /* results of w, or an object with "error" set */
+    QJsonObject run(const Workload &w);
+
+private:
+    BenchOptions options;
+
+    bool generate(const Workload &w, const QString &root, qint64 *bytes,
+                  QString *error);
+};
+
+/* counts the finished clients of a run, ends loop after the last */
+class ClientWaiter : public QObject
+{
+    Q_OBJECT
+
+public:
+    ClientWaiter(int count, QEventLoop *loop);
+
+    /* ids of the clients that finished, the others were cut off */
+    QSet<int> finished;
+
+public slots:
+    void client_finished(int id);
+
+private:
+    int left;
+    QEventLoop *loop;
+};
+
+#endif // BENCH_H
@@ -0,0 +1,123 @@
+#include "benchclient.h"
+#include "clientengine.h"
+#include <QDebug>
+#include <QTimer>
+
+BenchClient::BenchClient(int id, const QString &share,
+                         const QString &local_dir, quint16 port,
+                         int streams) :
+    QObject(0),
+    elapsed_us(0),
+    failures(0),
+    ok(false),
+    id(id),
+    share(share),
+    local_dir(local_dir),
+    port(port),
+    streams(streams),
+    engine(0),
+    probe_timer(0),
+    probe_sent(-1),
+    checked(false),
+    done(false)
+{
+}
+
+/* runs on the client's thread, so everything below lives there */
+void BenchClient::start()
+{
+    engine = new ClientEngine(this);
+    probe_timer = new QTimer(this);
+    probe_timer->setInterval(LATENCY_PROBE_MS);
+
+    connect(engine, SIGNAL(ready()),
+            this, SLOT(handle_ready()));
+    connect(engine, SIGNAL(download_checked(QString,int)),
+            this, SLOT(handle_checked(QString,int)));
+    connect(engine, SIGNAL(idle()),
+            this, SLOT(handle_idle()));
+    connect(engine, SIGNAL(dirs_listed(QStringList)),
+            this, SLOT(handle_dirs(QStringList)));
+    connect(engine, SIGNAL(failed(QString)),
+            this, SLOT(handle_failed(QString)));
+    connect(engine, SIGNAL(closed()),
+            this, SLOT(handle_closed()));
+    connect(probe_timer, SIGNAL(timeout()),
+            this, SLOT(probe()));
+
+    clock.start();
+    engine->set_streams(streams);
+    engine->connect_to("127.0.0.1", port);
+}
+
+void BenchClient::handle_ready()
+{
+    engine->download(share, local_dir);
+    probe_timer->start();
+}
+
+void BenchClient::handle_checked(QString dirname, int requested)
+{
+    Q_UNUSED(dirname);
+    Q_UNUSED(requested);
+
+    checked = true;
+}
+
+void BenchClient::probe()
+{
+    if (probe_sent >= 0)
+        return;
+
+    probe_sent = clock.nsecsElapsed();
+    engine->list_dirs();
+}
+
+void BenchClient::handle_dirs(QStringList names)
+{
+    Q_UNUSED(names);
+
+    if (probe_sent < 0)
+        return;
+
+    latencies_us.append((clock.nsecsElapsed() - probe_sent) / 1000);
+    probe_sent = -1;
+}
+
+void BenchClient::handle_idle()
+{
+    if (!checked)
+        return;
+
+    elapsed_us = clock.nsecsElapsed() / 1000;
+    failures = engine->failed_files();
+    finish(failures == 0);
+}
+
+void BenchClient::handle_failed(QString reason)
+{
+    if (done)
+        return;
+
+    qDebug() << "Client " << id << ": " << reason;
+    finish(false);
+}
+
+void BenchClient::handle_closed()
+{
+    finish(false);
+}
+
+void BenchClient::finish(bool success)
+{
+    if (done)
+        return;
+
+    done = true;
+    ok = success;
+    if (!elapsed_us)
+        elapsed_us = clock.nsecsElapsed() / 1000;
+    probe_timer->stop();
+    engine->close();
+    emit finished(id);
+}
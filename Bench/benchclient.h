@@ -0,0 +1,70 @@
+#ifndef BENCHCLIENT_H
+#define BENCHCLIENT_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QVector>
+
+class QTimer;
+class ClientEngine;
+
+/* interval of the latency probes sent while a download runs */
+#define LATENCY_PROBE_MS    20
+
+/*
+ * One simulated client, run on its own thread: connects, downloads the
+ * whole share into local_dir and meanwhile measures the round trip of
+ * small MSG_TAG_SYNC requests on the same connection.
+ *
+ * The results are read by the owner once finished() was emitted, they
+ * do not change after that.
+ */
+class BenchClient : public QObject
+{
+    Q_OBJECT
+
+public:
+    BenchClient(int id, const QString &share, const QString &local_dir,
+                quint16 port, int streams);
+
+    /* connect to elapsed, microseconds */
+    qint64 elapsed_us;
+    /* request round trips, microseconds */
+    QVector<qint64> latencies_us;
+    int failures;
+    bool ok;
+
+public slots:
+    void start();
+
+signals:
+    void finished(int id);
+
+private slots:
+    void handle_ready();
+    void handle_checked(QString dirname, int requested);
+    void handle_idle();
+    void handle_dirs(QStringList names);
+    void handle_failed(QString reason);
+    void handle_closed();
+    void probe();
+
+private:
+    int id;
+    QString share;
+    QString local_dir;
+    quint16 port;
+    int streams;
+    ClientEngine *engine;
+    QTimer *probe_timer;
+    QElapsedTimer clock;
+    /* nsecsElapsed() of the probe in flight, -1 if none */
+    qint64 probe_sent;
+    bool checked;
+    bool done;
+
+    void finish(bool success);
+};
+
+#endif // BENCHCLIENT_H
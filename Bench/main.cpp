@@ -0,0 +1,142 @@
+#include "bench.h"
+#include "clientengine.h"
+#include "session.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QFile>
+#include <stdio.h>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("filetrans-bench");
+
+    BenchOptions options;
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+                "Loopback benchmark of FileTransDemo, prints JSON.\n\n"
+                "Workloads: large (1 x 10 GiB), small (100k x 4 KiB),\n"
+                "mixed (2000 files of 1 KiB - 16 MiB), concurrent\n"
+                "(1000 x 64 KiB for --clients clients at once), stress\n"
+                "(500 files of 1 - 256 KiB for 64 clients, every copy\n"
+                "compared with the share), sparse (one sparse 5 GiB\n"
+                "file, not scaled, checked across the 4 GiB offset) and\n"
+                "delta (1 GiB, the client holds a copy with 1% of its\n"
+                "blocks changed; reports bytes on the wire).");
+    parser.addHelpOption();
+
+    QCommandLineOption workload_option(QStringList() << "w" << "workload",
+                                       "Run only <name>, may be repeated.",
+                                       "name");
+    QCommandLineOption dir_option(QStringList() << "d" << "dir",
+                                  "Keep generated data below <dir>.",
+                                  "dir", options.dir);
+    QCommandLineOption scale_option(QStringList() << "s" << "scale",
+                                    "Scale file counts and sizes by "
+                                    "<factor>.", "factor", "1.0");
+    QCommandLineOption clients_option(QStringList() << "c" << "clients",
+                                      "Clients of the concurrent workload.",
+                                      "count",
+                                      QString::number(options.clients));
+    QCommandLineOption streams_option(QStringList() << "j" << "streams",
+                                      "Connections per client.", "count",
+                                      QString::number(options.streams));
+    QCommandLineOption workers_option("workers",
+                                      "Server transfer threads, 0 for one "
+                                      "per core.", "count", "0");
+    QCommandLineOption chunk_option("chunk-size",
+                                    "Server read size when not using "
+                                    "sendfile().", "bytes",
+                                    QString::number(options.chunk_size));
+    QCommandLineOption no_zero_copy_option("no-zero-copy",
+                                           "Read file data instead of "
+                                           "using sendfile().");
+    QCommandLineOption no_compression_option("no-compression",
+                                             "Never compress file data.");
+    QCommandLineOption keep_option("keep", "Keep the downloaded copies.");
+    QCommandLineOption timeout_option("timeout",
+                                      "Give up on clients still running "
+                                      "after <seconds>.", "seconds",
+                                      QString::number(options.timeout));
+    QCommandLineOption output_option(QStringList() << "o" << "output",
+                                     "Write the JSON to <file>.", "file");
+    parser.addOption(workload_option);
+    parser.addOption(dir_option);
+    parser.addOption(scale_option);
+    parser.addOption(clients_option);
+    parser.addOption(streams_option);
+    parser.addOption(workers_option);
+    parser.addOption(chunk_option);
+    parser.addOption(no_zero_copy_option);
+    parser.addOption(no_compression_option);
+    parser.addOption(keep_option);
+    parser.addOption(timeout_option);
+    parser.addOption(output_option);
+    parser.process(a);
+
+    bool scale_ok, clients_ok, streams_ok, workers_ok, chunk_ok, timeout_ok;
+    options.dir = parser.value(dir_option);
+    options.scale = parser.value(scale_option).toDouble(&scale_ok);
+    options.clients = parser.value(clients_option).toInt(&clients_ok);
+    options.streams = parser.value(streams_option).toInt(&streams_ok);
+    options.workers = parser.value(workers_option).toInt(&workers_ok);
+    options.chunk_size = parser.value(chunk_option).toInt(&chunk_ok);
+    options.zero_copy = !parser.isSet(no_zero_copy_option);
+    options.compression = !parser.isSet(no_compression_option);
+    options.keep = parser.isSet(keep_option);
+    options.timeout = parser.value(timeout_option).toInt(&timeout_ok);
+    if (!scale_ok || options.scale <= 0 || !clients_ok ||
+            options.clients <= 0 || !streams_ok || options.streams <= 0 ||
+            options.streams > MAX_STREAMS || !workers_ok ||
+            options.workers < 0 || !chunk_ok ||
+            options.chunk_size < MIN_CHUNK_SIZE ||
+            options.chunk_size > MAX_CHUNK_SIZE || !timeout_ok ||
+            options.timeout <= 0)
+        parser.showHelp(1);
+
+    QStringList selected = parser.values(workload_option);
+    QList<Workload> workloads = Bench::workloads(options);
+    Bench bench(options);
+    QJsonArray results;
+    bool ok = true;
+
+    for (int i = 0; i < workloads.size(); i++) {
+        const Workload &w = workloads.at(i);
+        if (!selected.isEmpty() && !selected.contains(w.name))
+            continue;
+
+        QJsonObject result = bench.run(w);
+        if (result.contains("error") || result["failures"].toInt() > 0)
+            ok = false;
+        results.append(result);
+    }
+
+    QJsonObject config;
+    config["scale"] = options.scale;
+    config["streams"] = options.streams;
+    config["workers"] = options.workers;
+    config["chunk_size"] = options.chunk_size;
+    config["zero_copy"] = options.zero_copy;
+    config["compression"] = options.compression;
+
+    QJsonObject report;
+    report["protocol_version"] = PROTOCOL_VERSION;
+    report["config"] = config;
+    report["workloads"] = results;
+
+    QByteArray json = QJsonDocument(report).toJson();
+    if (parser.isSet(output_option)) {
+        QFile file(parser.value(output_option));
+        if (!file.open(QFile::WriteOnly) || file.write(json) != json.size()) {
+            fprintf(stderr, "filetrans-bench: %s\n",
+                    file.errorString().toLocal8Bit().constData());
+            return 1;
+        }
+    } else {
+        fwrite(json.constData(), 1, json.size(), stdout);
+    }
+
+    return ok ? 0 : 1;
+}
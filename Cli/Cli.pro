@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Command line client, no widgets
+#
+#-------------------------------------------------
+
+QT       += core \
+        network
+QT       -= gui
+
+TARGET = filetrans
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+
+SOURCES += main.cpp \
+        cli.cpp
+
+HEADERS  += cli.h
+
+include(../Client/engine.pri)
@@ -0,0 +1,185 @@
+#include "cli.h"
+#include "clientengine.h"
+#include <QCoreApplication>
+#include <QDir>
+#include <stdio.h>
+
+static void print_line(FILE *out, const QString &line)
+{
+    fprintf(out, "%s\n", line.toLocal8Bit().constData());
+    fflush(out);
+}
+
+Cli::Cli(const QString &command, const QStringList &args,
+         const QString &output, int idle_timeout, QObject *parent) :
+    QObject(parent),
+    command(command),
+    args(args),
+    output(output),
+    checking(0),
+    downloading(false),
+    finished(false)
+{
+    engine = new ClientEngine(this);
+
+    idle_timer.setSingleShot(true);
+    idle_timer.setInterval(idle_timeout * 1000);
+
+    connect(engine, SIGNAL(ready()),
+            this, SLOT(handle_ready()));
+    connect(engine, SIGNAL(closed()),
+            this, SLOT(handle_closed()));
+    connect(engine, SIGNAL(failed(QString)),
+            this, SLOT(handle_failed(QString)));
+    connect(engine, SIGNAL(dirs_listed(QStringList)),
+            this, SLOT(handle_dirs(QStringList)));
+    connect(engine, SIGNAL(entries_listed(QString,QStringList)),
+            this, SLOT(handle_entries(QString,QStringList)));
+    connect(engine, SIGNAL(download_checked(QString,int)),
+            this, SLOT(handle_checked(QString,int)));
+    connect(engine, SIGNAL(progress(int)),
+            this, SLOT(handle_progress(int)));
+    connect(engine, SIGNAL(idle()),
+            this, SLOT(handle_idle()));
+    connect(&idle_timer, SIGNAL(timeout()),
+            this, SLOT(handle_timeout()));
+}
+
+bool Cli::is_valid() const
+{
+    if (command == "ls")
+        return args.size() <= 1;
+    if (command == "get")
+        return !args.isEmpty();
+    if (command == "sync")
+        return args.isEmpty();
+    return false;
+}
+
+void Cli::start(const QString &address, quint16 port, int streams)
+{
+    engine->set_streams(streams);
+    engine->connect_to(address, port);
+}
+
+void Cli::handle_ready()
+{
+    /* a listing that never comes back times out like a download */
+    idle_timer.start();
+    if (command == "ls" && args.size() == 1) {
+        engine->list_entries(args.at(0));
+    } else if (command == "get") {
+        QString local_dir = output.isEmpty() ?
+                    QDir::current().absoluteFilePath(args.at(0)) : output;
+        download(args.at(0), local_dir, args.mid(1));
+    } else {
+        /* ls and sync both start from the shared directories */
+        engine->list_dirs();
+    }
+}
+
+void Cli::download(const QString &dirname, const QString &local_dir,
+                   const QStringList &paths)
+{
+    downloading = true;
+    checking++;
+    idle_timer.start();
+    engine->download(dirname, local_dir, paths);
+}
+
+void Cli::handle_dirs(QStringList names)
+{
+    if (command == "ls") {
+        for (int i = 0; i < names.size(); i++)
+            print_line(stdout, names.at(i));
+        finish(0);
+        return;
+    }
+
+    /* sync */
+    QDir root(output.isEmpty() ? QDir::currentPath() : output);
+    for (int i = 0; i < names.size(); i++)
+        download(names.at(i), root.absoluteFilePath(names.at(i)),
+                 QStringList());
+    if (names.isEmpty())
+        finish(0);
+}
+
+void Cli::handle_entries(QString dirname, QStringList entries)
+{
+    Q_UNUSED(dirname);
+
+    for (int i = 0; i < entries.size(); i++)
+        print_line(stdout, entries.at(i));
+    finish(0);
+}
+
+void Cli::handle_checked(QString dirname, int requested)
+{
+    print_line(stdout, tr("%1: %2 files to fetch").arg(dirname)
+               .arg(requested));
+    checking--;
+    idle_timer.start();
+}
+
+void Cli::handle_progress(int pending)
+{
+    Q_UNUSED(pending);
+
+    if (downloading)
+        idle_timer.start();
+}
+
+void Cli::handle_idle()
+{
+    if (!downloading || checking > 0)
+        return;
+
+    int failures = engine->failed_files();
+    if (failures > 0) {
+        print_line(stderr, tr("%1 files failed").arg(failures));
+        finish(1);
+        return;
+    }
+    finish(0);
+}
+
+void Cli::handle_timeout()
+{
+    if (!downloading)
+        print_line(stderr, tr("no answer for %1 s")
+                   .arg(idle_timer.interval() / 1000));
+    else
+        print_line(stderr, tr("no progress for %1 s, %2 files missing")
+                   .arg(idle_timer.interval() / 1000)
+                   .arg(engine->pending_files()));
+    finish(1);
+}
+
+void Cli::handle_failed(QString reason)
+{
+    if (finished)
+        return;
+
+    print_line(stderr, reason);
+    finish(1);
+}
+
+void Cli::handle_closed()
+{
+    if (finished)
+        return;
+
+    print_line(stderr, tr("Connection closed"));
+    finish(1);
+}
+
+void Cli::finish(int code)
+{
+    if (finished)
+        return;
+
+    finished = true;
+    idle_timer.stop();
+    QCoreApplication::exit(code);
+}
@@ -0,0 +1,62 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <QObject>
+#include <QStringList>
+#include <QTimer>
+
+class ClientEngine;
+
+/* seconds without a received file before a download gives up */
+#define DEFAULT_IDLE_TIMEOUT    60
+
+/*
+ * One command of the command line client, run over a ClientEngine:
+ *
+ *   ls                 shared directories
+ *   ls <dir>           files of a shared directory
+ *   get <dir> [path..] update <output>/ from dir, or only the paths
+ *   sync               update <output>/<dir> from every shared dir
+ *
+ * The application exits with 0 once the command is done, 1 on error.
+ */
+class Cli : public QObject
+{
+    Q_OBJECT
+
+public:
+    Cli(const QString &command, const QStringList &args,
+        const QString &output, int idle_timeout, QObject *parent = 0);
+
+    /* false when command and args do not make a valid command */
+    bool is_valid() const;
+    void start(const QString &address, quint16 port, int streams);
+
+private slots:
+    void handle_ready();
+    void handle_closed();
+    void handle_failed(QString reason);
+    void handle_dirs(QStringList names);
+    void handle_entries(QString dirname, QStringList entries);
+    void handle_checked(QString dirname, int requested);
+    void handle_progress(int pending);
+    void handle_idle();
+    void handle_timeout();
+
+private:
+    ClientEngine *engine;
+    QString command;
+    QStringList args;
+    QString output;
+    QTimer idle_timer;
+    /* manifests not compared yet */
+    int checking;
+    bool downloading;
+    bool finished;
+
+    void download(const QString &dirname, const QString &local_dir,
+                  const QStringList &paths);
+    void finish(int code);
+};
+
+#endif // CLI_H
@@ -0,0 +1,62 @@
+#include "cli.h"
+#include "clientengine.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("filetrans");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+                "Command line client of FileTransDemo.\n\n"
+                "  ls                   list the shared directories\n"
+                "  ls <dir>             list the files of a shared directory\n"
+                "  get <dir> [path...]  update ./<dir> from the server\n"
+                "  sync                 update every shared directory");
+    parser.addHelpOption();
+    parser.addPositionalArgument("command", "ls, get or sync");
+    parser.addPositionalArgument("args", "Arguments of the command",
+                                 "[args...]");
+
+    QCommandLineOption server_option(QStringList() << "s" << "server",
+                                     "Server <address>.", "address",
+                                     "127.0.0.1");
+    QCommandLineOption port_option(QStringList() << "p" << "port",
+                                   "Server <port>.", "port",
+                                   QString::number(LISTEN_PORT));
+    QCommandLineOption streams_option(QStringList() << "j" << "streams",
+                                      "Connections per download.", "count",
+                                      QString::number(DEFAULT_STREAMS));
+    QCommandLineOption output_option(QStringList() << "o" << "output",
+                                     "Download into <dir> instead of ./",
+                                     "dir");
+    QCommandLineOption timeout_option(QStringList() << "t" << "timeout",
+                                      "Give up after <seconds> without "
+                                      "progress.", "seconds",
+                                      QString::number(DEFAULT_IDLE_TIMEOUT));
+    parser.addOption(server_option);
+    parser.addOption(port_option);
+    parser.addOption(streams_option);
+    parser.addOption(output_option);
+    parser.addOption(timeout_option);
+    parser.process(a);
+
+    QStringList args = parser.positionalArguments();
+    bool port_ok, streams_ok, timeout_ok;
+    uint port = parser.value(port_option).toUInt(&port_ok);
+    int streams = parser.value(streams_option).toInt(&streams_ok);
+    int timeout = parser.value(timeout_option).toInt(&timeout_ok);
+    if (args.isEmpty() || !port_ok || port == 0 || port > 65535 ||
+            !streams_ok || !timeout_ok || timeout <= 0)
+        parser.showHelp(1);
+
+    Cli cli(args.at(0), args.mid(1), parser.value(output_option), timeout);
+    if (!cli.is_valid())
+        parser.showHelp(1);
+
+    cli.start(parser.value(server_option), port, streams);
+
+    return a.exec();
+}
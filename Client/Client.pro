@@ -19,3 +19,5 @@ SOURCES += main.cpp\
 HEADERS  += client.h
 
 FORMS    += client.ui
+
+include(engine.pri)
@@ -0,0 +1,717 @@
+#include "clientengine.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QTcpSocket>
+#include <QUuid>
+#include "delta.h"
+#include "compress.h"
+#include "wire.h"
+#include "downloadstream.h"
+
+ClientEngine::ClientEngine(QObject *parent) :
+    QObject(parent),
+    stream_count(DEFAULT_STREAMS),
+    totalsize(0),
+    tag(0),
+    request_id(0),
+    read_status(STATUS_READ_PREFACE),
+    receiver(&downloads),
+    next_request_id(1),
+    files_requested(0),
+    deltas_done(0),
+    deltas_failed(0),
+    delta_decoder(0),
+    delta_basis(0),
+    delta_target(0),
+    delta_ok(false)
+{
+    client_socket = new QTcpSocket(this);
+    client_socket->abort();
+
+    checker = new LocalChecker(this);
+    connect(checker, SIGNAL(checked(QSharedPointer<LocalCheck>)),
+            this, SLOT(handle_checked(QSharedPointer<LocalCheck>)));
+
+    connect(client_socket, SIGNAL(connected()),
+            this, SLOT(socket_connected()));
+    connect(client_socket, SIGNAL(disconnected()),
+            this, SLOT(handle_disconnect()));
+    connect(client_socket, SIGNAL(readyRead()),
+            this, SLOT(handle_msg()));
+    connect(client_socket, SIGNAL(error(QAbstractSocket::SocketError)),
+            this, SLOT(handle_socket_error()));
+}
+
+ClientEngine::~ClientEngine()
+{
+    close_streams();
+    close_delta();
+}
+
+void ClientEngine::set_streams(int count)
+{
+    stream_count = qBound(1, count, MAX_STREAMS);
+}
+
+void ClientEngine::connect_to(const QString &address, quint16 port)
+{
+    client_socket->connectToHost(address, port);
+}
+
+void ClientEngine::close()
+{
+    client_socket->close();
+}
+
+void ClientEngine::socket_connected()
+{
+    read_status = STATUS_READ_PREFACE;
+    emit connected();
+
+    /* requests are enabled once the server accepted our version */
+    client_socket->write(make_preface(compress_features()));
+}
+
+void ClientEngine::handle_disconnect()
+{
+    close_streams();
+    downloads.abort_all();
+    close_delta();
+    requests.clear();
+    files_requested = 0;
+    deltas_done = 0;
+    deltas_failed = 0;
+    emit closed();
+}
+
+void ClientEngine::handle_socket_error()
+{
+    emit failed(client_socket->errorString());
+}
+
+void ClientEngine::handle_msg()
+{
+    read_frames();
+    check_pending();
+}
+
+void ClientEngine::read_frames()
+{
+    QTcpSocket *socket = client_socket;
+
+    do {
+        switch (read_status) {
+        case STATUS_READ_PREFACE:
+            if (!handle_preface())
+                return;
+            break;
+        case STATUS_NONE:
+            /* wait for frame header */
+            if (!read_frame_header(socket, &tag, &totalsize, &request_id))
+                return;
+            if (totalsize < 0) {
+                qDebug() << tr("IO Error");
+                socket->abort();
+                return;
+            }
+            read_status = STATUS_READ_TAG;
+            break;
+        case STATUS_READ_TAG:
+            switch ((int)(tag))
+            {
+            case MSG_TAG_LIST:
+                /* wait for msg ready */
+                if (socket->bytesAvailable() < totalsize)
+                    return;
+                handle_msg_list(socket->read(totalsize));
+                read_status = STATUS_NONE;
+                break;
+            case MSG_TAG_ENTRY:
+                /* wait for msg ready */
+                if (socket->bytesAvailable() < totalsize)
+                    return;
+                handle_entry(socket->read(totalsize));
+                read_status = STATUS_NONE;
+                break;
+            case MSG_TAG_MANIFEST:
+                /* wait for msg ready */
+                if (socket->bytesAvailable() < totalsize)
+                    return;
+                handle_manifest(socket->read(totalsize));
+                read_status = STATUS_NONE;
+                break;
+            case MSG_TAG_DELTA:
+                /* wait for msg ready */
+                if (socket->bytesAvailable() < totalsize)
+                    return;
+                handle_delta(socket->read(totalsize));
+                read_status = STATUS_NONE;
+                break;
+            case MSG_TAG_BATCH:
+                /* wait for msg ready */
+                if (socket->bytesAvailable() < totalsize)
+                    return;
+                if (!downloads.store_batch(request_id,
+                                           socket->read(totalsize)))
+                    qDebug() << "Bad batch";
+                read_status = STATUS_NONE;
+                break;
+            case MSG_TAG_COPY:
+                /* wait for msg ready */
+                if (socket->bytesAvailable() < totalsize)
+                    return;
+                if (!downloads.store_copy(request_id,
+                                          socket->read(totalsize)))
+                    qDebug() << "Bad copy";
+                read_status = STATUS_NONE;
+                break;
+            case MSG_TAG_ERROR:
+                /* wait for msg ready */
+                if (socket->bytesAvailable() < totalsize)
+                    return;
+                handle_error(socket->read(totalsize));
+                read_status = STATUS_NONE;
+                break;
+            case MSG_TAG_CHECKSUM:
+                /* wait for msg ready */
+                if (socket->bytesAvailable() < totalsize)
+                    return;
+                receiver.check(socket->read(totalsize));
+                read_status = STATUS_NONE;
+                break;
+            case MSG_TAG_FILE:
+            case MSG_TAG_RANGE:
+            case MSG_TAG_ZRANGE:
+                receiver.start(tag, totalsize, request_id);
+                read_status = STATUS_READ_FILE;
+                break;
+            default:
+                qDebug() << tr("IO Error");
+                socket->abort();
+                return;
+            }
+            break;
+        case STATUS_READ_FILE:
+            switch (receiver.read(socket)) {
+            case 0:
+                return;
+            case 1:
+                read_status = STATUS_NONE;
+                break;
+            default:
+                qDebug() << tr("IO Error");
+                socket->abort();
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+    } while (read_status != STATUS_NONE || socket->bytesAvailable());
+
+    totalsize = 0;
+    tag = 0;
+    request_id = 0;
+}
+
+bool ClientEngine::handle_preface()
+{
+    quint32 magic, version, features;
+
+    if (!read_preface(client_socket, &magic, &version, &features))
+        return false;
+
+    if (magic != PROTOCOL_MAGIC || version != PROTOCOL_VERSION) {
+        emit failed(tr("Server version mismatch"));
+        client_socket->abort();
+        return false;
+    }
+
+    read_status = STATUS_NONE;
+
+    open_streams();
+    emit ready();
+    return true;
+}
+
+int ClientEngine::pending_files() const
+{
+    return qMax(0, files_requested - downloads.settled_files() -
+                deltas_done);
+}
+
+/* after every read on any of the connections */
+void ClientEngine::check_pending()
+{
+    int pending = pending_files();
+    emit progress(pending);
+
+    if (pending == 0 && requests.isEmpty() &&
+            client_socket->state() == QAbstractSocket::ConnectedState)
+        emit idle();
+}
+
+/*
+ * Join this connection and stream_count - 1 more into one server
+ * side stream group, the server spreads the files we request here
+ * over all of them.
+ */
+void ClientEngine::open_streams()
+{
+    if (stream_count <= 1)
+        return;
+
+    QByteArray token = QUuid::createUuid().toRfc4122();
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_short_bytes(token);
+
+    client_socket->write(make_frame(MSG_TAG_JOIN, block));
+
+    for (int i = 1; i < stream_count; i++) {
+        DownloadStream *stream = new DownloadStream(&downloads, token, this);
+        connect(stream, SIGNAL(received()), this, SLOT(check_pending()));
+        connect(stream, SIGNAL(lost()), this, SLOT(stream_lost()));
+        stream->connect_to(client_socket->peerName(),
+                           client_socket->peerPort());
+        streams.append(stream);
+    }
+}
+
+/*
+ * An extra stream is gone. The server sends what it had not sent on it
+ * over this connection and the streams left; the files it cut off were
+ * given up on.
+ */
+void ClientEngine::stream_lost()
+{
+    DownloadStream *stream = qobject_cast<DownloadStream *>(sender());
+    if (!streams.removeOne(stream))
+        return;
+
+    qDebug() << "Stream lost, " << streams.size() + 1 << " left";
+    stream->deleteLater();
+    check_pending();
+}
+
+void ClientEngine::close_streams()
+{
+    qDeleteAll(streams);
+    streams.clear();
+}
+
+void ClientEngine::close_delta()
+{
+    delete delta_decoder;
+    delta_decoder = 0;
+    delete delta_basis;
+    delta_basis = 0;
+    delete delta_target;
+    delta_target = 0;
+}
+
+/* write a request frame, its responses carry the returned id */
+quint32 ClientEngine::send_request(qint32 tag, const QByteArray &body)
+{
+    quint32 id = next_request_id++;
+    if (next_request_id == 0)
+        next_request_id = 1;
+
+    client_socket->write(make_frame(tag, body, id));
+    return id;
+}
+
+void ClientEngine::list_dirs()
+{
+    Request request;
+    request.tag = MSG_TAG_SYNC;
+
+    requests.insert(send_request(MSG_TAG_SYNC, QByteArray()), request);
+}
+
+/* Body layout: Count(quint32) + Count * Name, see wire.h */
+void ClientEngine::handle_msg_list(const QByteArray &body)
+{
+    if (!requests.remove(request_id))
+        return;
+
+    WireReader in(body);
+    QStringList names;
+
+    quint32 count = in.get_u32();
+    for (quint32 n = 0; n < count; n++) {
+        QString name = in.get_name();
+        if (!in.is_ok())
+            break;
+        names.append(name);
+    }
+
+    emit dirs_listed(names);
+}
+
+void ClientEngine::list_entries(const QString &dirname)
+{
+    Request request;
+    request.tag = MSG_TAG_ENTRY;
+    request.dirname = dirname;
+
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_name(request.dirname);
+
+    requests.insert(send_request(MSG_TAG_ENTRY, block), request);
+}
+
+/*
+ * Body layout: DirName + Last(quint8) + Count(quint32) +
+ *              Count * (IsDir(quint8) + Path), see wire.h
+ * A listing arrives in batches, it is reported after the last one.
+ */
+void ClientEngine::handle_entry(const QByteArray &body)
+{
+    QHash<quint32, Request>::iterator it = requests.find(request_id);
+    if (it == requests.end() || it->tag != MSG_TAG_ENTRY)
+        return;
+
+    WireReader in(body);
+
+    in.get_name();
+    quint8 last = in.get_u8();
+    quint32 count = in.get_u32();
+    for (quint32 i = 0; i < count && in.is_ok(); i++) {
+        bool is_dir = in.get_u8();
+        QString path = in.get_name();
+        if (in.is_ok())
+            it->entries.append(is_dir ? path + "/" : path);
+    }
+    if (!last)
+        return;
+
+    Request request = *it;
+    requests.erase(it);
+    emit entries_listed(request.dirname, request.entries);
+}
+
+/*
+ * Body layout: FileName + Reason, see protocol.h
+ * A failed listing or manifest is reported through failed(), a delta
+ * the server can't make is fetched whole, a file is given up on.
+ */
+void ClientEngine::handle_error(const QByteArray &body)
+{
+    QHash<quint32, Request>::iterator it = requests.find(request_id);
+    if (it == requests.end()) {
+        if (!downloads.store_error(request_id, body))
+            qDebug() << "Bad error frame";
+        return;
+    }
+
+    WireReader in(body);
+
+    QString name = in.get_name();
+    QString reason = in.get_name();
+
+    Request request = *it;
+    requests.erase(it);
+
+    if (request.tag == MSG_TAG_DELTA) {
+        deltas_done++;
+        if (in.is_ok() && is_safe_path(name)) {
+            LocalFile file;
+            file.name = name;
+            file.hash = request.hash;
+            request_files(request, QList<LocalFile>() << file);
+        }
+        return;
+    }
+
+    emit failed(tr("%1: %2").arg(request.dirname, reason));
+}
+
+void ClientEngine::download(const QString &dirname, const QString &local_dir,
+                            const QStringList &paths)
+{
+    Request request;
+    request.tag = MSG_TAG_MANIFEST;
+    request.dirname = dirname;
+    request.local_dir = QDir(local_dir).absolutePath();
+    for (int i = 0; i < paths.size(); i++)
+        request.paths.append(QDir::cleanPath(paths.at(i)));
+    QDir().mkpath(request.local_dir);
+
+    QByteArray block;
+    WireWriter out(&block);
+
+    /* ask what the server has first, handle_manifest() picks the files */
+    out.put_name(request.dirname);
+
+    requests.insert(send_request(MSG_TAG_MANIFEST, block), request);
+}
+
+/* name is one of paths or below one of them */
+static bool is_selected(const QStringList &paths, const QString &name)
+{
+    if (paths.isEmpty())
+        return true;
+
+    for (int i = 0; i < paths.size(); i++) {
+        const QString &path = paths.at(i);
+        if (name == path || (name.startsWith(path) &&
+                             name.at(path.size()) == '/'))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Compare the server's manifest with the local copy and request only
+ * the files that are missing or differ. The local files are read on
+ * the LocalChecker threads, handle_checked() sends the requests.
+ */
+void ClientEngine::handle_manifest(const QByteArray &body)
+{
+    QHash<quint32, Request>::iterator it = requests.find(request_id);
+    if (it == requests.end() || it->tag != MSG_TAG_MANIFEST)
+        return;
+
+    WireReader in(body);
+    QSharedPointer<LocalCheck> check(new LocalCheck);
+    check->request_id = request_id;
+    check->local_dir = it->local_dir;
+
+    in.get_name();
+    quint8 last = in.get_u8();
+    quint32 count = in.get_u32();
+    for (quint32 i = 0; i < count && in.is_ok(); i++) {
+        LocalFile file;
+        file.name = in.get_name();
+        file.size = in.get_u64();
+        file.mtime = in.get_u64();
+        file.hash = in.get_short_bytes();
+        if (in.is_ok() && is_safe_path(file.name) &&
+                is_selected(it->paths, file.name))
+            check->files.append(file);
+    }
+
+    /* the manifest comes in batches, each one is checked on its own */
+    if (!check->files.isEmpty()) {
+        it->checks++;
+        checker->submit(check);
+    }
+    if (!last)
+        return;
+
+    it->listed = true;
+    if (it->checks > 0)
+        return;
+
+    Request request = *it;
+    requests.erase(it);
+    emit download_checked(request.dirname, request.requested);
+}
+
+/* a manifest batch is checked, ask for what the local copy lacks */
+void ClientEngine::handle_checked(QSharedPointer<LocalCheck> check)
+{
+    /* dropped meanwhile, by a disconnect */
+    QHash<quint32, Request>::iterator it = requests.find(check->request_id);
+    if (it == requests.end() || it->tag != MSG_TAG_MANIFEST)
+        return;
+
+    QList<LocalFile> wanted;
+    QList<LocalFile> deltas;
+    for (int i = 0; i < check->files.size(); i++) {
+        const LocalFile &file = check->files.at(i);
+        if (file.state == LOCAL_CURRENT)
+            downloads.hold(file.hash, QFileInfo(check->local_dir + "/" +
+                                                file.name).absoluteFilePath());
+        else if (file.state == LOCAL_DELTA)
+            deltas.append(file);
+        else
+            wanted.append(file);
+    }
+
+    it->checks--;
+    it->requested += wanted.size() + deltas.size();
+    /* sending inserts into requests, it is not valid after that */
+    Request request = *it;
+    if (request.listed && request.checks == 0)
+        requests.erase(it);
+
+    for (int i = 0; i < deltas.size(); i++)
+        get_files_delta(request, deltas.at(i));
+    if (!wanted.isEmpty())
+        request_files(request, wanted);
+
+    if (request.listed && request.checks == 0)
+        emit download_checked(request.dirname, request.requested);
+    /* there may be nothing left to wait for */
+    check_pending();
+}
+
+/*
+ * Request body: DirName + WantCount(quint32) + WantCount * Path +
+ *     PartCount(quint32) + PartCount * (Path + Size(quint64) +
+ *                                       SHA-256(short bytes)) +
+ *     HaveCount(quint32) + HaveCount * SHA-256(short bytes)
+ * in the encoding of wire.h.
+ * The file frames of the response are written under request.local_dir.
+ * The partial downloads LocalChecker hashed are offered for resume. The
+ * contents the manifest announced, where known, that are already held
+ * here are reported, so the server can answer with a MSG_TAG_COPY
+ * instead of the data.
+ */
+void ClientEngine::request_files(const Request &request,
+                                 const QList<LocalFile> &wanted)
+{
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_name(request.dirname);
+    out.put_u32(wanted.size());
+    for (int i = 0; i < wanted.size(); i++)
+        out.put_name(wanted.at(i).name);
+
+    quint32 parts = 0;
+    for (int i = 0; i < wanted.size(); i++) {
+        if (wanted.at(i).part_size > 0)
+            parts++;
+    }
+
+    out.put_u32(parts);
+    for (int i = 0; i < wanted.size(); i++) {
+        const LocalFile &file = wanted.at(i);
+        if (file.part_size <= 0)
+            continue;
+
+        out.put_name(file.name);
+        out.put_u64(file.part_size);
+        out.put_short_bytes(file.part_hash);
+    }
+
+    QList<QByteArray> have;
+    for (int i = 0; i < wanted.size(); i++) {
+        const QByteArray &hash = wanted.at(i).hash;
+        if (hash.isEmpty())
+            continue;
+        downloads.expect(request.local_dir + "/" + wanted.at(i).name, hash);
+        if (downloads.holds(hash) && !have.contains(hash))
+            have.append(hash);
+    }
+
+    out.put_u32(have.size());
+    for (int i = 0; i < have.size(); i++)
+        out.put_short_bytes(have.at(i));
+
+    downloads.add_request(send_request(MSG_TAG_FILE, block),
+                          request.local_dir);
+    files_requested += wanted.size();
+}
+
+/*
+ * Request body: DirName + FileName + Signature(long bytes)
+ * file is LOCAL_DELTA, signed by LocalChecker.
+ */
+void ClientEngine::get_files_delta(const Request &manifest,
+                                   const LocalFile &file)
+{
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_name(manifest.dirname);
+    out.put_name(file.name);
+    out.put_long_bytes(file.signature);
+
+    Request request;
+    request.tag = MSG_TAG_DELTA;
+    request.dirname = manifest.dirname;
+    request.local_dir = manifest.local_dir;
+    request.hash = file.hash;
+    requests.insert(send_request(MSG_TAG_DELTA, block), request);
+    files_requested++;
+}
+
+/*
+ * Body layout: MetaSize(quint32) + Meta + Ops
+ * Meta: FileName + FileSize(quint64) + MTime(quint64 ms) +
+ *       BlockSize(quint32) + Last(quint8)
+ *
+ * The new file is rebuilt next to the old one and renamed over it once
+ * the last frame is in and the result has the SHA-256 the manifest
+ * announced. On any error the whole file is requested, a frame that
+ * can't be read fails the file.
+ * The server streams one delta at a time, so frames of different
+ * deltas never interleave.
+ */
+void ClientEngine::handle_delta(const QByteArray &body)
+{
+    QHash<quint32, Request>::iterator it = requests.find(request_id);
+    if (it == requests.end() || it->tag != MSG_TAG_DELTA)
+        return;
+
+    WireReader in(body);
+
+    qint64 meta_size = in.get_u32();
+    QString name = in.get_name();
+    qint64 file_size = in.get_u64();
+    qint64 mtime = in.get_u64();
+    int block_size = in.get_u32();
+    bool last = in.get_u8();
+    if (!in.is_ok() || !is_safe_path(name) || file_size < 0 ||
+            meta_size > body.size() - (qint64)sizeof(quint32)) {
+        /* no name to fall back to: the file failed, the rest is dropped */
+        qDebug() << "Bad delta frame";
+        close_delta();
+        requests.erase(it);
+        deltas_done++;
+        deltas_failed++;
+        return;
+    }
+
+    QString final_name = it->local_dir + "/" + name;
+    QString delta_name = it->local_dir + "/" + name + DELTA_SUFFIX;
+
+    if (!delta_decoder) {
+        delta_basis = new QFile(final_name);
+        delta_target = new QFile(delta_name);
+        delta_ok = delta_basis->open(QFile::ReadOnly) &&
+                delta_target->open(QFile::WriteOnly);
+        if (delta_ok)
+            Downloads::preallocate(delta_target, 0, file_size);
+        delta_decoder = new DeltaDecoder(delta_basis, delta_target, block_size);
+    }
+
+    if (delta_ok)
+        delta_ok = delta_decoder->apply(body.mid(sizeof(qint32) + meta_size));
+    if (!last)
+        return;
+
+    Request request = *it;
+    requests.erase(it);
+    deltas_done++;
+
+    bool ok = delta_ok && delta_decoder->written() == file_size &&
+            delta_decoder->result() == request.hash &&
+            Downloads::sync_file(delta_target);
+    if (ok)
+        delta_target->setFileTime(QDateTime::fromMSecsSinceEpoch(mtime),
+                                  QFileDevice::FileModificationTime);
+    close_delta();
+
+    if (ok && Downloads::replace_file(delta_name, final_name))
+        return;
+
+    qDebug() << "Delta Error " << name;
+    QFile::remove(delta_name);
+
+    /* fall back to the whole file */
+    LocalFile file;
+    file.name = name;
+    file.hash = request.hash;
+    request_files(request, QList<LocalFile>() << file);
+}
@@ -0,0 +1,166 @@
+#ifndef CLIENTENGINE_H
+#define CLIENTENGINE_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QStringList>
+#include "protocol.h"
+#include "downloads.h"
+#include "localcheck.h"
+
+class QFile;
+class QTcpSocket;
+class DeltaDecoder;
+class DownloadStream;
+
+/* handle msg status */
+#define STATUS_READ_PREFACE         0
+#define STATUS_NONE                 1
+#define STATUS_READ_TAG             3
+#define STATUS_READ_FILE            7
+
+/* connections per download, including the main one */
+#define DEFAULT_STREAMS     4
+#define MAX_STREAMS         16
+
+/* suffix of files being rebuilt from a delta */
+#define DELTA_SUFFIX    ".delta"
+
+/*
+ * Client side of the protocol, without any widgets: the connection,
+ * its extra download streams, the requests in flight and the files
+ * being received. The Client window and the command line client are
+ * both thin shells that call the request methods and show what the
+ * signals report.
+ */
+class ClientEngine : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ClientEngine(QObject *parent = 0);
+    ~ClientEngine();
+
+    /* connections per download, takes effect on the next connect */
+    void set_streams(int count);
+    void connect_to(const QString &address, quint16 port = LISTEN_PORT);
+    void close();
+
+    /* answered by dirs_listed() */
+    void list_dirs();
+    /* answered by entries_listed() */
+    void list_entries(const QString &dirname);
+    /*
+     * Bring local_dir up to date with the shared directory dirname,
+     * limited to paths and the trees below them when paths is not
+     * empty. download_checked() tells how many files are on the way.
+     */
+    void download(const QString &dirname, const QString &local_dir,
+                  const QStringList &paths = QStringList());
+
+    /* files requested and neither stored nor given up on yet */
+    int pending_files() const;
+    int failed_files() const
+    {
+        return downloads.failed_files() + deltas_failed;
+    }
+
+signals:
+    void connected();
+    /* the server accepted our version, requests may be sent */
+    void ready();
+    void closed();
+    void failed(QString reason);
+    void dirs_listed(QStringList names);
+    void entries_listed(QString dirname, QStringList entries);
+    void download_checked(QString dirname, int requested);
+    /* data came in, pending files are left */
+    void progress(int pending);
+    /* no request is waiting for an answer and no file is pending */
+    void idle();
+
+private slots:
+    void socket_connected();
+    void handle_disconnect();
+    void handle_socket_error();
+    void handle_msg();
+    void check_pending();
+    void stream_lost();
+    void handle_checked(QSharedPointer<LocalCheck> check);
+
+private:
+    /*
+     * request waiting for its response, by request id; responses may
+     * come in several frames and for many requests at once
+     */
+    struct Request
+    {
+        Request() : tag(0), requested(0), checks(0), listed(false) {}
+
+        qint32 tag;
+        QString dirname;
+        /* local copy of dirname */
+        QString local_dir;
+        /* MSG_TAG_MANIFEST: only these paths, all when empty */
+        QStringList paths;
+        /* MSG_TAG_MANIFEST: files requested so far */
+        int requested;
+        /* MSG_TAG_MANIFEST: batches with the LocalChecker */
+        int checks;
+        /* MSG_TAG_MANIFEST: the last batch is in */
+        bool listed;
+        /* MSG_TAG_DELTA: SHA-256 of the file the manifest announced */
+        QByteArray hash;
+        /* MSG_TAG_ENTRY: listing received so far */
+        QStringList entries;
+    };
+
+    QTcpSocket *client_socket;
+    int stream_count;
+
+    qint64 totalsize;   // body size of current frame
+    qint32 tag;    // recv msg tag
+    quint32 request_id;    // recv msg request id
+
+    int read_status;
+
+    /* manifest batches compared with the local copies */
+    LocalChecker *checker;
+    /* files being received, on this and the extra streams */
+    Downloads downloads;
+    FileReceiver receiver;
+    /* extra connections joined to this one, see open_streams() */
+    QList<DownloadStream *> streams;
+    QHash<quint32, Request> requests;
+    quint32 next_request_id;
+    /* files asked for since connecting, see pending_files() */
+    int files_requested;
+    /* deltas applied or turned into a whole file request */
+    int deltas_done;
+    /* deltas given up on, their frames could not be read */
+    int deltas_failed;
+
+    /* delta being applied, see handle_delta() */
+    DeltaDecoder *delta_decoder;
+    QFile *delta_basis;
+    QFile *delta_target;
+    bool delta_ok;
+
+    void read_frames();
+    bool handle_preface();
+    void open_streams();
+    void close_streams();
+    quint32 send_request(qint32 tag, const QByteArray &body);
+    void request_files(const Request &request,
+                       const QList<LocalFile> &wanted);
+    void handle_msg_list(const QByteArray &body);
+    void handle_manifest(const QByteArray &body);
+    void get_files_delta(const Request &request, const LocalFile &file);
+    void handle_delta(const QByteArray &body);
+    void close_delta();
+    void handle_entry(const QByteArray &body);
+    void handle_error(const QByteArray &body);
+};
+
+#endif // CLIENTENGINE_H
@@ -0,0 +1,805 @@
+#include "downloads.h"
+#include "protocol.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "wire.h"
+#include <QDebug>
+#include <QAbstractSocket>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QSet>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#endif
+
+Downloads::Downloads() :
+    recv_pool(new BufferPool(RECV_BLOCK_SIZE)),
+    settled(0),
+    failures(0)
+{
+}
+
+Downloads::~Downloads()
+{
+    abort_all();
+}
+
+void Downloads::add_request(quint32 request_id, const QString &dir)
+{
+    request_dirs.insert(request_id, dir);
+}
+
+/*
+ * The prefix before start is what the server agreed to resume from,
+ * everything after it is truncated away.
+ */
+bool Downloads::begin(quint32 request_id, const QString &name, qint64 size,
+                      qint64 mtime, qint64 start, QString *path)
+{
+    /* names come from the server, keep them inside the request's dir */
+    QHash<quint32, QString>::const_iterator dir =
+            request_dirs.constFind(request_id);
+    if (dir == request_dirs.constEnd() || !is_safe_path(name) ||
+            start < 0 || start > size)
+        return false;
+
+    QString final_name = *dir + "/" + name;
+    *path = final_name;
+    if (files.contains(final_name))
+        return true;
+
+    QString part_name = final_name + PART_SUFFIX;
+    QDir().mkpath(QFileInfo(part_name).absolutePath());
+
+    File entry;
+    entry.request_id = request_id;
+    entry.file = new QFile(part_name);
+    entry.final_name = final_name;
+    entry.mtime = mtime;
+    entry.left = size - start;
+
+    bool ok;
+    if (start > 0)
+        ok = entry.file->open(QFile::ReadWrite) &&
+                entry.file->size() >= start &&
+                entry.file->resize(start);
+    else
+        ok = entry.file->open(QFile::WriteOnly);
+    if (!ok) {
+        delete entry.file;
+        return false;
+    }
+    preallocate(entry.file, start, size - start);
+
+    files.insert(final_name, entry);
+    if (entry.left == 0)
+        finish(final_name);
+    return true;
+}
+
+bool Downloads::write(const QString &path, qint64 offset,
+                      const char *data, qint64 len)
+{
+    QHash<QString, File>::iterator it = files.find(path);
+    if (it == files.end())
+        return false;
+
+    QFile *file = it->file;
+#ifdef Q_OS_UNIX
+    /* positional, chunks of other streams may be in flight */
+    qint64 done = 0;
+    while (done < len) {
+        ssize_t n = ::pwrite(file->handle(), data + done, len - done,
+                             offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+#else
+    if (!file->seek(offset) || file->write(data, len) != len)
+        return false;
+#endif
+
+    return true;
+}
+
+void Downloads::verified(const QString &path, qint64 length)
+{
+    QHash<QString, File>::iterator it = files.find(path);
+    if (it == files.end())
+        return;
+
+    it->left -= length;
+    if (it->left <= 0)
+        finish(path);
+}
+
+void Downloads::discard(const QString &path)
+{
+    QHash<QString, File>::iterator it = files.find(path);
+    if (it == files.end())
+        return;
+
+    fail(it->request_id, path);
+}
+
+/* count path as failed once, whatever still comes for it is skipped */
+void Downloads::fail(quint32 request_id, const QString &path)
+{
+    QSet<QString> &skipped = discarded[request_id];
+    if (skipped.contains(path))
+        return;
+    skipped.insert(path);
+
+    QHash<QString, File>::iterator it = files.find(path);
+    if (it != files.end()) {
+        it->file->remove();
+        delete it->file;
+        files.erase(it);
+    }
+    settled++;
+    failures++;
+    landed(path, false);
+}
+
+bool Downloads::skips(quint32 request_id, const QString &name) const
+{
+    QHash<quint32, QSet<QString> >::const_iterator it =
+            discarded.constFind(request_id);
+    if (it == discarded.constEnd())
+        return false;
+    return it->contains(request_dirs.value(request_id) + "/" + name);
+}
+
+void Downloads::finish(const QString &path)
+{
+    File entry = files.take(path);
+
+    /* same mtime as the server marks the copy as up to date */
+    entry.file->setFileTime(QDateTime::fromMSecsSinceEpoch(entry.mtime),
+                            QFileDevice::FileModificationTime);
+    QString part_name = entry.file->fileName();
+    /* data must be on disk before the rename makes it the good copy */
+    sync_file(entry.file);
+    entry.file->close();
+    delete entry.file;
+
+    settled++;
+    bool ok = replace_file(part_name, entry.final_name);
+    if (!ok) {
+        qDebug() << "Rename Error " << entry.final_name;
+        failures++;
+    }
+    landed(entry.final_name, ok);
+}
+
+/*
+ * Reserve the blocks of [offset, offset + len) up front, so the file
+ * is laid out in few extents instead of growing write by write. The
+ * size is kept: a .part only ever holds what actually arrived.
+ */
+void Downloads::preallocate(QFile *file, qint64 offset, qint64 len)
+{
+#ifdef Q_OS_LINUX
+    if (len > 0 &&
+            ::fallocate(file->handle(), FALLOC_FL_KEEP_SIZE, offset, len) < 0)
+        qDebug() << "fallocate: " << strerror(errno);
+#else
+    Q_UNUSED(file);
+    Q_UNUSED(offset);
+    Q_UNUSED(len);
+#endif
+}
+
+void Downloads::sync_dirs(const QSet<QString> &dirs)
+{
+#ifdef Q_OS_UNIX
+    QSet<QString>::const_iterator it = dirs.constBegin();
+    for (; it != dirs.constEnd(); ++it) {
+        int fd = ::open(QFile::encodeName(*it).constData(),
+                        O_RDONLY | O_DIRECTORY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+#else
+    Q_UNUSED(dirs);
+#endif
+}
+
+bool Downloads::sync_file(QFile *file)
+{
+    file->flush();
+#if defined(Q_OS_LINUX)
+    return ::fdatasync(file->handle()) == 0;
+#elif defined(Q_OS_UNIX)
+    return ::fsync(file->handle()) == 0;
+#else
+    return true;
+#endif
+}
+
+/*
+ * Flush everything written to the filesystem holding dir in one go,
+ * one journal commit instead of one per file. False where the OS can't.
+ */
+bool Downloads::sync_fs(const QString &dir)
+{
+#ifdef Q_OS_LINUX
+    int fd = ::open(QFile::encodeName(dir).constData(),
+                    O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    bool ok = ::syncfs(fd) == 0;
+    ::close(fd);
+    return ok;
+#else
+    Q_UNUSED(dir);
+    return false;
+#endif
+}
+
+/*
+ * All files of the batch are written to their .part first, then
+ * flushed together with sync_fs(), or one by one with sync_file() where
+ * that fails. Only then are they renamed, and each touched directory is
+ * synced once. A bad record skips that file only.
+ */
+bool Downloads::store_batch(quint32 request_id, const QByteArray &body)
+{
+    QHash<quint32, QString>::const_iterator dir =
+            request_dirs.constFind(request_id);
+    if (dir == request_dirs.constEnd())
+        return false;
+
+    WireReader head(body);
+    qint32 codec = (qint32)head.get_u32();
+    qint32 raw_size = (qint32)head.get_u32();
+    quint32 count = head.get_u32();
+    if (!head.is_ok() || raw_size < 0 || raw_size > BATCH_MAX_RAW ||
+            count > BATCH_MAX_FILES)
+        return false;
+
+    QByteArray payload;
+    if (!decompress_block(codec, body.mid(3 * sizeof(quint32)), raw_size,
+                          &payload))
+        return false;
+
+    WireReader in(payload);
+    QStringList parts;
+    QStringList finals;
+    for (quint32 i = 0; i < count; i++) {
+        QString name = in.get_name();
+        quint32 size = in.get_u32();
+        qint64 mtime = (qint64)in.get_u64();
+        const uchar *data = in.get_bytes(size);
+        quint32 crc = in.get_u32();
+        if (!in.is_ok())
+            return false;
+
+        settled++;
+        if (!is_safe_path(name)) {
+            failures++;
+            continue;
+        }
+
+        QString final_name = *dir + "/" + name;
+        if (crc32c(0, data, size) != crc) {
+            qDebug() << "Checksum Error " << name;
+            failures++;
+            landed(final_name, false);
+            continue;
+        }
+
+        QFile file(final_name + PART_SUFFIX);
+        QDir().mkpath(QFileInfo(file).absolutePath());
+        if (!file.open(QFile::WriteOnly) ||
+                file.write(reinterpret_cast<const char *>(data), size) !=
+                (qint64)size) {
+            qDebug() << "Write Error " << final_name;
+            failures++;
+            landed(final_name, false);
+            continue;
+        }
+        file.setFileTime(QDateTime::fromMSecsSinceEpoch(mtime),
+                         QFileDevice::FileModificationTime);
+        file.close();
+
+        parts.append(file.fileName());
+        finals.append(final_name);
+    }
+
+    if (parts.isEmpty())
+        return true;
+
+    /* data must be on disk before the renames make it the good copies */
+    if (!sync_fs(*dir)) {
+        for (int i = parts.size() - 1; i >= 0; i--) {
+            QFile file(parts.at(i));
+            if (file.open(QFile::ReadWrite) && sync_file(&file))
+                continue;
+            qDebug() << "Sync Error " << finals.at(i);
+            file.remove();
+            failures++;
+            landed(finals.at(i), false);
+            parts.removeAt(i);
+            finals.removeAt(i);
+        }
+    }
+
+    QSet<QString> dirs;
+    for (int i = 0; i < parts.size(); i++) {
+#ifdef Q_OS_UNIX
+        bool renamed = ::rename(QFile::encodeName(parts.at(i)).constData(),
+                                QFile::encodeName(finals.at(i)).constData())
+                == 0;
+#else
+        bool renamed = replace_file(parts.at(i), finals.at(i));
+#endif
+        if (!renamed) {
+            qDebug() << "Rename Error " << finals.at(i);
+            failures++;
+        } else
+            dirs.insert(QFileInfo(finals.at(i)).absolutePath());
+    }
+    sync_dirs(dirs);
+
+    /* copies of this content may only be made once it is in place */
+    for (int i = 0; i < finals.size(); i++)
+        landed(finals.at(i), QFileInfo(finals.at(i)).isFile() &&
+               !QFile::exists(parts.at(i)));
+    return true;
+}
+
+/*
+ * MSG_TAG_ERROR body: FileName + Reason, see wire.h
+ * The server won't send the file; ranges of it already in flight on
+ * other streams are drained.
+ */
+bool Downloads::store_error(quint32 request_id, const QByteArray &body)
+{
+    QHash<quint32, QString>::const_iterator dir =
+            request_dirs.constFind(request_id);
+    if (dir == request_dirs.constEnd())
+        return false;
+
+    WireReader in(body);
+
+    QString name = in.get_name();
+    QString reason = in.get_name();
+    if (!in.is_ok() || !is_safe_path(name))
+        return false;
+
+    qDebug() << "Not sent " << name << reason;
+    fail(request_id, *dir + "/" + name);
+    return true;
+}
+
+void Downloads::hold(const QByteArray &hash, const QString &path)
+{
+    if (!hash.isEmpty() && !blobs.contains(hash))
+        blobs.insert(hash, path);
+}
+
+void Downloads::expect(const QString &path, const QByteArray &hash)
+{
+    if (hash.isEmpty() || expected.contains(path))
+        return;
+    expected.insert(path, hash);
+    incoming[hash]++;
+}
+
+/*
+ * MSG_TAG_COPY body: FileName + FileSize(quint64) + MTime(quint64 ms) +
+ *                    SHA-256(short bytes), see wire.h
+ * Copied right away when the content is held, after the download that
+ * brings it in otherwise. With neither the file is given up on, the
+ * next sync fetches it.
+ */
+bool Downloads::store_copy(quint32 request_id, const QByteArray &body)
+{
+    QHash<quint32, QString>::const_iterator dir =
+            request_dirs.constFind(request_id);
+    if (dir == request_dirs.constEnd())
+        return false;
+
+    WireReader in(body);
+
+    Copy copy;
+    QString name = in.get_name();
+    copy.size = in.get_u64();
+    copy.mtime = in.get_u64();
+    QByteArray hash = in.get_short_bytes();
+    if (!in.is_ok() || !is_safe_path(name) || copy.size < 0)
+        return false;
+    copy.path = *dir + "/" + name;
+
+    /* the server sends no data for it */
+    take_expected(copy.path);
+
+    if (blobs.contains(hash)) {
+        copy_blob(hash, copy);
+    } else if (incoming.value(hash) > 0) {
+        waiting[hash].append(copy);
+    } else {
+        qDebug() << "Copy source missing " << name;
+        settled++;
+        failures++;
+    }
+    return true;
+}
+
+QByteArray Downloads::take_expected(const QString &path)
+{
+    QByteArray hash = expected.take(path);
+    if (!hash.isEmpty() && --incoming[hash] <= 0)
+        incoming.remove(hash);
+    return hash;
+}
+
+/* the download of path is over, hand its content to waiting copies */
+void Downloads::landed(const QString &path, bool ok)
+{
+    QByteArray hash = take_expected(path);
+    if (hash.isEmpty())
+        return;
+
+    if (ok)
+        blobs.insert(hash, path);
+    else if (incoming.contains(hash))
+        return;    // another download brings the same content
+
+    QList<Copy> copies = waiting.take(hash);
+    for (int i = 0; i < copies.size(); i++) {
+        if (blobs.contains(hash)) {
+            copy_blob(hash, copies.at(i));
+        } else {
+            settled++;
+            failures++;
+        }
+    }
+}
+
+void Downloads::copy_blob(const QByteArray &hash, const Copy &copy)
+{
+    settled++;
+    if (copy_file(blobs.value(hash), copy, hash))
+        return;
+
+    /* the held file changed since, don't offer it again */
+    qDebug() << "Copy Error " << copy.path;
+    blobs.remove(hash);
+    failures++;
+}
+
+/*
+ * Copy from into copy.path through a .part, checking the content
+ * against hash on the way, so a held file that changed since is never
+ * passed off as the server's.
+ */
+bool Downloads::copy_file(const QString &from, const Copy &copy,
+                          const QByteArray &hash)
+{
+    QFile in(from);
+    QFile out(copy.path + PART_SUFFIX);
+
+    QDir().mkpath(QFileInfo(out).absolutePath());
+    if (!in.open(QFile::ReadOnly) || in.size() != copy.size ||
+            !out.open(QFile::WriteOnly))
+        return false;
+    preallocate(&out, 0, copy.size);
+
+    QCryptographicHash sha(QCryptographicHash::Sha256);
+    char *block = recv_pool->take();
+    qint64 left = copy.size;
+    while (left > 0) {
+        qint64 n = in.read(block, qMin(left, (qint64)RECV_BLOCK_SIZE));
+        if (n <= 0 || out.write(block, n) != n)
+            break;
+        sha.addData(block, n);
+        left -= n;
+    }
+    recv_pool->give(block);
+
+    if (left > 0 || sha.result() != hash) {
+        out.remove();
+        return false;
+    }
+
+    out.setFileTime(QDateTime::fromMSecsSinceEpoch(copy.mtime),
+                    QFileDevice::FileModificationTime);
+    sync_file(&out);
+    out.close();
+    return replace_file(out.fileName(), copy.path);
+}
+
+void Downloads::abort_all()
+{
+    QHash<QString, File>::iterator it = files.begin();
+    for (; it != files.end(); ++it) {
+        it->file->close();
+        delete it->file;
+    }
+    files.clear();
+    discarded.clear();
+    request_dirs.clear();
+    expected.clear();
+    incoming.clear();
+    waiting.clear();
+    settled = 0;
+    failures = 0;
+}
+
+bool Downloads::replace_file(const QString &from, const QString &to)
+{
+#ifdef Q_OS_UNIX
+    if (::rename(QFile::encodeName(from).constData(),
+                 QFile::encodeName(to).constData()) < 0)
+        return false;
+
+    /* persist the new directory entry too */
+    sync_dirs(QSet<QString>() << QFileInfo(to).absolutePath());
+    return true;
+#else
+    QFile::remove(to);
+    return QFile::rename(from, to);
+#endif
+}
+
+FileReceiver::FileReceiver(Downloads *downloads) :
+    downloads(downloads),
+    block(0),
+    tag(0),
+    body_size(0),
+    request_id(0),
+    meta_size(-1),
+    meta_read(false),
+    offset(0),
+    left(0),
+    raw_size(0),
+    codec(CODEC_NONE),
+    crc_offset(0),
+    crc_length(0),
+    crc(0)
+{
+}
+
+FileReceiver::~FileReceiver()
+{
+    if (pool)
+        pool->give(block);
+}
+
+void FileReceiver::start(qint32 tag, qint64 body_size, quint32 request_id)
+{
+    this->tag = tag;
+    this->body_size = body_size;
+    this->request_id = request_id;
+    meta_size = -1;
+    meta_read = false;
+    offset = 0;
+    left = 0;
+}
+
+int FileReceiver::read(QIODevice *device)
+{
+    if (!meta_read) {
+        if (meta_size < 0) {
+            if (device->bytesAvailable() < (int)sizeof(quint32))
+                return 0;
+
+            WireReader in(device->read(sizeof(quint32)));
+            meta_size = in.get_u32();
+            if (!in.is_ok() ||
+                    meta_size > body_size - (qint64)sizeof(quint32))
+                return -1;
+        }
+        if (device->bytesAvailable() < meta_size)
+            return 0;
+        if (!read_meta(device))
+            return -1;
+        meta_read = true;
+    }
+
+    if (tag == MSG_TAG_ZRANGE) {
+        /* a chunk is decompressed as a whole */
+        if (device->bytesAvailable() < left)
+            return 0;
+
+        packed.resize(left);
+        if (device->read(packed.data(), left) != left)
+            return -1;
+        if (path.isEmpty()) {
+            left = 0;
+            return 1;
+        }
+
+        /* raw chunks are written from packed, sharing it would copy */
+        const QByteArray *data = &packed;
+        if (codec != CODEC_NONE) {
+            if (!decompress_block(codec, packed, raw_size, &unpacked))
+                return -1;
+            data = &unpacked;
+        } else if (packed.size() != raw_size) {
+            return -1;
+        }
+
+        if (!downloads->write(path, offset, data->constData(), data->size()))
+            return -1;
+        add_crc(data->constData(), data->size());
+        left = 0;
+        return 1;
+    }
+
+    if (!block) {
+        pool = downloads->get_pool();
+        block = pool->take();
+    }
+
+    /* fill whole blocks before writing, up to RECV_BURST per call */
+    qint64 burst = 0;
+    while (left > 0 && burst < RECV_BURST) {
+        qint64 want = qMin(left, (qint64)RECV_BLOCK_SIZE);
+        qint64 fill = 0;
+        while (fill < want) {
+            qint64 n = device->bytesAvailable() > 0 ?
+                        device->read(block + fill, want - fill) :
+                        read_direct(device, block + fill, want - fill);
+            if (n <= 0)
+                break;
+            fill += n;
+        }
+        if (fill == 0)
+            break;
+
+        if (!path.isEmpty()) {
+            if (!downloads->write(path, offset, block, fill))
+                return -1;
+            add_crc(block, fill);
+        }
+        offset += fill;
+        left -= fill;
+        burst += fill;
+        if (fill < want)
+            break;
+    }
+
+    return left == 0 ? 1 : 0;
+}
+
+/*
+ * Once the socket's own buffer is drained, frame data is read from the
+ * descriptor into our buffer, skipping the copy through QTcpSocket. Only
+ * the bytes of the current frame are taken, headers stay with Qt.
+ * Returns 0 when nothing is there; errors and EOF are left for the
+ * socket to notice.
+ */
+qint64 FileReceiver::read_direct(QIODevice *device, char *data, qint64 len)
+{
+#ifdef Q_OS_UNIX
+    QAbstractSocket *socket = qobject_cast<QAbstractSocket *>(device);
+    if (!socket || socket->socketDescriptor() < 0)
+        return 0;
+
+    ssize_t n;
+    do {
+        n = ::recv(socket->socketDescriptor(), data, len, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    return n > 0 ? n : 0;
+#else
+    Q_UNUSED(device);
+    Q_UNUSED(data);
+    Q_UNUSED(len);
+    return 0;
+#endif
+}
+
+/* Meta of the file frames, see Session::start_file() */
+bool FileReceiver::read_meta(QIODevice *device)
+{
+    WireReader in(device->read(meta_size));
+
+    name = in.get_name();
+    qint64 file_size = in.get_u64();
+    qint64 mtime = in.get_u64();
+    qint64 start = in.get_u64();
+    offset = start;
+    if (tag == MSG_TAG_RANGE || tag == MSG_TAG_ZRANGE)
+        offset = in.get_u64();
+    if (tag == MSG_TAG_ZRANGE) {
+        raw_size = in.get_u32();
+        codec = in.get_u32();
+    }
+    if (!in.is_ok())
+        return false;
+
+    left = body_size - (qint64)sizeof(quint32) - meta_size;
+    /* bytes the frame adds to the file */
+    qint64 length = tag == MSG_TAG_ZRANGE ? raw_size : left;
+    bool bad_chunk = tag == MSG_TAG_ZRANGE &&
+            (raw_size <= 0 || raw_size > COMPRESS_CHUNK_SIZE ||
+             left > raw_size);
+    if (bad_chunk || start < 0 || offset < start ||
+            offset + length > file_size ||
+            (tag == MSG_TAG_FILE && offset + length != file_size)) {
+        qDebug() << "Bad file frame " << name;
+        return false;
+    }
+
+    /* counted as failed already, drain what is left of it */
+    if (downloads->skips(request_id, name)) {
+        path.clear();
+        return true;
+    }
+
+    if (!downloads->begin(request_id, name, file_size, mtime, start,
+                          &path)) {
+        qDebug() << "Open file Error " << name;
+        return false;
+    }
+    return true;
+}
+
+void FileReceiver::add_crc(const char *data, qint64 len)
+{
+    if (crc_length == 0) {
+        crc_path = path;
+        crc_offset = offset;
+    }
+    crc = crc32c(crc, data, len);
+    crc_length += len;
+}
+
+/* MSG_TAG_CHECKSUM body, see Session::finish_current_file() */
+void FileReceiver::check(const QByteArray &body)
+{
+    WireReader in(body);
+
+    in.get_name();
+    qint64 trailer_offset = in.get_u64();
+    qint64 trailer_length = in.get_u64();
+    quint32 trailer_crc = in.get_u32();
+
+    /* empty data: nothing was written, path is the last frame's */
+    QString checked = crc_length > 0 ? crc_path : path;
+    bool ok = in.is_ok() &&
+            trailer_length == crc_length && trailer_crc == crc &&
+            (crc_length == 0 || trailer_offset == crc_offset);
+    /* the data of a discarded file was dropped unchecked */
+    if (ok && !checked.isEmpty()) {
+        downloads->verified(checked, trailer_length);
+    } else if (!checked.isEmpty()) {
+        qDebug() << "Checksum Error " << checked;
+        downloads->discard(checked);
+    }
+
+    crc_path.clear();
+    crc_offset = 0;
+    crc_length = 0;
+    crc = 0;
+}
+
+void FileReceiver::abort(bool in_frame)
+{
+    if (crc_length > 0 && !crc_path.isEmpty())
+        downloads->discard(crc_path);
+    if (in_frame && meta_read && !path.isEmpty())
+        downloads->discard(path);
+
+    crc_path.clear();
+    crc_offset = 0;
+    crc_length = 0;
+    crc = 0;
+}
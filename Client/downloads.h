@@ -0,0 +1,202 @@
+#ifndef DOWNLOADS_H
+#define DOWNLOADS_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QSharedPointer>
+#include <QString>
+#include "bufferpool.h"
+
+class QFile;
+class QIODevice;
+
+/* suffix of files still being downloaded */
+#define PART_SUFFIX     ".part"
+
+/* bytes of file data read from the socket per write */
+#define RECV_BLOCK_SIZE     (256 * 1024)
+/* most file data taken in one FileReceiver::read(), the rest waits */
+#define RECV_BURST          (16 * 1024 * 1024)
+/* largest MSG_TAG_BATCH payload accepted */
+#define BATCH_MAX_RAW       (2 * BATCH_MAX_SIZE)
+
+/*
+ * .part files being received. A file may arrive as one MSG_TAG_FILE
+ * frame or as MSG_TAG_RANGE chunks spread over several connections, in
+ * any order, so data is written at its offset and the file is moved to
+ * its final name once every byte is in and has passed its checksum.
+ */
+class Downloads
+{
+public:
+    Downloads();
+    ~Downloads();
+
+    /* file frames answering request_id are written under dir */
+    void add_request(quint32 request_id, const QString &dir);
+
+    /*
+     * Open name of request_id for a transfer of [start, size), no-op if
+     * already open. path is set to the key for write().
+     */
+    bool begin(quint32 request_id, const QString &name, qint64 size,
+               qint64 mtime, qint64 start, QString *path);
+    bool write(const QString &path, qint64 offset,
+               const char *data, qint64 len);
+    /* length bytes of path passed their checksum */
+    void verified(const QString &path, qint64 length);
+    /*
+     * checksum mismatch or lost stream: drop the .part, the next sync
+     * fetches it again; the frames still coming for it are skipped,
+     * see skips()
+     */
+    void discard(const QString &path);
+    /* name of request_id was discarded, its frames are read and dropped */
+    bool skips(quint32 request_id, const QString &name) const;
+    /* unpack a MSG_TAG_BATCH body of request_id, false if malformed */
+    bool store_batch(quint32 request_id, const QByteArray &body);
+    /* give up on the file of a MSG_TAG_ERROR body, false if malformed */
+    bool store_error(quint32 request_id, const QByteArray &body);
+
+    /* path holds content hash, MSG_TAG_COPY frames may copy from it */
+    void hold(const QByteArray &hash, const QString &path);
+    bool holds(const QByteArray &hash) const { return blobs.contains(hash); }
+    /* path is being downloaded with content hash, held once it lands */
+    void expect(const QString &path, const QByteArray &hash);
+    /* carry out a MSG_TAG_COPY body of request_id, false if malformed */
+    bool store_copy(quint32 request_id, const QByteArray &body);
+    /* close everything, the .part files stay for resume, held stays */
+    void abort_all();
+    /* files stored or given up on since the last abort_all() */
+    int settled_files() const { return settled; }
+    /* the part of settled_files() that did not make it to disk */
+    int failed_files() const { return failures; }
+    /* RECV_BLOCK_SIZE buffers of the connections writing here */
+    QSharedPointer<BufferPool> get_pool() const { return recv_pool; }
+
+    /* move from over to, replacing to in one step where the OS allows it */
+    static bool replace_file(const QString &from, const QString &to);
+    /* flush file data to stable storage */
+    static bool sync_file(QFile *file);
+    /* reserve disk blocks for [offset, offset + len) of an open file */
+    static void preallocate(QFile *file, qint64 offset, qint64 len);
+
+private:
+    struct File
+    {
+        quint32 request_id;
+        QFile *file;
+        QString final_name;
+        qint64 mtime;
+        qint64 left;
+    };
+
+    /* MSG_TAG_COPY target */
+    struct Copy
+    {
+        QString path;
+        qint64 size;
+        qint64 mtime;
+    };
+
+    /*
+     * request id -> local directory, kept for the connection's lifetime
+     * since the server skips files it no longer has without telling
+     */
+    QHash<quint32, QString> request_dirs;
+    /* final path -> open .part */
+    QHash<QString, File> files;
+    /* request id -> final paths given up on while their data came in */
+    QHash<quint32, QSet<QString> > discarded;
+    QSharedPointer<BufferPool> recv_pool;
+    /* content hash -> local file holding it */
+    QHash<QByteArray, QString> blobs;
+    /* final path -> content hash of downloads in flight, and per hash */
+    QHash<QString, QByteArray> expected;
+    QHash<QByteArray, int> incoming;
+    /* copies waiting for a download of their content to land */
+    QHash<QByteArray, QList<Copy> > waiting;
+    int settled;
+    int failures;
+
+    void finish(const QString &path);
+    void fail(quint32 request_id, const QString &path);
+    void landed(const QString &path, bool ok);
+    QByteArray take_expected(const QString &path);
+    void copy_blob(const QByteArray &hash, const Copy &copy);
+    bool copy_file(const QString &from, const Copy &copy,
+                   const QByteArray &hash);
+    static void sync_dirs(const QSet<QString> &dirs);
+    static bool sync_fs(const QString &dir);
+};
+
+/*
+ * Reads the body of one MSG_TAG_FILE, MSG_TAG_RANGE or MSG_TAG_ZRANGE
+ * frame into Downloads, as the data trickles in.
+ *
+ * FILE:   MetaSize(quint32) + FileName + FileSize(quint64) +
+ *         MTime(quint64 ms) + Offset(quint64) + FileData
+ * RANGE:  MetaSize(quint32) + FileName + FileSize(quint64) +
+ *         MTime(quint64 ms) + Start(quint64) + Offset(quint64) + FileData
+ * ZRANGE: as RANGE, then RawSize(quint32) + Codec(quint32) before the
+ *         data, which is one chunk compressed with Codec
+ * in the encoding of wire.h.
+ */
+class FileReceiver
+{
+public:
+    explicit FileReceiver(Downloads *downloads);
+    ~FileReceiver();
+
+    void start(qint32 tag, qint64 body_size, quint32 request_id);
+    /* 1 when the frame is done, 0 while waiting for data, -1 on error */
+    int read(QIODevice *device);
+    /*
+     * MSG_TAG_CHECKSUM body, the trailer of the file data read since
+     * the last one: FileName + Offset(quint64) + Length(quint64) +
+     * CRC32C(quint32)
+     */
+    void check(const QByteArray &body);
+    /*
+     * the connection is gone: the file with data read since the last
+     * trailer, or in the frame being read if in_frame, is discarded
+     */
+    void abort(bool in_frame);
+
+private:
+    Downloads *downloads;
+    /* file data is read into block, taken from pool on first use */
+    QSharedPointer<BufferPool> pool;
+    char *block;
+    /* MSG_TAG_ZRANGE chunk as received and decompressed, reused */
+    QByteArray packed;
+    QByteArray unpacked;
+    qint32 tag;
+    qint64 body_size;
+    quint32 request_id;
+    qint64 meta_size;
+    bool meta_read;
+    QString name;
+    /* empty while the data of a discarded file is dropped */
+    QString path;
+    qint64 offset;
+    qint64 left;
+    /* MSG_TAG_ZRANGE chunk */
+    qint32 raw_size;
+    qint32 codec;
+    /* CRC-32C of the data written since the last trailer */
+    QString crc_path;
+    qint64 crc_offset;
+    qint64 crc_length;
+    quint32 crc;
+
+    bool read_meta(QIODevice *device);
+    qint64 read_direct(QIODevice *device, char *data, qint64 len);
+    void add_crc(const char *data, qint64 len);
+
+    Q_DISABLE_COPY(FileReceiver)
+};
+
+#endif // DOWNLOADS_H
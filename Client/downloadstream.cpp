@@ -0,0 +1,134 @@
+#include "downloadstream.h"
+#include "clientengine.h"
+#include "compress.h"
+#include "wire.h"
+#include <QDebug>
+#include <QTcpSocket>
+
+DownloadStream::DownloadStream(Downloads *downloads, const QByteArray &token,
+                               QObject *parent) :
+    QObject(parent),
+    downloads(downloads),
+    token(token),
+    receiver(downloads),
+    read_status(STATUS_READ_PREFACE),
+    tag(0),
+    body_size(0),
+    request_id(0),
+    gone(false)
+{
+    socket = new QTcpSocket(this);
+
+    connect(socket, SIGNAL(connected()),
+            this, SLOT(socket_connected()));
+    connect(socket, SIGNAL(readyRead()),
+            this, SLOT(handle_msg()));
+    connect(socket, SIGNAL(disconnected()),
+            this, SLOT(handle_lost()));
+    connect(socket, SIGNAL(error(QAbstractSocket::SocketError)),
+            this, SLOT(handle_lost()));
+}
+
+void DownloadStream::connect_to(const QString &address, quint16 port)
+{
+    socket->connectToHost(address, port);
+}
+
+void DownloadStream::socket_connected()
+{
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_short_bytes(token);
+
+    socket->write(make_preface(compress_features()));
+    socket->write(make_frame(MSG_TAG_JOIN, block));
+}
+
+void DownloadStream::handle_msg()
+{
+    read_frames();
+    emit received();
+}
+
+/*
+ * The file cut off on this connection fails, the server hands the
+ * items it had not sent yet to the other streams of the group.
+ */
+void DownloadStream::handle_lost()
+{
+    if (gone)
+        return;
+    gone = true;
+
+    qDebug() << "Stream lost: " << socket->errorString();
+    receiver.abort(read_status == STATUS_READ_FILE);
+    emit lost();
+}
+
+void DownloadStream::read_frames()
+{
+    do {
+        switch (read_status) {
+        case STATUS_READ_PREFACE:
+        {
+            quint32 magic, version, features;
+            if (!read_preface(socket, &magic, &version, &features))
+                return;
+            if (magic != PROTOCOL_MAGIC || version != PROTOCOL_VERSION) {
+                socket->abort();
+                return;
+            }
+            read_status = STATUS_NONE;
+            break;
+        }
+        case STATUS_NONE:
+            if (!read_frame_header(socket, &tag, &body_size, &request_id))
+                return;
+            if (body_size < 0) {
+                socket->abort();
+                return;
+            }
+            if (tag == MSG_TAG_CHECKSUM || tag == MSG_TAG_BATCH ||
+                    tag == MSG_TAG_ERROR) {
+                read_status = STATUS_READ_TAG;
+                break;
+            }
+            if (tag != MSG_TAG_FILE && tag != MSG_TAG_RANGE &&
+                    tag != MSG_TAG_ZRANGE) {
+                qDebug() << "Stream: unexpected tag " << tag;
+                socket->abort();
+                return;
+            }
+            receiver.start(tag, body_size, request_id);
+            read_status = STATUS_READ_FILE;
+            break;
+        case STATUS_READ_TAG:
+            /* checksum trailer, batch or error, read whole */
+            if (socket->bytesAvailable() < body_size)
+                return;
+            if (tag == MSG_TAG_BATCH)
+                downloads->store_batch(request_id, socket->read(body_size));
+            else if (tag == MSG_TAG_ERROR)
+                downloads->store_error(request_id, socket->read(body_size));
+            else
+                receiver.check(socket->read(body_size));
+            read_status = STATUS_NONE;
+            break;
+        case STATUS_READ_FILE:
+            switch (receiver.read(socket)) {
+            case 0:
+                return;
+            case 1:
+                read_status = STATUS_NONE;
+                break;
+            default:
+                socket->abort();
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+    } while (read_status != STATUS_NONE || socket->bytesAvailable());
+}
@@ -0,0 +1,50 @@
+#ifndef DOWNLOADSTREAM_H
+#define DOWNLOADSTREAM_H
+
+#include <QObject>
+#include <QByteArray>
+#include "downloads.h"
+
+class QTcpSocket;
+
+/*
+ * Extra connection of a multi-stream download. It joins the server's
+ * stream group of the main connection and only ever receives file
+ * data, every request still goes over the main connection.
+ */
+class DownloadStream : public QObject
+{
+    Q_OBJECT
+
+public:
+    DownloadStream(Downloads *downloads, const QByteArray &token,
+                   QObject *parent = 0);
+
+    void connect_to(const QString &address, quint16 port);
+
+signals:
+    /* data was read into downloads */
+    void received();
+    /* the connection failed or was closed, emitted once */
+    void lost();
+
+private slots:
+    void socket_connected();
+    void handle_msg();
+    void handle_lost();
+
+private:
+    QTcpSocket *socket;
+    Downloads *downloads;
+    QByteArray token;
+    FileReceiver receiver;
+    int read_status;
+    qint32 tag;
+    qint64 body_size;
+    quint32 request_id;
+    bool gone;
+
+    void read_frames();
+};
+
+#endif // DOWNLOADSTREAM_H
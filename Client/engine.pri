@@ -0,0 +1,16 @@
+# Protocol engine shared by the Client window and the Cli
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += $$PWD/clientengine.cpp \
+        $$PWD/downloads.cpp \
+        $$PWD/downloadstream.cpp \
+        $$PWD/localcheck.cpp
+
+HEADERS += $$PWD/clientengine.h \
+        $$PWD/downloads.h \
+        $$PWD/downloadstream.h \
+        $$PWD/localcheck.h
+
+include(../Common/common.pri)
@@ -0,0 +1,141 @@
+#include "localcheck.h"
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
+#include "delta.h"
+#include "downloads.h"
+#include "filehash.h"
+
+/* checks done on the pool, outlives its LocalChecker */
+struct CheckQueue
+{
+    CheckQueue() : owner(0) {}
+
+    QMutex lock;
+    QList<QSharedPointer<LocalCheck> > list;
+    /* null once the LocalChecker is gone */
+    QObject *owner;
+};
+
+class CheckPool : public QThreadPool
+{
+public:
+    CheckPool() { setMaxThreadCount(LOCAL_CHECK_THREADS); }
+};
+
+static CheckPool *check_pool()
+{
+    static CheckPool pool;
+    return &pool;
+}
+
+static void check_file(const QString &local_dir, LocalFile *file)
+{
+    QFileInfo local(local_dir + "/" + file->name);
+    QString path = local.absoluteFilePath();
+
+    if (local.isFile() && local.size() == file->size) {
+        if (local.lastModified().toMSecsSinceEpoch() == file->mtime) {
+            file->state = LOCAL_CURRENT;
+            return;
+        }
+
+        /* same size, different mtime: compare contents */
+        if (hash_file_prefix(path, file->size) == file->hash) {
+            QFile local_file(path);
+            if (local_file.open(QFile::ReadWrite))
+                local_file.setFileTime(
+                            QDateTime::fromMSecsSinceEpoch(file->mtime),
+                            QFileDevice::FileModificationTime);
+            file->state = LOCAL_CURRENT;
+            return;
+        }
+    }
+
+    /* large changed files: fetch only the differing blocks */
+    QFileInfo part(path + PART_SUFFIX);
+    if (local.isFile() && local.size() >= DELTA_MIN_SIZE && !part.exists()) {
+        file->signature = make_signature(
+                    path, delta_block_size(local.size()));
+        if (!file->signature.isEmpty()) {
+            file->state = LOCAL_DELTA;
+            return;
+        }
+    }
+
+    file->state = LOCAL_WANTED;
+    if (part.isFile()) {
+        file->part_size = part.size();
+        file->part_hash = hash_file_prefix(part.absoluteFilePath(),
+                                           file->part_size);
+    }
+}
+
+/* check the files of a manifest batch on a pool thread */
+class CheckTask : public QRunnable
+{
+public:
+    CheckTask(const QSharedPointer<LocalCheck> &check,
+              const QSharedPointer<CheckQueue> &queue) :
+        check(check),
+        queue(queue)
+    {
+    }
+
+    void run()
+    {
+        for (int i = 0; i < check->files.size(); i++) {
+            /* the engine is gone, nobody waits for the rest */
+            {
+                QMutexLocker locker(&queue->lock);
+                if (!queue->owner)
+                    return;
+            }
+            check_file(check->local_dir, &check->files[i]);
+        }
+
+        QMutexLocker locker(&queue->lock);
+        if (!queue->owner)
+            return;
+        queue->list.append(check);
+        if (queue->list.size() == 1)
+            QMetaObject::invokeMethod(queue->owner, "reap",
+                                      Qt::QueuedConnection);
+    }
+
+private:
+    QSharedPointer<LocalCheck> check;
+    QSharedPointer<CheckQueue> queue;
+};
+
+LocalChecker::LocalChecker(QObject *parent) :
+    QObject(parent),
+    queue(new CheckQueue)
+{
+    queue->owner = this;
+}
+
+LocalChecker::~LocalChecker()
+{
+    QMutexLocker locker(&queue->lock);
+    queue->owner = 0;
+}
+
+void LocalChecker::submit(const QSharedPointer<LocalCheck> &check)
+{
+    check_pool()->start(new CheckTask(check, queue));
+}
+
+void LocalChecker::reap()
+{
+    QList<QSharedPointer<LocalCheck> > list;
+    {
+        QMutexLocker locker(&queue->lock);
+        list.swap(queue->list);
+    }
+    for (int i = 0; i < list.size(); i++)
+        emit checked(list.at(i));
+}
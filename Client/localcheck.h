@@ -0,0 +1,77 @@
+#ifndef LOCALCHECK_H
+#define LOCALCHECK_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QList>
+#include <QSharedPointer>
+#include <QString>
+
+/* threads comparing manifests with the local copies, for all engines */
+#define LOCAL_CHECK_THREADS 2
+
+/* what a manifest file needs, see LocalFile */
+#define LOCAL_CURRENT       0
+#define LOCAL_WANTED        1
+#define LOCAL_DELTA         2
+
+/* one file of a manifest and how it compares with the local copy */
+struct LocalFile
+{
+    LocalFile() : size(0), mtime(0), state(LOCAL_WANTED), part_size(0) {}
+
+    /* as the manifest announced it */
+    QString name;
+    qint64 size;
+    qint64 mtime;
+    QByteArray hash;
+
+    /* LOCAL_CURRENT: the local copy has this content, its mtime is set */
+    int state;
+    /* LOCAL_WANTED: partial download offered for resume, size 0 if none */
+    qint64 part_size;
+    QByteArray part_hash;
+    /* LOCAL_DELTA: signature of the local copy */
+    QByteArray signature;
+};
+
+/* the files of one manifest batch, checked together */
+struct LocalCheck
+{
+    LocalCheck() : request_id(0) {}
+
+    quint32 request_id;
+    QString local_dir;
+    QList<LocalFile> files;
+};
+
+struct CheckQueue;
+
+/*
+ * Reads and hashes local files on a thread pool, so a large manifest
+ * does not stall the event loop of the window or the other transfers:
+ * same size files are compared by content, partial downloads hashed
+ * for resume and changed large files signed for a delta.
+ */
+class LocalChecker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit LocalChecker(QObject *parent = 0);
+    ~LocalChecker();
+
+    /* sets the state of every file of check, checked() hands it back */
+    void submit(const QSharedPointer<LocalCheck> &check);
+
+signals:
+    void checked(QSharedPointer<LocalCheck> check);
+
+private slots:
+    void reap();
+
+private:
+    QSharedPointer<CheckQueue> queue;
+};
+
+#endif // LOCALCHECK_H
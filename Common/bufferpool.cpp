@@ -0,0 +1,51 @@
+#include "bufferpool.h"
+#include <QAtomicInteger>
+
+static QAtomicInteger<qint64> allocated;
+
+BufferPool::BufferPool(int buffer_size, int max_free) :
+    buffer_size(buffer_size),
+    max_free(max_free)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    for (int i = 0; i < free_list.size(); i++)
+        qFreeAligned(free_list.at(i));
+}
+
+char *BufferPool::take()
+{
+    {
+        QMutexLocker locker(&lock);
+        if (!free_list.isEmpty()) {
+            char *buffer = free_list.last();
+            free_list.removeLast();
+            return buffer;
+        }
+    }
+
+    allocated.fetchAndAddRelaxed(1);
+    return (char *)qMallocAligned(buffer_size, BUFFER_ALIGN);
+}
+
+void BufferPool::give(char *buffer)
+{
+    if (!buffer)
+        return;
+
+    {
+        QMutexLocker locker(&lock);
+        if (free_list.size() < max_free) {
+            free_list.append(buffer);
+            return;
+        }
+    }
+    qFreeAligned(buffer);
+}
+
+qint64 BufferPool::allocations()
+{
+    return allocated.load();
+}
@@ -0,0 +1,41 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QtGlobal>
+#include <QMutex>
+#include <QVector>
+
+/* buffers start on their own cache line */
+#define BUFFER_ALIGN        64
+/* free buffers a pool keeps for reuse */
+#define POOL_MAX_FREE       16
+
+/*
+ * Fixed-size buffers for file data in flight, recycled instead of
+ * allocated per chunk. A pool serves one worker or connection; give()
+ * may be called from any thread.
+ */
+class BufferPool
+{
+public:
+    explicit BufferPool(int buffer_size, int max_free = POOL_MAX_FREE);
+    ~BufferPool();
+
+    int get_buffer_size() const { return buffer_size; }
+    /* a buffer of get_buffer_size() bytes, back with give() */
+    char *take();
+    void give(char *buffer);
+
+    /* buffers allocated by all pools so far, reuse does not count */
+    static qint64 allocations();
+
+private:
+    int buffer_size;
+    int max_free;
+    QMutex lock;
+    QVector<char *> free_list;
+
+    Q_DISABLE_COPY(BufferPool)
+};
+
+#endif // BUFFERPOOL_H
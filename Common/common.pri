@@ -0,0 +1,39 @@
+# Wire protocol shared by Server and Client
+
+# included by both engines in the Bench project
+isEmpty(COMMON_PRI_INCLUDED) {
+COMMON_PRI_INCLUDED = 1
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += $$PWD/protocol.cpp \
+        $$PWD/filehash.cpp \
+        $$PWD/delta.cpp \
+        $$PWD/compress.cpp \
+        $$PWD/crc32c.cpp \
+        $$PWD/wire.cpp \
+        $$PWD/bufferpool.cpp
+
+HEADERS += $$PWD/protocol.h \
+        $$PWD/filehash.h \
+        $$PWD/delta.h \
+        $$PWD/compress.h \
+        $$PWD/crc32c.h \
+        $$PWD/wire.h \
+        $$PWD/bufferpool.h
+
+# optional codecs, qCompress is always available
+unix {
+    CONFIG += link_pkgconfig
+    packagesExist(libzstd) {
+        PKGCONFIG += libzstd
+        DEFINES += HAVE_ZSTD
+    }
+    packagesExist(liblz4) {
+        PKGCONFIG += liblz4
+        DEFINES += HAVE_LZ4
+    }
+}
+
+}
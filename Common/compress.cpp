@@ -0,0 +1,125 @@
+#include "compress.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+/* zstd level, favour speed: the link is the bottleneck, not the ratio */
+#define ZSTD_LEVEL      1
+#define ZLIB_LEVEL      1
+
+quint32 compress_features()
+{
+    quint32 features = FEATURE_ZLIB;
+
+#ifdef HAVE_LZ4
+    features |= FEATURE_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    features |= FEATURE_ZSTD;
+#endif
+    return features;
+}
+
+int pick_codec(quint32 features)
+{
+    if (features & FEATURE_ZSTD)
+        return CODEC_ZSTD;
+    if (features & FEATURE_LZ4)
+        return CODEC_LZ4;
+    if (features & FEATURE_ZLIB)
+        return CODEC_ZLIB;
+    return CODEC_NONE;
+}
+
+bool compress_block(int codec, const char *data, int len, QByteArray *out)
+{
+    switch (codec) {
+    case CODEC_ZLIB:
+        /* qCompress() always allocates */
+        *out = qCompress(reinterpret_cast<const uchar *>(data), len,
+                         ZLIB_LEVEL);
+        return !out->isEmpty();
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+    {
+        out->resize(LZ4_compressBound(len));
+        int n = LZ4_compress_default(data, out->data(), len, out->size());
+        if (n <= 0)
+            return false;
+        out->resize(n);
+        return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+    {
+        out->resize(ZSTD_compressBound(len));
+        size_t n = ZSTD_compress(out->data(), out->size(), data, len,
+                                 ZSTD_LEVEL);
+        if (ZSTD_isError(n))
+            return false;
+        out->resize(n);
+        return true;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+bool decompress_block(int codec, const QByteArray &data, int raw_size,
+                      QByteArray *out)
+{
+    switch (codec) {
+    case CODEC_NONE:
+        *out = data;
+        break;
+    case CODEC_ZLIB:
+        *out = qUncompress(data);
+        break;
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+    {
+        out->resize(raw_size);
+        int n = LZ4_decompress_safe(data.constData(), out->data(),
+                                    data.size(), raw_size);
+        if (n < 0)
+            return false;
+        out->resize(n);
+        break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+    {
+        out->resize(raw_size);
+        size_t n = ZSTD_decompress(out->data(), raw_size,
+                                   data.constData(), data.size());
+        if (ZSTD_isError(n))
+            return false;
+        out->resize(n);
+        break;
+    }
+#endif
+    default:
+        return false;
+    }
+
+    return out->size() == raw_size;
+}
+
+bool is_compressible(int codec, const QByteArray &sample)
+{
+    if (codec == CODEC_NONE || sample.isEmpty())
+        return false;
+
+    /* images, archives and the like barely shrink, skip them */
+    QByteArray packed;
+    return compress_block(codec, sample.constData(), sample.size(),
+                          &packed) &&
+            packed.size() < sample.size() * 9 / 10;
+}
@@ -0,0 +1,49 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <QByteArray>
+
+/*
+ * Payload compression for file data.
+ *
+ * Each side lists the codecs it was built with in the preface features;
+ * the server only uses codecs both sides have. zlib (qCompress) is
+ * always there, zstd and LZ4 when found at build time (HAVE_ZSTD,
+ * HAVE_LZ4). Every compressed chunk names its codec, so the receiver
+ * never has to know which one was negotiated.
+ */
+
+/* preface feature bits */
+#define FEATURE_ZLIB        (1 << 0)
+#define FEATURE_LZ4         (1 << 1)
+#define FEATURE_ZSTD        (1 << 2)
+#define FEATURE_COMPRESS    (FEATURE_ZLIB | FEATURE_LZ4 | FEATURE_ZSTD)
+
+/* codec of a chunk, CODEC_NONE stores it raw */
+#define CODEC_NONE          0
+#define CODEC_ZLIB          1
+#define CODEC_LZ4           2
+#define CODEC_ZSTD          3
+
+/* raw bytes per compressed chunk */
+#define COMPRESS_CHUNK_SIZE     (256 * 1024)
+/* bytes of a file tried before deciding to compress it */
+#define COMPRESS_SAMPLE_SIZE    (64 * 1024)
+/* files smaller than this are not worth the chunk overhead */
+#define COMPRESS_MIN_SIZE       (4 * 1024)
+
+/* FEATURE_* bits of the codecs built in */
+quint32 compress_features();
+/* fastest codec among features, CODEC_NONE if there is none */
+int pick_codec(quint32 features);
+
+/* false on error, out's storage is reused when it is large enough */
+bool compress_block(int codec, const char *data, int len, QByteArray *out);
+/* false unless data decompresses to exactly raw_size bytes */
+bool decompress_block(int codec, const QByteArray &data, int raw_size,
+                      QByteArray *out);
+
+/* true when sample shrinks enough to pay for compressing the file */
+bool is_compressible(int codec, const QByteArray &sample);
+
+#endif // COMPRESS_H
@@ -0,0 +1,128 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY     0x82f63b78
+
+static quint32 table[8][256];
+
+static bool init_table()
+{
+    for (int i = 0; i < 256; i++) {
+        quint32 crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++)
+            table[k][i] = (table[k - 1][i] >> 8) ^
+                    table[0][table[k - 1][i] & 0xff];
+    }
+    return true;
+}
+
+static quint32 crc32c_sw(quint32 crc, const uchar *p, size_t len)
+{
+    /* thread safe one time init */
+    static const bool table_ready = init_table();
+    Q_UNUSED(table_ready);
+
+    while (len > 0 && ((quintptr)p & 7)) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        quint64 word;
+        memcpy(&word, p, 8);
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+        word = qbswap(word);
+#endif
+        word ^= crc;
+        crc = table[7][word & 0xff] ^
+                table[6][(word >> 8) & 0xff] ^
+                table[5][(word >> 16) & 0xff] ^
+                table[4][(word >> 24) & 0xff] ^
+                table[3][(word >> 32) & 0xff] ^
+                table[2][(word >> 40) & 0xff] ^
+                table[1][(word >> 48) & 0xff] ^
+                table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static quint32 crc32c_hw(quint32 crc, const uchar *p, size_t len)
+{
+    quint64 crc64 = crc;
+
+    while (len > 0 && ((quintptr)p & 7)) {
+        crc64 = _mm_crc32_u8((quint32)crc64, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        quint64 word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc64 = _mm_crc32_u8((quint32)crc64, *p++);
+        len--;
+    }
+    return (quint32)crc64;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static quint32 crc32c_hw(quint32 crc, const uchar *p, size_t len)
+{
+    while (len > 0 && ((quintptr)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        quint64 word;
+        memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+quint32 crc32c(quint32 crc, const void *data, size_t len)
+{
+    const uchar *p = static_cast<const uchar *>(data);
+
+    crc = ~crc;
+#if defined(CRC32C_X86)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42)
+        return ~crc32c_hw(crc, p, len);
+#elif defined(CRC32C_ARM)
+    return ~crc32c_hw(crc, p, len);
+#endif
+    return ~crc32c_sw(crc, p, len);
+}
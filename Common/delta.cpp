@@ -0,0 +1,287 @@
+#include "delta.h"
+#include "wire.h"
+#include <QFile>
+#include <QtMath>
+#include <QCryptographicHash>
+#include <string.h>
+
+#define DELTA_MIN_BLOCK     (2 * 1024)
+#define DELTA_MAX_BLOCK     (1024 * 1024)
+/* keep signatures well below MAX_REQUEST_SIZE */
+#define DELTA_MAX_BLOCKS    (512 * 1024)
+
+static quint32 weak_sum(const char *data, int len, quint32 *a, quint32 *b)
+{
+    const uchar *p = reinterpret_cast<const uchar *>(data);
+    quint32 s1 = 0, s2 = 0;
+
+    for (int i = 0; i < len; i++) {
+        s1 += p[i];
+        s2 += (quint32)(len - i) * p[i];
+    }
+
+    *a = s1;
+    *b = s2;
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+static QByteArray strong_sum(const char *data, int len)
+{
+    return QCryptographicHash::hash(QByteArray::fromRawData(data, len),
+                                    QCryptographicHash::Md5);
+}
+
+int delta_block_size(qint64 size)
+{
+    qint64 bs = (qint64)qSqrt((qreal)size);
+
+    bs = qMax(bs, size / DELTA_MAX_BLOCKS + 1);
+    bs = qBound((qint64)DELTA_MIN_BLOCK, bs, (qint64)DELTA_MAX_BLOCK);
+    /* round up to 1K */
+    return (int)((bs + 1023) & ~1023);
+}
+
+QByteArray make_signature(const QString &path, int block_size)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+        return QByteArray();
+
+    qint64 size = file.size();
+    qint32 count = (qint32)((size + block_size - 1) / block_size);
+    qint32 last = size % block_size ? (qint32)(size % block_size) : block_size;
+
+    QByteArray sig;
+    WireWriter out(&sig);
+
+    sig.reserve(12 + count * DELTA_RECORD_SIZE);
+    out.put_u32(block_size);
+    out.put_u32(count);
+    out.put_u32(last);
+
+    QByteArray block;
+    for (qint32 i = 0; i < count; i++) {
+        block = file.read(i == count - 1 ? last : block_size);
+        if (block.isEmpty())
+            return QByteArray();
+
+        quint32 a, b;
+        out.put_u32(weak_sum(block.constData(), block.size(), &a, &b));
+        QByteArray sum = strong_sum(block.constData(), block.size());
+        out.put_bytes(sum.constData(), sum.size());
+    }
+
+    return sig;
+}
+
+DeltaEncoder::DeltaEncoder(const QByteArray &signature) :
+    valid(false),
+    block_size(0),
+    block_count(0),
+    last_block_size(0),
+    pos(0),
+    lit_start(0),
+    have_weak(false),
+    sum_a(0),
+    sum_b(0)
+{
+    WireReader in(signature);
+
+    block_size = (qint32)in.get_u32();
+    block_count = (qint32)in.get_u32();
+    last_block_size = (qint32)in.get_u32();
+    if (!in.is_ok() || block_size <= 0 || block_size > DELTA_MAX_BLOCK ||
+            block_count < 0 ||
+            last_block_size <= 0 || last_block_size > block_size ||
+            signature.size() != 12 + (qint64)block_count * DELTA_RECORD_SIZE)
+        return;
+
+    strong.reserve(block_count * DELTA_STRONG_SIZE);
+    weak_index.reserve(block_count);
+    for (int i = 0; i < block_count; i++) {
+        weak_index.insert(in.get_u32(), i);
+        strong.append(reinterpret_cast<const char *>(
+                          in.get_bytes(DELTA_STRONG_SIZE)),
+                      DELTA_STRONG_SIZE);
+    }
+
+    valid = true;
+}
+
+void DeltaEncoder::feed(const char *data, int len)
+{
+    buf.append(data, len);
+    scan(false);
+}
+
+void DeltaEncoder::finish()
+{
+    scan(true);
+}
+
+QByteArray DeltaEncoder::take_output()
+{
+    QByteArray result = out;
+    out.clear();
+    return result;
+}
+
+/* index of a basis block equal to data, or -1 */
+int DeltaEncoder::match(const char *data, int len, quint32 weak) const
+{
+    QMultiHash<quint32, int>::const_iterator it = weak_index.constFind(weak);
+    QByteArray sum;
+
+    for (; it != weak_index.constEnd() && it.key() == weak; ++it) {
+        int index = it.value();
+        int size = index == block_count - 1 ? last_block_size : block_size;
+        if (size != len)
+            continue;
+
+        if (sum.isEmpty())
+            sum = strong_sum(data, len);
+        if (memcmp(sum.constData(),
+                   strong.constData() + index * DELTA_STRONG_SIZE,
+                   DELTA_STRONG_SIZE) == 0)
+            return index;
+    }
+
+    return -1;
+}
+
+void DeltaEncoder::scan(bool final)
+{
+    const char *p = buf.constData();
+    int size = buf.size();
+
+    while (block_count > 0 && pos + block_size <= size) {
+        if (!have_weak) {
+            weak_sum(p + pos, block_size, &sum_a, &sum_b);
+            have_weak = true;
+        }
+
+        int index = match(p + pos, block_size,
+                          (sum_a & 0xffff) | (sum_b << 16));
+        if (index >= 0) {
+            emit_literal(lit_start, pos);
+            emit_copy(index);
+            pos += block_size;
+            lit_start = pos;
+            have_weak = false;
+            continue;
+        }
+
+        /* rolling needs the byte after the window */
+        if (pos + block_size == size)
+            break;
+
+        uchar old_byte = p[pos];
+        uchar new_byte = p[pos + block_size];
+        sum_a = sum_a - old_byte + new_byte;
+        sum_b = sum_b - (quint32)block_size * old_byte + sum_a;
+        pos++;
+
+        if (pos - lit_start >= DELTA_MAX_LITERAL) {
+            emit_literal(lit_start, pos);
+            lit_start = pos;
+        }
+    }
+
+    if (final) {
+        /* the basis' short last block can only match the very tail */
+        int tail = size - pos;
+        if (block_count > 0 && tail > 0 && tail == last_block_size &&
+                tail < block_size) {
+            quint32 a, b;
+            int index = match(p + pos, tail, weak_sum(p + pos, tail, &a, &b));
+            if (index >= 0) {
+                emit_literal(lit_start, pos);
+                emit_copy(index);
+                lit_start = pos = size;
+            }
+        }
+
+        emit_literal(lit_start, size);
+        buf.clear();
+        pos = lit_start = 0;
+        have_weak = false;
+        return;
+    }
+
+    if (block_count == 0) {
+        /* nothing to match against: everything is literal */
+        emit_literal(lit_start, size);
+        pos = lit_start = size;
+    }
+
+    /* drop what has been emitted */
+    if (lit_start > 0) {
+        buf.remove(0, lit_start);
+        pos -= lit_start;
+        lit_start = 0;
+    }
+}
+
+void DeltaEncoder::emit_literal(int from, int to)
+{
+    WireWriter ops(&out);
+
+    while (from < to) {
+        int len = qMin(to - from, DELTA_MAX_LITERAL);
+
+        ops.put_u8(DELTA_OP_DATA);
+        ops.put_u32(len);
+        ops.put_bytes(buf.constData() + from, len);
+        from += len;
+    }
+}
+
+void DeltaEncoder::emit_copy(int index)
+{
+    WireWriter ops(&out);
+
+    ops.put_u8(DELTA_OP_COPY);
+    ops.put_u32(index);
+}
+
+DeltaDecoder::DeltaDecoder(QFile *basis, QFile *target, int block_size) :
+    basis(basis),
+    target(target),
+    block_size(block_size),
+    total(0),
+    sha(QCryptographicHash::Sha256)
+{
+}
+
+bool DeltaDecoder::apply(const QByteArray &ops)
+{
+    WireReader in(ops);
+
+    while (!in.at_end()) {
+        char op = (char)in.get_u8();
+        quint32 value = in.get_u32();
+        if (!in.is_ok())
+            return false;
+
+        if (op == DELTA_OP_COPY) {
+            if (block_size <= 0 || !basis->seek((qint64)value * block_size))
+                return false;
+            QByteArray block = basis->read(block_size);
+            if (block.isEmpty() || target->write(block) != block.size())
+                return false;
+            sha.addData(block);
+            total += block.size();
+        } else if (op == DELTA_OP_DATA) {
+            const char *data =
+                    reinterpret_cast<const char *>(in.get_bytes(value));
+            if (!data || target->write(data, value) != (qint64)value)
+                return false;
+            sha.addData(data, (int)value);
+            total += value;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,100 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QMultiHash>
+#include <QString>
+
+class QFile;
+
+/*
+ * rsync style block delta.
+ *
+ * The receiver describes the copy it already has as a signature: for
+ * every block a weak rolling checksum and an MD5. The sender scans its
+ * own file with the rolling checksum and emits a stream of ops that
+ * either reference one of the receiver's blocks or carry literal data.
+ *
+ * Signature: BlockSize(quint32) + BlockCount(quint32) +
+ *            LastBlockSize(quint32) +
+ *            BlockCount * (Weak(quint32) + MD5(16 bytes))
+ * Ops:       'C' + BlockIndex(quint32)
+ *            'D' + Length(quint32) + Data
+ * All integers little endian, see wire.h.
+ */
+
+#define DELTA_OP_COPY       'C'
+#define DELTA_OP_DATA       'D'
+#define DELTA_STRONG_SIZE   16
+#define DELTA_RECORD_SIZE   (4 + DELTA_STRONG_SIZE)
+/* literals are cut into ops of at most this many bytes */
+#define DELTA_MAX_LITERAL   (64 * 1024)
+/* don't bother with deltas for files smaller than this */
+#define DELTA_MIN_SIZE      (256 * 1024)
+
+/* block size for a basis file of the given size, about sqrt(size) */
+int delta_block_size(qint64 size);
+/* signature of a local file, empty on read errors */
+QByteArray make_signature(const QString &path, int block_size);
+
+class DeltaEncoder
+{
+public:
+    explicit DeltaEncoder(const QByteArray &signature);
+
+    bool is_valid() const { return valid; }
+    int get_block_size() const { return block_size; }
+    /* feed the next bytes of the new file */
+    void feed(const char *data, int len);
+    /* no more data: flush the tail */
+    void finish();
+    /* complete ops produced so far */
+    QByteArray take_output();
+    int output_size() const { return out.size(); }
+
+private:
+    bool valid;
+    int block_size;
+    int block_count;
+    int last_block_size;
+    QMultiHash<quint32, int> weak_index;
+    QByteArray strong;
+
+    /* unsent input, window starts at pos, pending literal at lit_start */
+    QByteArray buf;
+    int pos;
+    int lit_start;
+    bool have_weak;
+    quint32 sum_a;
+    quint32 sum_b;
+
+    QByteArray out;
+
+    void scan(bool final);
+    int match(const char *data, int len, quint32 weak) const;
+    void emit_literal(int from, int to);
+    void emit_copy(int index);
+};
+
+class DeltaDecoder
+{
+public:
+    /* basis is the receiver's old copy, target receives the new file */
+    DeltaDecoder(QFile *basis, QFile *target, int block_size);
+
+    /* apply whole ops, false on malformed input or I/O errors */
+    bool apply(const QByteArray &ops);
+    qint64 written() const { return total; }
+    /* SHA-256 of what was written, to check against the sender's */
+    QByteArray result() { return sha.result(); }
+
+private:
+    QFile *basis;
+    QFile *target;
+    int block_size;
+    qint64 total;
+    QCryptographicHash sha;
+};
+
+#endif // DELTA_H
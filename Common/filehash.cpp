@@ -0,0 +1,24 @@
+#include "filehash.h"
+#include <QFile>
+#include <QCryptographicHash>
+
+QByteArray hash_file_prefix(const QString &path, qint64 length)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    QByteArray block;
+    qint64 left = length;
+
+    while (left > 0) {
+        block = file.read(qMin(left, (qint64)HASH_BLOCK_SIZE));
+        if (block.isEmpty())
+            return QByteArray();
+        hash.addData(block);
+        left -= block.size();
+    }
+
+    return hash.result();
+}
@@ -0,0 +1,16 @@
+#ifndef FILEHASH_H
+#define FILEHASH_H
+
+#include <QByteArray>
+#include <QString>
+
+/* block size used when hashing files */
+#define HASH_BLOCK_SIZE     (64 * 1024)
+
+/*
+ * SHA-256 of the first length bytes of a file.
+ * Returns an empty array when the file can't be read that far.
+ */
+QByteArray hash_file_prefix(const QString &path, qint64 length);
+
+#endif // FILEHASH_H
@@ -0,0 +1,81 @@
+#include "protocol.h"
+#include <QIODevice>
+#include <QStringList>
+#include <QDir>
+#include <QtEndian>
+
+bool is_safe_path(const QString &path)
+{
+    if (path.isEmpty() || path.contains('\\') || QDir::isAbsolutePath(path))
+        return false;
+
+    QStringList parts = path.split('/');
+    for (int i = 0; i < parts.size(); i++) {
+        const QString &part = parts.at(i);
+        if (part.isEmpty() || part == "." || part == "..")
+            return false;
+    }
+
+    return true;
+}
+
+QByteArray make_preface(quint32 features)
+{
+    uchar buf[PREFACE_SIZE];
+
+    qToLittleEndian<quint32>(PROTOCOL_MAGIC, buf);
+    qToLittleEndian<quint32>(PROTOCOL_VERSION, buf + 4);
+    qToLittleEndian<quint32>(features, buf + 8);
+
+    return QByteArray(reinterpret_cast<const char *>(buf), sizeof(buf));
+}
+
+bool read_preface(QIODevice *device, quint32 *magic,
+                  quint32 *version, quint32 *features)
+{
+    if (device->bytesAvailable() < PREFACE_SIZE)
+        return false;
+
+    uchar buf[PREFACE_SIZE];
+    device->read(reinterpret_cast<char *>(buf), sizeof(buf));
+
+    *magic = qFromLittleEndian<quint32>(buf);
+    *version = qFromLittleEndian<quint32>(buf + 4);
+    *features = qFromLittleEndian<quint32>(buf + 8);
+    return true;
+}
+
+QByteArray make_frame_header(qint32 tag, qint64 body_size,
+                             quint32 request_id)
+{
+    uchar buf[FRAME_HEADER_SIZE];
+
+    qToLittleEndian<quint64>(body_size, buf);
+    qToLittleEndian<quint16>(tag, buf + 8);
+    qToLittleEndian<quint16>(0, buf + 10);
+    qToLittleEndian<quint32>(request_id, buf + 12);
+
+    return QByteArray(reinterpret_cast<const char *>(buf), sizeof(buf));
+}
+
+QByteArray make_frame(qint32 tag, const QByteArray &body,
+                      quint32 request_id)
+{
+    return make_frame_header(tag, body.size(), request_id) + body;
+}
+
+bool read_frame_header(QIODevice *device, qint32 *tag, qint64 *body_size,
+                       quint32 *request_id)
+{
+    if (device->bytesAvailable() < FRAME_HEADER_SIZE)
+        return false;
+
+    uchar buf[FRAME_HEADER_SIZE];
+    device->read(reinterpret_cast<char *>(buf), sizeof(buf));
+
+    /* sizes past 2^63 come out negative and are rejected as bad */
+    *body_size = (qint64)qFromLittleEndian<quint64>(buf);
+    *tag = qFromLittleEndian<quint16>(buf + 8);
+    *request_id = qFromLittleEndian<quint32>(buf + 12);
+    return true;
+}
@@ -0,0 +1,100 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QString>
+
+class QIODevice;
+
+/* Server listen port */
+#define LISTEN_PORT 6789
+
+/*
+ * Headers are fixed size little endian, request and response bodies use
+ * the encoding of wire.h.
+ *
+ * Connection preface, sent once by each side right after connecting:
+ *   Magic(quint32) + Version(quint32) + Features(quint32)
+ * The client speaks first. A peer whose first bytes are not the magic
+ * (protocol v1 clients start with an int frame size) is disconnected.
+ * Features are FEATURE_* bits of compress.h.
+ */
+#define PROTOCOL_MAGIC      0x46544450  // "FTDP"
+#define PROTOCOL_VERSION    14
+#define PREFACE_SIZE        (3 * (int)sizeof(quint32))
+
+/*
+ * Frame layout: BodySize(quint64) + TAG(quint16) + Flags(quint16) +
+ *               RequestId(quint32) + Body
+ * BodySize counts the bytes following the header, Flags are reserved
+ * and sent as 0. Every response frame carries the id of the request it
+ * answers, so a client may have many requests outstanding on one
+ * connection. Id 0 is unsolicited.
+ */
+#define FRAME_HEADER_SIZE   16
+
+/* message type tag */
+#define MSG_TAG_SYNC    1       // sync file request
+#define MSG_TAG_FILE    2       // download file
+#define MSG_TAG_LIST    3       // dir list
+#define MSG_TAG_ENTRY   4       // list file entry request
+#define MSG_TAG_MANIFEST 5      // file sizes, mtimes and hashes of a dir
+#define MSG_TAG_DELTA   6       // block delta of one file
+#define MSG_TAG_JOIN    7       // join connection to a stream group
+#define MSG_TAG_RANGE   8       // chunk of a file split over streams
+#define MSG_TAG_ZRANGE  9       // compressed chunk of a file
+#define MSG_TAG_CHECKSUM 10     // CRC-32C trailer of the data just sent
+#define MSG_TAG_BATCH   11      // many small files in one frame
+#define MSG_TAG_COPY    12      // file the client already holds a copy of
+#define MSG_TAG_ERROR   13      // request or file that can't be served
+
+/*
+ * MSG_TAG_BATCH body: Codec(quint32) + RawSize(quint32) + Count(quint32) +
+ * Payload, the payload compressed with Codec (see compress.h) from
+ * RawSize bytes of Count records:
+ *   Name + Size(quint32) + MTime(quint64 ms) + Data + CRC32C(quint32)
+ * encoded as in wire.h. Files up to BATCH_FILE_MAX bytes are packed
+ * until the payload would pass BATCH_MAX_SIZE.
+ */
+#define BATCH_FILE_MAX      (64 * 1024)
+#define BATCH_MAX_SIZE      (1024 * 1024)
+#define BATCH_MAX_FILES     4096
+/* bytes of a record besides its name and data */
+#define BATCH_RECORD_HEAD   (2 + 4 + 8 + 4)
+
+/*
+ * MSG_TAG_COPY body: FileName + FileSize(quint64) + MTime(quint64 ms) +
+ *                    SHA-256(short bytes)
+ * Sent instead of the data of a wanted file whose content the client
+ * said it holds, or that went out earlier on the same connection. The
+ * client copies it from its own copy of that content.
+ */
+
+/*
+ * MSG_TAG_ERROR body: FileName + Reason
+ * The file of a MSG_TAG_FILE or MSG_TAG_DELTA request can't be sent, it
+ * vanished or the request was bad; no more frames come for it. An empty
+ * name fails the whole request, e.g. a listing of an unknown share.
+ */
+
+/*
+ * Paths from the peer are '/' separated and relative to the shared
+ * directory; they must not leave it.
+ */
+bool is_safe_path(const QString &path);
+
+QByteArray make_preface(quint32 features);
+/* false until the whole preface is available */
+bool read_preface(QIODevice *device, quint32 *magic,
+                  quint32 *version, quint32 *features);
+
+QByteArray make_frame_header(qint32 tag, qint64 body_size,
+                             quint32 request_id = 0);
+QByteArray make_frame(qint32 tag, const QByteArray &body,
+                      quint32 request_id = 0);
+/* false until the whole frame header is available */
+bool read_frame_header(QIODevice *device, qint32 *tag, qint64 *body_size,
+                       quint32 *request_id);
+
+#endif // PROTOCOL_H
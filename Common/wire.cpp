@@ -0,0 +1,144 @@
+#include "wire.h"
+#include <QtEndian>
+
+void WireWriter::put_u8(quint8 value)
+{
+    out->append((char)value);
+}
+
+void WireWriter::put_u32(quint32 value)
+{
+    uchar buf[sizeof(value)];
+    qToLittleEndian(value, buf);
+    out->append(reinterpret_cast<const char *>(buf), sizeof(buf));
+}
+
+void WireWriter::put_u64(quint64 value)
+{
+    uchar buf[sizeof(value)];
+    qToLittleEndian(value, buf);
+    out->append(reinterpret_cast<const char *>(buf), sizeof(buf));
+}
+
+void WireWriter::put_name(const QString &name)
+{
+    QByteArray utf8 = name.toUtf8();
+    if (utf8.size() > 0xffff)
+        utf8.truncate(0xffff);
+
+    uchar buf[sizeof(quint16)];
+    qToLittleEndian((quint16)utf8.size(), buf);
+    out->append(reinterpret_cast<const char *>(buf), sizeof(buf));
+    out->append(utf8);
+}
+
+void WireWriter::put_short_bytes(const QByteArray &bytes)
+{
+    int len = qMin(bytes.size(), 0xff);
+    put_u8(len);
+    out->append(bytes.constData(), len);
+}
+
+void WireWriter::put_long_bytes(const QByteArray &bytes)
+{
+    put_u32(bytes.size());
+    out->append(bytes);
+}
+
+void WireWriter::put_bytes(const char *data, int len)
+{
+    out->append(data, len);
+}
+
+char *WireWriter::put_space(int len)
+{
+    int pos = out->size();
+    out->resize(pos + len);
+    return out->data() + pos;
+}
+
+WireReader::WireReader(const QByteArray &in) :
+    p(reinterpret_cast<const uchar *>(in.constData())),
+    end(p + in.size()),
+    ok(true)
+{
+}
+
+bool WireReader::need(qint64 len)
+{
+    if (ok && len >= 0 && end - p >= len)
+        return true;
+    ok = false;
+    return false;
+}
+
+quint8 WireReader::get_u8()
+{
+    if (!need(1))
+        return 0;
+    return *p++;
+}
+
+quint32 WireReader::get_u32()
+{
+    if (!need(sizeof(quint32)))
+        return 0;
+    quint32 value = qFromLittleEndian<quint32>(p);
+    p += sizeof(quint32);
+    return value;
+}
+
+quint64 WireReader::get_u64()
+{
+    if (!need(sizeof(quint64)))
+        return 0;
+    quint64 value = qFromLittleEndian<quint64>(p);
+    p += sizeof(quint64);
+    return value;
+}
+
+QString WireReader::get_name()
+{
+    if (!need(sizeof(quint16)))
+        return QString();
+    int len = qFromLittleEndian<quint16>(p);
+    p += sizeof(quint16);
+    if (!need(len))
+        return QString();
+
+    QString name = QString::fromUtf8(reinterpret_cast<const char *>(p), len);
+    p += len;
+    return name;
+}
+
+QByteArray WireReader::get_short_bytes()
+{
+    int len = get_u8();
+    if (!need(len))
+        return QByteArray();
+
+    QByteArray bytes(reinterpret_cast<const char *>(p), len);
+    p += len;
+    return bytes;
+}
+
+QByteArray WireReader::get_long_bytes()
+{
+    quint32 len = get_u32();
+    if (!need(len))
+        return QByteArray();
+
+    QByteArray bytes(reinterpret_cast<const char *>(p), len);
+    p += len;
+    return bytes;
+}
+
+const uchar *WireReader::get_bytes(qint64 len)
+{
+    if (!need(len))
+        return 0;
+
+    const uchar *bytes = p;
+    p += len;
+    return bytes;
+}
@@ -0,0 +1,64 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <QByteArray>
+#include <QString>
+
+/*
+ * Compact little endian encoding of request bodies, listings, file
+ * frame metadata, batch records and deltas.
+ *
+ * Integers are fixed size little endian, names are Length(quint16) +
+ * UTF-8 bytes. Records are read in place from the frame body, so the
+ * only allocation per entry is the QString of its name.
+ */
+class WireWriter
+{
+public:
+    explicit WireWriter(QByteArray *out) : out(out) {}
+
+    void put_u8(quint8 value);
+    void put_u32(quint32 value);
+    void put_u64(quint64 value);
+    /* names longer than 64K bytes are cut, paths never get there */
+    void put_name(const QString &name);
+    /* Length(quint8) + bytes, for hashes */
+    void put_short_bytes(const QByteArray &bytes);
+    /* Length(quint32) + bytes, for signatures */
+    void put_long_bytes(const QByteArray &bytes);
+    /* len raw bytes, the length is up to the format */
+    void put_bytes(const char *data, int len);
+    /* room for len raw bytes, filled in by the caller */
+    char *put_space(int len);
+
+private:
+    QByteArray *out;
+};
+
+class WireReader
+{
+public:
+    explicit WireReader(const QByteArray &in);
+
+    /* false once a read ran past the end, every later read returns 0 */
+    bool is_ok() const { return ok; }
+    bool at_end() const { return p == end; }
+
+    quint8 get_u8();
+    quint32 get_u32();
+    quint64 get_u64();
+    QString get_name();
+    QByteArray get_short_bytes();
+    QByteArray get_long_bytes();
+    /* the next len raw bytes in place, 0 past the end */
+    const uchar *get_bytes(qint64 len);
+
+private:
+    const uchar *p;
+    const uchar *end;
+    bool ok;
+
+    bool need(qint64 len);
+};
+
+#endif // WIRE_H
@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Headless server, no widgets
+#
+#-------------------------------------------------
+
+QT       += core \
+        network
+QT       -= gui
+
+TARGET = filetransd
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+
+SOURCES += main.cpp \
+        daemon.cpp
+
+HEADERS  += daemon.h
+
+include(../Server/engine.pri)
@@ -0,0 +1,199 @@
+#include "daemon.h"
+#include "transferserver.h"
+#include "metricsserver.h"
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSettings>
+#include <QStringList>
+
+DaemonConfig::DaemonConfig() :
+    port(LISTEN_PORT),
+    workers(0),
+    high_water(SEND_HIGH_WATER),
+    chunk_size(SEND_CHUNK_SIZE),
+    zero_copy(true),
+    compression(true),
+    metrics_port(0),
+    rate(0),
+    client_rate(0),
+    share_rate(0)
+{
+}
+
+bool DaemonConfig::load(const QString &file, QString *error)
+{
+    if (!QFileInfo(file).isFile()) {
+        *error = QString("%1: no such file").arg(file);
+        return false;
+    }
+
+    QSettings settings(file, QSettings::IniFormat);
+    if (settings.status() != QSettings::NoError) {
+        *error = QString("%1: bad format").arg(file);
+        return false;
+    }
+
+    settings.beginGroup("server");
+    uint value = settings.value("port", port).toUInt();
+    if (value == 0 || value > 65535) {
+        *error = QString("%1: bad port").arg(file);
+        return false;
+    }
+    port = value;
+    workers = settings.value("workers", workers).toInt();
+    if (workers < 0) {
+        *error = QString("%1: bad workers").arg(file);
+        return false;
+    }
+    high_water = settings.value("high_water", high_water).toLongLong();
+    if (high_water <= 0) {
+        *error = QString("%1: bad high_water").arg(file);
+        return false;
+    }
+    chunk_size = settings.value("chunk_size", chunk_size).toInt();
+    if (chunk_size < MIN_CHUNK_SIZE || chunk_size > MAX_CHUNK_SIZE) {
+        *error = QString("%1: bad chunk_size").arg(file);
+        return false;
+    }
+    zero_copy = settings.value("zero_copy", zero_copy).toBool();
+    compression = settings.value("compression", compression).toBool();
+    value = settings.value("metrics_port", metrics_port).toUInt();
+    if (value > 65535) {
+        *error = QString("%1: bad metrics_port").arg(file);
+        return false;
+    }
+    metrics_port = value;
+    rate = settings.value("rate", rate).toLongLong();
+    client_rate = settings.value("client_rate", client_rate).toLongLong();
+    share_rate = settings.value("share_rate", share_rate).toLongLong();
+    if (rate < 0 || client_rate < 0 || share_rate < 0) {
+        *error = QString("%1: bad rate").arg(file);
+        return false;
+    }
+    settings.endGroup();
+
+    settings.beginGroup("shares");
+    QStringList names = settings.childKeys();
+    for (int i = 0; i < names.size(); i++) {
+        QString path = settings.value(names.at(i)).toString();
+        if (!add_share(names.at(i) + "=" + path, error))
+            return false;
+    }
+    settings.endGroup();
+
+    settings.beginGroup("share_rates");
+    names = settings.childKeys();
+    for (int i = 0; i < names.size(); i++) {
+        bool ok;
+        qint64 share_limit = settings.value(names.at(i)).toLongLong(&ok);
+        if (!ok || share_limit < 0) {
+            *error = QString("%1: bad rate of %2").arg(file, names.at(i));
+            return false;
+        }
+        share_rates.insert(names.at(i), share_limit);
+    }
+    settings.endGroup();
+
+    return true;
+}
+
+bool DaemonConfig::add_share(const QString &spec, QString *error)
+{
+    QString name;
+    QString path = spec;
+    int sep = spec.indexOf('=');
+    if (sep >= 0) {
+        name = spec.left(sep);
+        path = spec.mid(sep + 1);
+    }
+
+    QFileInfo dir(path);
+    if (!dir.isDir()) {
+        *error = QString("%1: not a directory").arg(path);
+        return false;
+    }
+    if (name.isEmpty())
+        name = QDir(dir.absoluteFilePath()).dirName();
+
+    /* names end up in client paths, keep them one component */
+    if (name.isEmpty() || name.contains('/') || name == "." || name == "..") {
+        *error = QString("%1: bad share name").arg(spec);
+        return false;
+    }
+
+    shares.insert(name, dir.absoluteFilePath());
+    return true;
+}
+
+Daemon::Daemon(const DaemonConfig &config, QObject *parent) :
+    QObject(parent),
+    config(config),
+    tcp_server(0),
+    metrics_server(0)
+{
+}
+
+Daemon::~Daemon()
+{
+    /* workers read shared_dirs until their threads are joined */
+    delete metrics_server;
+    delete tcp_server;
+}
+
+bool Daemon::start(QString *error)
+{
+    QHash<QString, QString>::const_iterator it = config.shares.constBegin();
+    for (; it != config.shares.constEnd(); ++it) {
+        qDebug() << "Sharing " << it.key() << " " << it.value();
+        shared_dirs.insert(it.key(), it.value());
+    }
+
+    tcp_server = new TransferServer(&shared_dirs, config.workers);
+    tcp_server->set_high_water_mark(config.high_water);
+    tcp_server->set_chunk_size(config.chunk_size);
+    tcp_server->set_zero_copy(config.zero_copy);
+    tcp_server->set_compression(config.compression);
+    tcp_server->set_rate_limits(config.rate, config.client_rate,
+                                config.share_rate);
+    QHash<QString, qint64>::const_iterator rate =
+            config.share_rates.constBegin();
+    for (; rate != config.share_rates.constEnd(); ++rate)
+        tcp_server->set_share_rate(rate.key(), rate.value());
+
+    connect(tcp_server, SIGNAL(session_opened(quint64,QString,quint16)),
+            this, SLOT(handle_connect(quint64,QString,quint16)));
+    connect(tcp_server, SIGNAL(session_closed(quint64)),
+            this, SLOT(handle_disconnect(quint64)));
+
+    if (!tcp_server->listen(QHostAddress::AnyIPv4, config.port)) {
+        *error = tcp_server->errorString();
+        return false;
+    }
+
+    qDebug() << "Listening on " << config.port;
+
+    if (config.metrics_port) {
+        metrics_server = new MetricsServer(tcp_server->get_stats());
+        if (!metrics_server->listen(QHostAddress::LocalHost,
+                                    config.metrics_port)) {
+            *error = "metrics: " + metrics_server->errorString();
+            return false;
+        }
+        qDebug() << "Metrics on 127.0.0.1:" << config.metrics_port;
+    }
+    return true;
+}
+
+void Daemon::handle_connect(quint64 id, QString ip, quint16 port)
+{
+    QString peer = QString("%1:%2").arg(ip).arg(port);
+
+    qDebug() << "Client: " << peer;
+    clients.insert(id, peer);
+}
+
+void Daemon::handle_disconnect(quint64 id)
+{
+    qDebug() << "Closed: " << clients.take(id);
+}
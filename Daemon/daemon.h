@@ -0,0 +1,87 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <QObject>
+#include <QHash>
+#include <QString>
+#include "shareddirs.h"
+
+class TransferServer;
+class MetricsServer;
+
+/*
+ * Settings of the headless server. A config file looks like
+ *
+ *   [server]
+ *   port=6789
+ *   workers=0
+ *   high_water=4194304
+ *   chunk_size=262144
+ *   zero_copy=true
+ *   compression=true
+ *   metrics_port=9100
+ *   rate=0
+ *   client_rate=0
+ *   share_rate=0
+ *
+ *   [shares]
+ *   photos=/srv/photos
+ *
+ *   [share_rates]
+ *   photos=10485760
+ *
+ * and the command line overrides what it sets.
+ */
+struct DaemonConfig
+{
+    DaemonConfig();
+
+    /* false with error set when file can not be used */
+    bool load(const QString &file, QString *error);
+    /* "name=path", or "path" shared under its last component */
+    bool add_share(const QString &spec, QString *error);
+
+    quint16 port;
+    /* transfer threads, 0 for one per core */
+    int workers;
+    qint64 high_water;
+    int chunk_size;
+    bool zero_copy;
+    bool compression;
+    /* Prometheus text on 127.0.0.1:metrics_port, 0 for none */
+    quint16 metrics_port;
+    /* egress limits in bytes per second, 0 for none */
+    qint64 rate;
+    qint64 client_rate;
+    qint64 share_rate;
+    /* share name -> its own share_rate */
+    QHash<QString, qint64> share_rates;
+    /* share name -> absolute directory */
+    QHash<QString, QString> shares;
+};
+
+/* TransferServer and shared directories without a window */
+class Daemon : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit Daemon(const DaemonConfig &config, QObject *parent = 0);
+    ~Daemon();
+
+    bool start(QString *error);
+
+private slots:
+    void handle_connect(quint64 id, QString ip, quint16 port);
+    void handle_disconnect(quint64 id);
+
+private:
+    DaemonConfig config;
+    TransferServer *tcp_server;
+    MetricsServer *metrics_server;
+    SharedDirs shared_dirs;
+    /* session id -> peer, for the log */
+    QHash<quint64, QString> clients;
+};
+
+#endif // DAEMON_H
@@ -0,0 +1,135 @@
+#include "daemon.h"
+#include "session.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <stdio.h>
+
+static int fail(const QString &error)
+{
+    fprintf(stderr, "filetransd: %s\n", error.toLocal8Bit().constData());
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("filetransd");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless server of FileTransDemo.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("shares",
+                                 "Directories to share, as [name=]path.",
+                                 "[[name=]path...]");
+
+    QCommandLineOption config_option(QStringList() << "c" << "config",
+                                     "Read settings and shares from <file>.",
+                                     "file");
+    QCommandLineOption port_option(QStringList() << "p" << "port",
+                                   "Listen on <port>.", "port");
+    QCommandLineOption workers_option(QStringList() << "w" << "workers",
+                                      "Transfer threads, 0 for one per "
+                                      "core.", "count");
+    QCommandLineOption metrics_option("metrics-port",
+                                      "Serve Prometheus metrics on "
+                                      "127.0.0.1:<port>.", "port");
+    QCommandLineOption chunk_option("chunk-size",
+                                    "Read file data in <bytes> blocks when "
+                                    "not using sendfile().", "bytes");
+    QCommandLineOption no_zero_copy_option("no-zero-copy",
+                                           "Read file data instead of "
+                                           "using sendfile().");
+    QCommandLineOption no_compression_option("no-compression",
+                                             "Never compress file data.");
+    QCommandLineOption rate_option("rate",
+                                   "Send at most <bytes> per second in "
+                                   "total.", "bytes");
+    QCommandLineOption client_rate_option("client-rate",
+                                          "Send at most <bytes> per second "
+                                          "to one client address.", "bytes");
+    QCommandLineOption share_rate_option("share-rate",
+                                         "Send at most <bytes> per second "
+                                         "from one share.", "bytes");
+    parser.addOption(config_option);
+    parser.addOption(port_option);
+    parser.addOption(workers_option);
+    parser.addOption(metrics_option);
+    parser.addOption(chunk_option);
+    parser.addOption(no_zero_copy_option);
+    parser.addOption(no_compression_option);
+    parser.addOption(rate_option);
+    parser.addOption(client_rate_option);
+    parser.addOption(share_rate_option);
+    parser.process(a);
+
+    DaemonConfig config;
+    QString error;
+
+    if (parser.isSet(config_option) &&
+            !config.load(parser.value(config_option), &error))
+        return fail(error);
+
+    if (parser.isSet(port_option)) {
+        bool ok;
+        uint port = parser.value(port_option).toUInt(&ok);
+        if (!ok || port == 0 || port > 65535)
+            return fail("bad port");
+        config.port = port;
+    }
+    if (parser.isSet(workers_option)) {
+        bool ok;
+        config.workers = parser.value(workers_option).toInt(&ok);
+        if (!ok || config.workers < 0)
+            return fail("bad worker count");
+    }
+    if (parser.isSet(metrics_option)) {
+        bool ok;
+        uint port = parser.value(metrics_option).toUInt(&ok);
+        if (!ok || port == 0 || port > 65535)
+            return fail("bad metrics port");
+        config.metrics_port = port;
+    }
+    if (parser.isSet(chunk_option)) {
+        bool ok;
+        config.chunk_size = parser.value(chunk_option).toInt(&ok);
+        if (!ok || config.chunk_size < MIN_CHUNK_SIZE ||
+                config.chunk_size > MAX_CHUNK_SIZE)
+            return fail("bad chunk size");
+    }
+    if (parser.isSet(no_zero_copy_option))
+        config.zero_copy = false;
+    if (parser.isSet(no_compression_option))
+        config.compression = false;
+    if (parser.isSet(rate_option)) {
+        bool ok;
+        config.rate = parser.value(rate_option).toLongLong(&ok);
+        if (!ok || config.rate < 0)
+            return fail("bad rate");
+    }
+    if (parser.isSet(client_rate_option)) {
+        bool ok;
+        config.client_rate = parser.value(client_rate_option).toLongLong(&ok);
+        if (!ok || config.client_rate < 0)
+            return fail("bad client rate");
+    }
+    if (parser.isSet(share_rate_option)) {
+        bool ok;
+        config.share_rate = parser.value(share_rate_option).toLongLong(&ok);
+        if (!ok || config.share_rate < 0)
+            return fail("bad share rate");
+    }
+
+    QStringList shares = parser.positionalArguments();
+    for (int i = 0; i < shares.size(); i++) {
+        if (!config.add_share(shares.at(i), &error))
+            return fail(error);
+    }
+    if (config.shares.isEmpty())
+        return fail("nothing to share, see --help");
+
+    Daemon daemon(config);
+    if (!daemon.start(&error))
+        return fail(error);
+
+    return a.exec();
+}
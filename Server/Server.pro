@@ -19,3 +19,5 @@ SOURCES += main.cpp\
 HEADERS  += server.h
 
 FORMS    += server.ui
+
+include(engine.pri)
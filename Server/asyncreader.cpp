@@ -0,0 +1,508 @@
+#include "asyncreader.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "filehash.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSocketNotifier>
+#include <QThreadPool>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
+
+ReadFile::~ReadFile()
+{
+    if (fd >= 0)
+        ::close(fd);
+}
+
+/* blocking reads of the fallback backend, shared by all workers */
+class DiskPool : public QThreadPool
+{
+public:
+    DiskPool() { setMaxThreadCount(DISK_THREADS); }
+};
+
+static DiskPool *disk_pool()
+{
+    static DiskPool pool;
+    return &pool;
+}
+
+/* hand a finished request to the owner's reap(), pool threads only */
+template <class T>
+static void queue_done(DoneQueue *queue, QList<QSharedPointer<T> > *list,
+                       const QSharedPointer<T> &request)
+{
+    QMutexLocker locker(&queue->lock);
+    if (!queue->owner)
+        return;
+
+    bool idle = queue->is_empty();
+    list->append(request);
+    if (idle)
+        QMetaObject::invokeMethod(queue->owner, "reap",
+                                  Qt::QueuedConnection);
+}
+
+/* pread() until length bytes are in, the end of file or an error */
+static qint64 pread_full(int fd, char *buffer, qint64 length, qint64 offset)
+{
+    qint64 filled = 0;
+
+    while (filled < length) {
+        ssize_t n = ::pread(fd, buffer + filled, length - filled,
+                            offset + filled);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        if (n == 0)
+            break;
+        filled += n;
+    }
+    return filled;
+}
+
+/* pread() all of a request on a pool thread */
+class PreadTask : public QRunnable
+{
+public:
+    PreadTask(const QSharedPointer<ReadRequest> &request,
+              const QSharedPointer<DoneQueue> &queue) :
+        request(request),
+        queue(queue)
+    {
+    }
+
+    void run()
+    {
+        qint64 result = pread_full(request->file->fd, request->buffer,
+                                   request->length, request->offset);
+
+        request->filled = qMax(result, (qint64)0);
+        request->result = result;
+        request->done.storeRelease(1);
+        queue_done(queue.data(), &queue->list, request);
+    }
+
+private:
+    QSharedPointer<ReadRequest> request;
+    QSharedPointer<DoneQueue> queue;
+};
+
+/* hash_file_prefix() of a request on a pool thread */
+class HashTask : public QRunnable
+{
+public:
+    HashTask(const QSharedPointer<HashRequest> &request,
+             const QSharedPointer<DoneQueue> &queue) :
+        request(request),
+        queue(queue)
+    {
+    }
+
+    void run()
+    {
+        request->result = hash_file_prefix(request->path, request->length);
+        request->done.storeRelease(1);
+        queue_done(queue.data(), &queue->hashes, request);
+    }
+
+private:
+    QSharedPointer<HashRequest> request;
+    QSharedPointer<DoneQueue> queue;
+};
+
+/* read one step of a delta scan and feed it to the encoder */
+class DeltaTask : public QRunnable
+{
+public:
+    DeltaTask(const QSharedPointer<DeltaRequest> &request,
+              const QSharedPointer<DoneQueue> &queue) :
+        request(request),
+        queue(queue)
+    {
+    }
+
+    void run()
+    {
+        QByteArray block(request->length, Qt::Uninitialized);
+        qint64 result = pread_full(request->file->fd, block.data(),
+                                   request->length, request->offset);
+
+        if (result > 0)
+            request->encoder->feed(block.constData(), result);
+        /* the file shrank or can't be read: send what is there */
+        if (result < request->length)
+            request->last = true;
+        if (request->last)
+            request->encoder->finish();
+
+        request->result = result;
+        request->done.storeRelease(1);
+        queue_done(queue.data(), &queue->deltas, request);
+    }
+
+private:
+    QSharedPointer<DeltaRequest> request;
+    QSharedPointer<DoneQueue> queue;
+};
+
+/* read the files of a batch on a pool thread */
+class BatchTask : public QRunnable
+{
+public:
+    BatchTask(const QSharedPointer<BatchRequest> &request,
+              const QSharedPointer<DoneQueue> &queue) :
+        request(request),
+        queue(queue)
+    {
+    }
+
+    void run()
+    {
+        for (int i = 0; i < request->files.size(); i++)
+            read_file(&request->files[i]);
+
+        request->done.storeRelease(1);
+        queue_done(queue.data(), &queue->batches, request);
+    }
+
+private:
+    QSharedPointer<BatchRequest> request;
+    QSharedPointer<DoneQueue> queue;
+
+    static void read_file(BatchFile *batch_file)
+    {
+        QFile file(batch_file->path);
+        if (!file.open(QFile::ReadOnly | QFile::Unbuffered)) {
+            batch_file->status = READ_OPEN_FAILED;
+            return;
+        }
+
+        batch_file->size = file.size();
+        if (batch_file->size > batch_file->max_size) {
+            batch_file->status = READ_TOO_LARGE;
+            return;
+        }
+
+        batch_file->mtime = QFileInfo(file).lastModified().toMSecsSinceEpoch();
+        batch_file->data.resize(batch_file->size);
+        qint64 len = batch_file->size > 0 ?
+                    file.read(batch_file->data.data(), batch_file->size) : 0;
+        if (len != batch_file->size) {
+            batch_file->status = READ_SHORT;
+            batch_file->data.clear();
+            return;
+        }
+
+        batch_file->crc = crc32c(0, batch_file->data.constData(),
+                                 batch_file->size);
+    }
+};
+
+DiskReader::DiskReader(QObject *parent) :
+    QObject(parent),
+    done_queue(new DoneQueue),
+    started(false)
+#ifdef HAVE_LIBURING
+    ,
+    ring(0),
+    event_fd(-1),
+    notifier(0),
+    in_flight(0)
+#endif
+{
+    done_queue->owner = this;
+}
+
+DiskReader::~DiskReader()
+{
+    {
+        QMutexLocker locker(&done_queue->lock);
+        done_queue->owner = 0;
+    }
+
+#ifdef HAVE_LIBURING
+    if (!ring)
+        return;
+
+    /* the kernel writes into request buffers until they complete */
+    while (in_flight > 0) {
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(ring, &cqe) < 0)
+            break;
+        delete (QSharedPointer<ReadRequest> *)io_uring_cqe_get_data(cqe);
+        io_uring_cqe_seen(ring, cqe);
+        in_flight--;
+    }
+    io_uring_queue_exit(ring);
+    delete ring;
+    ::close(event_fd);
+#endif
+}
+
+/*
+ * Start reading request->length bytes at request->offset into
+ * request->buffer, which must be that large. request->waiter's pump()
+ * is queued on this thread once the read is done.
+ */
+void DiskReader::submit(const QSharedPointer<ReadRequest> &request)
+{
+    /* set up on first use, on the thread the reader lives in */
+    if (!started) {
+        started = true;
+#ifdef HAVE_LIBURING
+        if (!start_ring())
+            qDebug() << "io_uring unavailable, reading on a thread pool";
+#endif
+    }
+
+#ifdef HAVE_LIBURING
+    if (ring) {
+        backlog.enqueue(request);
+        submit_ring();
+        return;
+    }
+#endif
+
+    disk_pool()->start(new PreadTask(request, done_queue));
+}
+
+/*
+ * Hash the first request->length bytes of request->path. Queues
+ * request->waiter's pump() on this thread once request->result is set.
+ */
+void DiskReader::hash(const QSharedPointer<HashRequest> &request)
+{
+    disk_pool()->start(new HashTask(request, done_queue));
+}
+
+/*
+ * Read and encode one step of a delta scan on the pool. Queues
+ * request->waiter's pump() on this thread once request->result is set.
+ */
+void DiskReader::scan(const QSharedPointer<DeltaRequest> &request)
+{
+    disk_pool()->start(new DeltaTask(request, done_queue));
+}
+
+/*
+ * Read the files of request on the pool, in order. Queues
+ * request->waiter's pump() on this thread once all of them are done.
+ */
+void DiskReader::read_batch(const QSharedPointer<BatchRequest> &request)
+{
+    disk_pool()->start(new BatchTask(request, done_queue));
+}
+
+QSharedPointer<BufferPool> DiskReader::get_pool(int size)
+{
+    QSharedPointer<BufferPool> &pool = pools[size];
+    if (!pool)
+        pool = QSharedPointer<BufferPool>(new BufferPool(size));
+    return pool;
+}
+
+/* wake whoever still waits for the requests of list */
+template <class T>
+static void wake_waiters(const QList<QSharedPointer<T> > &list)
+{
+    for (int i = 0; i < list.size(); i++) {
+        if (list.at(i)->waiter)
+            QMetaObject::invokeMethod(list.at(i)->waiter, "pump",
+                                      Qt::QueuedConnection);
+    }
+}
+
+void DiskReader::reap()
+{
+    QList<QSharedPointer<ReadRequest> > list;
+    QList<QSharedPointer<HashRequest> > hashes;
+    QList<QSharedPointer<DeltaRequest> > deltas;
+    QList<QSharedPointer<BatchRequest> > batches;
+    {
+        QMutexLocker locker(&done_queue->lock);
+        list.swap(done_queue->list);
+        hashes.swap(done_queue->hashes);
+        deltas.swap(done_queue->deltas);
+        batches.swap(done_queue->batches);
+    }
+    wake_waiters(hashes);
+    wake_waiters(deltas);
+    wake_waiters(batches);
+    for (int i = 0; i < list.size(); i++)
+        finish(list.at(i));
+
+#ifdef HAVE_LIBURING
+    if (ring)
+        reap_ring();
+#endif
+}
+
+/* wake whoever still waits for request */
+void DiskReader::finish(const QSharedPointer<ReadRequest> &request)
+{
+    if (request->waiter)
+        QMetaObject::invokeMethod(request->waiter, "pump",
+                                  Qt::QueuedConnection);
+}
+
+#ifdef HAVE_LIBURING
+bool DiskReader::start_ring()
+{
+    ring = new struct io_uring;
+    if (io_uring_queue_init(RING_ENTRIES, ring, 0) < 0) {
+        delete ring;
+        ring = 0;
+        return false;
+    }
+
+    event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0 || io_uring_register_eventfd(ring, event_fd) < 0) {
+        if (event_fd >= 0)
+            ::close(event_fd);
+        event_fd = -1;
+        io_uring_queue_exit(ring);
+        delete ring;
+        ring = 0;
+        return false;
+    }
+
+    notifier = new QSocketNotifier(event_fd, QSocketNotifier::Read, this);
+    connect(notifier, SIGNAL(activated(int)),
+            this, SLOT(reap()));
+    return true;
+}
+
+/* move the backlog into the submission queue, as far as it fits */
+void DiskReader::submit_ring()
+{
+    int queued = 0;
+
+    while (!backlog.isEmpty() && in_flight < RING_ENTRIES) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+        if (!sqe)
+            break;
+
+        QSharedPointer<ReadRequest> request = backlog.dequeue();
+        io_uring_prep_read(sqe, request->file->fd,
+                           request->buffer + request->filled,
+                           request->length - request->filled,
+                           request->offset + request->filled);
+        io_uring_sqe_set_data(sqe, new QSharedPointer<ReadRequest>(request));
+        in_flight++;
+        queued++;
+    }
+
+    if (queued)
+        io_uring_submit(ring);
+}
+
+void DiskReader::reap_ring()
+{
+    quint64 count;
+    if (::read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        qDebug() << "eventfd read failed";
+
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(ring, &cqe) == 0) {
+        QSharedPointer<ReadRequest> *slot =
+                (QSharedPointer<ReadRequest> *)io_uring_cqe_get_data(cqe);
+        QSharedPointer<ReadRequest> request = *slot;
+        int res = cqe->res;
+
+        delete slot;
+        io_uring_cqe_seen(ring, cqe);
+        in_flight--;
+
+        if (res == -EINTR || res == -EAGAIN) {
+            backlog.enqueue(request);
+            continue;
+        }
+        if (res > 0) {
+            request->filled += res;
+            if (request->filled < request->length) {
+                /* short read, not necessarily the end of the file */
+                backlog.enqueue(request);
+                continue;
+            }
+        }
+
+        request->result = res < 0 ? res : request->filled;
+        request->done.storeRelease(1);
+        finish(request);
+    }
+
+    submit_ring();
+}
+#endif
+
+ReadAhead::ReadAhead(DiskReader *reader, QObject *waiter, int fd,
+                     qint64 offset, qint64 length, qint64 block_size) :
+    reader(reader),
+    waiter(waiter),
+    file(new ReadFile(::dup(fd))),
+    next_offset(offset),
+    end(offset + length),
+    block_size(block_size),
+    pool(reader->get_pool(block_size))
+{
+#ifdef Q_OS_LINUX
+    if (file->fd >= 0)
+        ::posix_fadvise(file->fd, offset, length, POSIX_FADV_SEQUENTIAL);
+#endif
+    fill();
+}
+
+ReadAhead::~ReadAhead()
+{
+    /* reads in flight finish on their own, nobody is woken for them */
+    for (int i = 0; i < pending.size(); i++)
+        pending.at(i)->waiter = 0;
+}
+
+int ReadAhead::take(QByteArray *block)
+{
+    if (pending.isEmpty() || !pending.head()->done.loadAcquire())
+        return pending.isEmpty() ? -1 : 0;
+
+    /* the previous block's buffer goes back to the pool first */
+    current = pending.dequeue();
+    fill();
+
+    if (current->result < 0) {
+        qDebug() << "Read error " << -current->result;
+        return -1;
+    }
+
+    *block = QByteArray::fromRawData(current->buffer, current->result);
+    return 1;
+}
+
+void ReadAhead::fill()
+{
+    while (pending.size() < READ_AHEAD_DEPTH && next_offset < end) {
+        QSharedPointer<ReadRequest> request(new ReadRequest);
+
+        request->file = file;
+        request->offset = next_offset;
+        request->length = qMin(block_size, end - next_offset);
+        request->pool = pool;
+        request->buffer = pool->take();
+        request->waiter = waiter;
+        reader->submit(request);
+
+        pending.enqueue(request);
+        next_offset += request->length;
+    }
+}
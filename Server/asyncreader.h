@@ -0,0 +1,229 @@
+#ifndef ASYNCREADER_H
+#define ASYNCREADER_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QPointer>
+#include <QQueue>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+#include "bufferpool.h"
+
+class QSocketNotifier;
+class DeltaEncoder;
+
+/* reads kept in flight per file, and their default size */
+#define READ_AHEAD_DEPTH    4
+#define READ_AHEAD_SIZE     (256 * 1024)
+/* threads doing blocking pread() when io_uring is not available */
+#define DISK_THREADS        4
+/* submission queue size of a worker's ring */
+#define RING_ENTRIES        64
+
+/* how a file of a BatchRequest was read, see BatchFile */
+#define READ_OK             0
+#define READ_OPEN_FAILED    1
+#define READ_TOO_LARGE      2
+#define READ_SHORT          3
+
+/* an fd that stays open until the last read of it is done */
+struct ReadFile
+{
+    explicit ReadFile(int fd) : fd(fd) {}
+    ~ReadFile();
+
+    int fd;
+};
+
+/* one positional read, shared by its submitter and the backend */
+struct ReadRequest
+{
+    ReadRequest() : offset(0), length(0), buffer(0), filled(0), result(0) {}
+    ~ReadRequest() { if (pool) pool->give(buffer); }
+
+    QSharedPointer<ReadFile> file;
+    qint64 offset;
+    qint64 length;
+    /* length bytes from pool */
+    QSharedPointer<BufferPool> pool;
+    char *buffer;
+    /* bytes in buffer so far, short reads are continued */
+    qint64 filled;
+    /* bytes read or -errno, valid once done is set */
+    qint64 result;
+    QAtomicInt done;
+    /* pump() of waiter is called on completion, worker thread only */
+    QPointer<QObject> waiter;
+};
+
+/* SHA-256 of the first length bytes of a file, see DiskReader::hash() */
+struct HashRequest
+{
+    HashRequest() : length(0) {}
+
+    QString path;
+    qint64 length;
+    /* empty when the file can't be read that far, valid once done */
+    QByteArray result;
+    QAtomicInt done;
+    /* pump() of waiter is called on completion, worker thread only */
+    QPointer<QObject> waiter;
+};
+
+/*
+ * One step of a delta scan, see DiskReader::scan(): length bytes at
+ * offset are read and fed to encoder, which is finished after the last
+ * step. Steps of one encoder must not overlap.
+ */
+struct DeltaRequest
+{
+    DeltaRequest() : offset(0), length(0), last(false), result(0) {}
+
+    QSharedPointer<ReadFile> file;
+    QSharedPointer<DeltaEncoder> encoder;
+    qint64 offset;
+    qint64 length;
+    /* this step ends the file, also set by a short read */
+    bool last;
+    /* bytes fed or -errno, valid once done is set */
+    qint64 result;
+    QAtomicInt done;
+    /* pump() of waiter is called on completion, worker thread only */
+    QPointer<QObject> waiter;
+};
+
+/* one file of a BatchRequest */
+struct BatchFile
+{
+    BatchFile() : max_size(0), size(0), mtime(0), crc(0), status(READ_OK) {}
+
+    QString path;
+    /* larger files are not read, only their size is set */
+    qint64 max_size;
+    /* READ_OK: all of the file, with its mtime in ms and CRC-32C */
+    QByteArray data;
+    qint64 size;
+    qint64 mtime;
+    quint32 crc;
+    int status;
+};
+
+/* small files read one after the other, see DiskReader::read_batch() */
+struct BatchRequest
+{
+    QVector<BatchFile> files;
+    QAtomicInt done;
+    /* pump() of waiter is called on completion, worker thread only */
+    QPointer<QObject> waiter;
+};
+
+/* completions of the thread pool backend, outlives its DiskReader */
+struct DoneQueue
+{
+    DoneQueue() : owner(0) {}
+
+    /* a reap() is queued already while any list is not empty */
+    bool is_empty() const
+    {
+        return list.isEmpty() && hashes.isEmpty() && deltas.isEmpty() &&
+                batches.isEmpty();
+    }
+
+    QMutex lock;
+    QList<QSharedPointer<ReadRequest> > list;
+    QList<QSharedPointer<HashRequest> > hashes;
+    QList<QSharedPointer<DeltaRequest> > deltas;
+    QList<QSharedPointer<BatchRequest> > batches;
+    /* null once the DiskReader is gone */
+    QObject *owner;
+};
+
+/*
+ * Asynchronous disk reads of one worker thread.
+ *
+ * Reads go to an io_uring when the kernel and liburing allow it, to a
+ * small pread() thread pool otherwise. Either way the worker's event
+ * loop never waits for the disk: completions are reaped on the worker
+ * thread and wake the session that asked for them.
+ */
+class DiskReader : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DiskReader(QObject *parent = 0);
+    ~DiskReader();
+
+    void submit(const QSharedPointer<ReadRequest> &request);
+    /* hash on the pool threads whatever the backend, it reads and sums */
+    void hash(const QSharedPointer<HashRequest> &request);
+    /* the same for a delta scan step and a batch of small files */
+    void scan(const QSharedPointer<DeltaRequest> &request);
+    void read_batch(const QSharedPointer<BatchRequest> &request);
+    /* read buffers of size bytes, shared by the files of this thread */
+    QSharedPointer<BufferPool> get_pool(int size);
+
+private slots:
+    void reap();
+
+private:
+    QSharedPointer<DoneQueue> done_queue;
+    QHash<int, QSharedPointer<BufferPool> > pools;
+    bool started;
+#ifdef HAVE_LIBURING
+    struct io_uring *ring;
+    int event_fd;
+    QSocketNotifier *notifier;
+    int in_flight;
+    /* requests that did not fit into the submission queue */
+    QQueue<QSharedPointer<ReadRequest> > backlog;
+
+    bool start_ring();
+    void submit_ring();
+    void reap_ring();
+#endif
+
+    void finish(const QSharedPointer<ReadRequest> &request);
+};
+
+/*
+ * Read-ahead of [offset, offset + length) of one file: up to
+ * READ_AHEAD_DEPTH reads of block_size bytes are in flight, and the
+ * blocks are handed out in file order.
+ */
+class ReadAhead
+{
+public:
+    ReadAhead(DiskReader *reader, QObject *waiter, int fd, qint64 offset,
+              qint64 length, qint64 block_size = READ_AHEAD_SIZE);
+    ~ReadAhead();
+
+    /*
+     * 1 with the next block, shorter than block_size only at the end
+     * of the range or if the file shrank; 0 while it is still being
+     * read, waiter's pump() is called when it is in; -1 on error.
+     * block points into a pooled buffer that stays valid until the
+     * next take(), changing it makes a copy.
+     */
+    int take(QByteArray *block);
+
+private:
+    DiskReader *reader;
+    QPointer<QObject> waiter;
+    QSharedPointer<ReadFile> file;
+    qint64 next_offset;
+    qint64 end;
+    qint64 block_size;
+    QSharedPointer<BufferPool> pool;
+    QQueue<QSharedPointer<ReadRequest> > pending;
+    /* owner of the block last handed out */
+    QSharedPointer<ReadRequest> current;
+
+    void fill();
+};
+
+#endif // ASYNCREADER_H
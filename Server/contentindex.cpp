@@ -0,0 +1,61 @@
+#include "contentindex.h"
+
+void ContentIndex::set(const QString &path, const QByteArray &hash)
+{
+    QMutexLocker locker(&lock);
+
+    QHash<QString, QByteArray>::iterator it = path_hashes.find(path);
+    if (it != path_hashes.end()) {
+        if (*it == hash)
+            return;
+        drop(*it);
+        *it = hash;
+    } else {
+        path_hashes.insert(path, hash);
+    }
+    counts[hash]++;
+}
+
+void ContentIndex::remove(const QString &path)
+{
+    QMutexLocker locker(&lock);
+
+    QHash<QString, QByteArray>::iterator it = path_hashes.find(path);
+    if (it == path_hashes.end())
+        return;
+    drop(*it);
+    path_hashes.erase(it);
+}
+
+void ContentIndex::forget(const QString &root)
+{
+    if (root.isEmpty())
+        return;
+
+    QMutexLocker locker(&lock);
+    QString prefix = root.endsWith('/') ? root : root + "/";
+
+    QHash<QString, QByteArray>::iterator it = path_hashes.begin();
+    while (it != path_hashes.end()) {
+        if (it.key().startsWith(prefix)) {
+            drop(*it);
+            it = path_hashes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int ContentIndex::copies(const QByteArray &hash) const
+{
+    QMutexLocker locker(&lock);
+    return counts.value(hash);
+}
+
+/* lock held */
+void ContentIndex::drop(const QByteArray &hash)
+{
+    QHash<QByteArray, int>::iterator it = counts.find(hash);
+    if (it != counts.end() && --*it <= 0)
+        counts.erase(it);
+}
@@ -0,0 +1,40 @@
+#ifndef CONTENTINDEX_H
+#define CONTENTINDEX_H
+
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+
+/*
+ * Content hashes over every shared directory: SHA-256 -> number of
+ * files holding it. Fed by DirIndex as it hashes files, so it covers
+ * what manifests have been built for. Sessions ask it whether content
+ * they send turns up more than once, and is worth remembering for a
+ * MSG_TAG_COPY later on.
+ */
+class ContentIndex
+{
+public:
+    ContentIndex() {}
+
+    /* absolute path now holds hash, replacing what it held before */
+    void set(const QString &path, const QByteArray &hash);
+    /* path is gone or its content is no longer known */
+    void remove(const QString &path);
+    /* forget every path below root */
+    void forget(const QString &root);
+    /* files known to hold hash */
+    int copies(const QByteArray &hash) const;
+
+private:
+    mutable QMutex lock;
+    QHash<QString, QByteArray> path_hashes;
+    QHash<QByteArray, int> counts;
+
+    void drop(const QByteArray &hash);
+
+    Q_DISABLE_COPY(ContentIndex)
+};
+
+#endif // CONTENTINDEX_H
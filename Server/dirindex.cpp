@@ -0,0 +1,499 @@
+#include "dirindex.h"
+#include "contentindex.h"
+#include "filehash.h"
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QTimer>
+#include <QSocketNotifier>
+#include <QFileSystemWatcher>
+#include <QRunnable>
+#include <QThreadPool>
+
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define INDEX_WATCH_MASK    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                             IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | \
+                             IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR)
+#endif
+
+static DirIndex::Entry make_entry(const QString &rel, const QFileInfo &info)
+{
+    DirIndex::Entry entry;
+
+    entry.path = rel;
+    entry.is_dir = info.isDir();
+    entry.size = entry.is_dir ? 0 : info.size();
+    entry.mtime = info.lastModified().toMSecsSinceEpoch();
+    return entry;
+}
+
+static QString join_path(const QString &dir, const QString &name)
+{
+    return dir.isEmpty() ? name : dir + "/" + name;
+}
+
+/* index the hash threads report to, outlives its DirIndex */
+struct HashQueue
+{
+    HashQueue(DirIndex *owner) : owner(owner) {}
+
+    QMutex lock;
+    /* null once the DirIndex is gone */
+    DirIndex *owner;
+};
+
+class HashPool : public QThreadPool
+{
+public:
+    HashPool() { setMaxThreadCount(INDEX_HASH_THREADS); }
+};
+
+static HashPool *hash_pool()
+{
+    static HashPool pool;
+    return &pool;
+}
+
+/* hash one file of an index on a pool thread */
+class IndexHashTask : public QRunnable
+{
+public:
+    IndexHashTask(const QSharedPointer<HashQueue> &queue,
+                  const QString &path, const QString &file, qint64 size,
+                  qint64 mtime) :
+        queue(queue),
+        path(path),
+        file(file),
+        size(size),
+        mtime(mtime)
+    {
+    }
+
+    void run()
+    {
+        QByteArray hash = hash_file_prefix(file, size);
+
+        QMutexLocker locker(&queue->lock);
+        if (queue->owner)
+            queue->owner->finish_hash(path, size, mtime, hash);
+    }
+
+private:
+    QSharedPointer<HashQueue> queue;
+    QString path;
+    QString file;
+    qint64 size;
+    qint64 mtime;
+};
+
+DirIndex::DirIndex(const QString &root, ContentIndex *content) :
+    QObject(0),
+    root(root),
+    content(content),
+    cache_valid(false),
+    ready(false),
+    settle_timer(0),
+    inotify_fd(-1),
+    notifier(0),
+    watcher(0),
+    hash_queue(new HashQueue(this))
+{
+}
+
+DirIndex::~DirIndex()
+{
+    /* a hash still running drops its result */
+    {
+        QMutexLocker locker(&hash_queue->lock);
+        hash_queue->owner = 0;
+    }
+
+#ifdef Q_OS_LINUX
+    if (inotify_fd >= 0)
+        ::close(inotify_fd);
+#endif
+}
+
+bool DirIndex::snapshot(QVector<Entry> *list)
+{
+    {
+        QReadLocker locker(&lock);
+        if (!ready)
+            return false;
+        if (cache_valid) {
+            *list = cache;
+            return true;
+        }
+    }
+
+    QWriteLocker locker(&lock);
+    if (!cache_valid) {
+        cache.clear();
+        cache.reserve(entries.size());
+        QMap<QString, Entry>::const_iterator it = entries.constBegin();
+        for (; it != entries.constEnd(); ++it)
+            cache.append(*it);
+        cache_valid = true;
+    }
+    *list = cache;
+    return true;
+}
+
+QByteArray DirIndex::hash(const QString &path, qint64 size, qint64 mtime)
+{
+    {
+        QMutexLocker locker(&hash_lock);
+        QHash<QString, HashEntry>::const_iterator it = hashes.constFind(path);
+        if (it != hashes.constEnd() && it->size == size && it->mtime == mtime)
+            return it->hash;
+    }
+
+    /* hash outside the lock, two workers may race on a cold entry */
+    HashEntry entry;
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.hash = hash_file_prefix(absolute(path), size);
+    store_hash(path, entry);
+    return entry.hash;
+}
+
+bool DirIndex::cached_hash(const QString &path, qint64 size, qint64 mtime,
+                           QByteArray *hash)
+{
+    QMutexLocker locker(&hash_lock);
+    QHash<QString, HashEntry>::const_iterator it = hashes.constFind(path);
+    if (it == hashes.constEnd() || it->size != size || it->mtime != mtime)
+        return false;
+    *hash = it->hash;
+    return true;
+}
+
+/* one hash per path at a time, whoever asks for it meanwhile waits too */
+void DirIndex::request_hash(const QString &path, qint64 size, qint64 mtime)
+{
+    {
+        QMutexLocker locker(&hash_lock);
+        if (hashing.contains(path))
+            return;
+        hashing.insert(path);
+    }
+
+    hash_pool()->start(new IndexHashTask(hash_queue, path, absolute(path),
+                                         size, mtime));
+}
+
+/* an IndexHashTask is done, on its pool thread with the hash queue locked */
+void DirIndex::finish_hash(const QString &path, qint64 size, qint64 mtime,
+                           const QByteArray &hash)
+{
+    HashEntry entry;
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.hash = hash;
+    store_hash(path, entry);
+
+    {
+        QMutexLocker locker(&hash_lock);
+        hashing.remove(path);
+    }
+    emit hashed();
+}
+
+void DirIndex::store_hash(const QString &path, const HashEntry &entry)
+{
+    if (content && !entry.hash.isEmpty())
+        content->set(absolute(path), entry.hash);
+
+    QMutexLocker locker(&hash_lock);
+    hashes.insert(path, entry);
+}
+
+/* full scan, runs on the indexer thread */
+void DirIndex::rebuild()
+{
+    if (!settle_timer) {
+        settle_timer = new QTimer(this);
+        settle_timer->setSingleShot(true);
+        settle_timer->setInterval(INDEX_SETTLE_MS);
+        connect(settle_timer, SIGNAL(timeout()), this, SLOT(flush_changes()));
+    }
+
+#ifdef Q_OS_LINUX
+    if (inotify_fd < 0) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd >= 0) {
+            notifier = new QSocketNotifier(inotify_fd, QSocketNotifier::Read,
+                                           this);
+            connect(notifier, SIGNAL(activated(int)),
+                    this, SLOT(read_events()));
+        }
+    } else {
+        /* drop old watches, scan_tree() adds them again */
+        QHash<int, QString>::const_iterator it = watch_paths.constBegin();
+        for (; it != watch_paths.constEnd(); ++it)
+            inotify_rm_watch(inotify_fd, it.key());
+        watch_paths.clear();
+    }
+#endif
+    if (inotify_fd < 0 && !watcher) {
+        watcher = new QFileSystemWatcher(this);
+        connect(watcher, SIGNAL(directoryChanged(QString)),
+                this, SLOT(handle_dir_changed(QString)));
+    }
+
+    QMap<QString, Entry> result;
+    scan_tree(QString(), &result);
+
+    QWriteLocker locker(&lock);
+    entries.swap(result);
+    cache_valid = false;
+    ready = true;
+}
+
+QString DirIndex::absolute(const QString &rel) const
+{
+    return rel.isEmpty() ? root : root + "/" + rel;
+}
+
+void DirIndex::watch_dir(const QString &rel)
+{
+#ifdef Q_OS_LINUX
+    if (inotify_fd >= 0) {
+        int wd = inotify_add_watch(inotify_fd,
+                                   QFile::encodeName(absolute(rel)).constData(),
+                                   INDEX_WATCH_MASK);
+        if (wd >= 0)
+            watch_paths.insert(wd, rel);
+        return;
+    }
+#endif
+    if (watcher)
+        watcher->addPath(absolute(rel));
+}
+
+/* add rel (a directory) and everything below it to result */
+void DirIndex::scan_tree(const QString &rel, QMap<QString, Entry> *result)
+{
+    QString base = absolute(rel);
+    QDir root_dir(root);
+
+    watch_dir(rel);
+
+    QDirIterator it(base, QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        QFileInfo info = it.fileInfo();
+        QString path = root_dir.relativeFilePath(info.absoluteFilePath());
+
+        result->insert(path, make_entry(path, info));
+        if (info.isDir())
+            watch_dir(path);
+    }
+}
+
+#ifdef Q_OS_LINUX
+void DirIndex::read_events()
+{
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = ::read(inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *event =
+                    reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                /* lost events, nothing short of a rescan is safe */
+                dirty_dirs.insert(QString());
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watch_paths.remove(event->wd);
+                continue;
+            }
+
+            QHash<int, QString>::const_iterator it =
+                    watch_paths.constFind(event->wd);
+            if (it == watch_paths.constEnd())
+                continue;
+
+            if (event->len > 0)
+                dirty_paths.insert(join_path(*it, QFile::decodeName(event->name)));
+            else
+                dirty_paths.insert(*it);
+        }
+    }
+
+    if (!settle_timer->isActive())
+        settle_timer->start();
+}
+#else
+void DirIndex::read_events()
+{
+}
+#endif
+
+void DirIndex::handle_dir_changed(const QString &path)
+{
+    QString rel = QDir(root).relativeFilePath(path);
+    if (rel == ".")
+        rel.clear();
+
+    dirty_dirs.insert(rel);
+    if (!settle_timer->isActive())
+        settle_timer->start();
+}
+
+void DirIndex::flush_changes()
+{
+    if (dirty_dirs.contains(QString()) && inotify_fd >= 0) {
+        /* inotify queue overflowed */
+        dirty_dirs.clear();
+        dirty_paths.clear();
+        rebuild();
+        return;
+    }
+
+    QSet<QString>::const_iterator it;
+    for (it = dirty_dirs.constBegin(); it != dirty_dirs.constEnd(); ++it)
+        rescan_dir(*it);
+    for (it = dirty_paths.constBegin(); it != dirty_paths.constEnd(); ++it)
+        refresh_path(*it);
+
+    dirty_dirs.clear();
+    dirty_paths.clear();
+}
+
+/* re-stat one path, picking up whole subtrees that appeared */
+void DirIndex::refresh_path(const QString &rel)
+{
+    if (rel.isEmpty())
+        return;
+
+    QFileInfo info(absolute(rel));
+    if (!info.exists()) {
+        remove_subtree(rel);
+        return;
+    }
+
+    QMap<QString, Entry> added;
+    bool is_new;
+    {
+        QReadLocker locker(&lock);
+        is_new = !entries.contains(rel);
+    }
+    if (info.isDir() && is_new)
+        scan_tree(rel, &added);
+
+    Entry entry = make_entry(rel, info);
+    if (!entry.is_dir)
+        drop_stale_hash(entry);
+
+    QWriteLocker locker(&lock);
+    entries.insert(rel, entry);
+    QMap<QString, Entry>::const_iterator it = added.constBegin();
+    for (; it != added.constEnd(); ++it)
+        entries.insert(it.key(), *it);
+    cache_valid = false;
+}
+
+/* a file changed: its digest, and the content index entry, are stale */
+void DirIndex::drop_stale_hash(const Entry &entry)
+{
+    QMutexLocker locker(&hash_lock);
+    QHash<QString, HashEntry>::iterator it = hashes.find(entry.path);
+    if (it == hashes.end() ||
+            (it->size == entry.size && it->mtime == entry.mtime))
+        return;
+    hashes.erase(it);
+    locker.unlock();
+
+    if (content)
+        content->remove(absolute(entry.path));
+}
+
+/* without per-file events: compare the children of one directory */
+void DirIndex::rescan_dir(const QString &rel)
+{
+    QDir dir(absolute(rel));
+    QStringList names = dir.entryList(QDir::Files | QDir::Dirs |
+                                      QDir::NoDotAndDotDot);
+    QSet<QString> present;
+    QStringList stale;
+
+    for (int i = 0; i < names.size(); i++)
+        present.insert(join_path(rel, names.at(i)));
+
+    {
+        QReadLocker locker(&lock);
+        QString prefix = rel.isEmpty() ? QString() : rel + "/";
+        QMap<QString, Entry>::const_iterator it = entries.lowerBound(prefix);
+        for (; it != entries.constEnd() && it.key().startsWith(prefix); ++it) {
+            /* direct children only */
+            if (it.key().indexOf('/', prefix.size()) >= 0)
+                continue;
+            if (!present.contains(it.key()))
+                stale.append(it.key());
+        }
+    }
+
+    for (int i = 0; i < stale.size(); i++)
+        remove_subtree(stale.at(i));
+
+    QSet<QString>::const_iterator it;
+    for (it = present.constBegin(); it != present.constEnd(); ++it)
+        refresh_path(*it);
+}
+
+void DirIndex::remove_subtree(const QString &rel)
+{
+    QWriteLocker locker(&lock);
+    QString prefix = rel + "/";
+
+    entries.remove(rel);
+    QMap<QString, Entry>::iterator it = entries.lowerBound(prefix);
+    while (it != entries.end() && it.key().startsWith(prefix))
+        it = entries.erase(it);
+    cache_valid = false;
+
+    QMutexLocker hash_locker(&hash_lock);
+    hashes.remove(rel);
+    QHash<QString, HashEntry>::iterator hit = hashes.begin();
+    while (hit != hashes.end()) {
+        if (hit.key().startsWith(prefix))
+            hit = hashes.erase(hit);
+        else
+            ++hit;
+    }
+    hash_locker.unlock();
+    locker.unlock();
+
+    /* sessions must not offer this content as a copy source any more */
+    if (content) {
+        content->remove(absolute(rel));
+        content->forget(absolute(rel));
+    }
+
+#ifdef Q_OS_LINUX
+    /* a directory moved away keeps its watches under the old name */
+    QHash<int, QString>::iterator wit = watch_paths.begin();
+    while (wit != watch_paths.end()) {
+        if (*wit == rel || wit->startsWith(prefix)) {
+            inotify_rm_watch(inotify_fd, wit.key());
+            wit = watch_paths.erase(wit);
+        } else {
+            ++wit;
+        }
+    }
+#endif
+}
@@ -0,0 +1,124 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <QObject>
+#include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+
+class QTimer;
+class QSocketNotifier;
+class QFileSystemWatcher;
+class ContentIndex;
+struct HashQueue;
+
+/* delay used to coalesce bursts of change notifications */
+#define INDEX_SETTLE_MS     200
+/* threads hashing files for request_hash(), shared by all indexes */
+#define INDEX_HASH_THREADS  2
+
+/*
+ * In-memory index of one shared directory tree.
+ *
+ * Built once on the indexer thread, then kept fresh from inotify
+ * events (QFileSystemWatcher on other platforms) instead of rescanning
+ * the tree for every request. Readers on the transfer workers get an
+ * implicitly shared snapshot, so serving a listing is a memory copy.
+ */
+class DirIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Entry
+    {
+        QString path;   // relative, '/' separated
+        qint64 size;
+        qint64 mtime;   // ms since epoch
+        bool is_dir;
+    };
+
+    /* content, when set, learns every hash computed here */
+    explicit DirIndex(const QString &root, ContentIndex *content = 0);
+    ~DirIndex();
+
+    QString get_root() const { return root; }
+    /* sorted by path; false while the first scan is still running */
+    bool snapshot(QVector<Entry> *list);
+    /* SHA-256 of a file, cached until its size or mtime change */
+    QByteArray hash(const QString &path, qint64 size, qint64 mtime);
+    /*
+     * as hash(), but false instead of reading the file; *hash is empty
+     * for a file that could not be read
+     */
+    bool cached_hash(const QString &path, qint64 size, qint64 mtime,
+                     QByteArray *hash);
+    /* hash the file on the hash threads, hashed() tells when it is in */
+    void request_hash(const QString &path, qint64 size, qint64 mtime);
+
+signals:
+    /* a request_hash() finished, emitted from a hash thread */
+    void hashed();
+
+public slots:
+    void rebuild();
+
+private slots:
+    void read_events();
+    void handle_dir_changed(const QString &path);
+    void flush_changes();
+
+private:
+    struct HashEntry
+    {
+        qint64 size;
+        qint64 mtime;
+        QByteArray hash;
+    };
+
+    QString root;
+    ContentIndex *content;
+
+    mutable QReadWriteLock lock;
+    QMap<QString, Entry> entries;
+    QVector<Entry> cache;
+    bool cache_valid;
+    bool ready;
+
+    QMutex hash_lock;
+    QHash<QString, HashEntry> hashes;
+    /* paths request_hash() is hashing, under hash_lock */
+    QSet<QString> hashing;
+    /* lets the hash threads find this index while it exists */
+    QSharedPointer<HashQueue> hash_queue;
+
+    /* change tracking, indexer thread only */
+    QTimer *settle_timer;
+    QSet<QString> dirty_paths;
+    QSet<QString> dirty_dirs;
+    int inotify_fd;
+    QSocketNotifier *notifier;
+    QHash<int, QString> watch_paths;
+    QFileSystemWatcher *watcher;
+
+    QString absolute(const QString &rel) const;
+    void store_hash(const QString &path, const HashEntry &entry);
+    void finish_hash(const QString &path, qint64 size, qint64 mtime,
+                     const QByteArray &hash);
+
+    friend class IndexHashTask;
+    void watch_dir(const QString &rel);
+    void scan_tree(const QString &rel, QMap<QString, Entry> *result);
+    void refresh_path(const QString &rel);
+    void drop_stale_hash(const Entry &entry);
+    void rescan_dir(const QString &rel);
+    void remove_subtree(const QString &rel);
+};
+
+#endif // DIRINDEX_H
@@ -0,0 +1,36 @@
+# Transfer engine shared by the Server window and the Daemon
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += $$PWD/session.cpp \
+        $$PWD/shareddirs.cpp \
+        $$PWD/dirindex.cpp \
+        $$PWD/contentindex.cpp \
+        $$PWD/streamgroup.cpp \
+        $$PWD/sessionstats.cpp \
+        $$PWD/metricsserver.cpp \
+        $$PWD/asyncreader.cpp \
+        $$PWD/ratelimit.cpp \
+        $$PWD/sendscheduler.cpp \
+        $$PWD/transferserver.cpp
+
+HEADERS += $$PWD/session.h \
+        $$PWD/shareddirs.h \
+        $$PWD/dirindex.h \
+        $$PWD/contentindex.h \
+        $$PWD/streamgroup.h \
+        $$PWD/sessionstats.h \
+        $$PWD/metricsserver.h \
+        $$PWD/asyncreader.h \
+        $$PWD/ratelimit.h \
+        $$PWD/sendscheduler.h \
+        $$PWD/transferserver.h
+
+include(../Common/common.pri)
+
+# io_uring for disk reads, a pread() thread pool otherwise
+linux:packagesExist(liburing) {
+    PKGCONFIG += liburing
+    DEFINES += HAVE_LIBURING
+}
@@ -0,0 +1,156 @@
+#include "metricsserver.h"
+#include "sessionstats.h"
+#include <QTcpSocket>
+
+MetricsServer::MetricsServer(const StatsRegistry *stats, QObject *parent) :
+    QTcpServer(parent),
+    stats(stats)
+{
+    connect(this, SIGNAL(newConnection()),
+            this, SLOT(handle_connect()));
+}
+
+void MetricsServer::handle_connect()
+{
+    while (QTcpSocket *socket = nextPendingConnection()) {
+        connect(socket, SIGNAL(readyRead()),
+                this, SLOT(handle_request()));
+        connect(socket, SIGNAL(disconnected()),
+                socket, SLOT(deleteLater()));
+    }
+}
+
+/* answer once the request headers are in, whatever they ask for */
+void MetricsServer::handle_request()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+
+    while (socket->canReadLine()) {
+        QByteArray line = socket->readLine();
+        if (line != "\r\n" && line != "\n")
+            continue;
+
+        QByteArray body = render();
+        socket->write("HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: " +
+                      QByteArray::number(body.size()) + "\r\n\r\n");
+        socket->write(body);
+        socket->disconnectFromHost();
+        return;
+    }
+}
+
+static QByteArray label(const QString &value)
+{
+    QByteArray out = value.toUtf8();
+    out.replace('\\', "\\\\");
+    out.replace('"', "\\\"");
+    out.replace('\n', "\\n");
+    return out;
+}
+
+static void add_header(QByteArray *out, const char *name, const char *type,
+                       const char *help)
+{
+    *out += QByteArray("# HELP ") + name + " " + help + "\n";
+    *out += QByteArray("# TYPE ") + name + " " + type + "\n";
+}
+
+QByteArray MetricsServer::render() const
+{
+    QList<QSharedPointer<SessionStats> > sessions = stats->sessions();
+    QList<QByteArray> labels;
+    QList<SessionStats::Snapshot> snapshots;
+    QHash<QString, qint64> shares = stats->closed_share_bytes();
+
+    for (int i = 0; i < sessions.size(); i++) {
+        labels.append("session=\"" +
+                      QByteArray::number(sessions.at(i)->get_id()) +
+                      "\",peer=\"" + label(sessions.at(i)->get_peer()) +
+                      "\"");
+        snapshots.append(sessions.at(i)->snapshot());
+
+        const QHash<QString, qint64> &open = snapshots.last().share_bytes;
+        QHash<QString, qint64>::const_iterator it = open.constBegin();
+        for (; it != open.constEnd(); ++it)
+            shares[it.key()] += it.value();
+    }
+
+    QByteArray out;
+
+    add_header(&out, "filetrans_sessions", "gauge", "Open client connections.");
+    out += "filetrans_sessions " + QByteArray::number(sessions.size()) + "\n";
+
+    add_header(&out, "filetrans_sent_bytes_total", "counter",
+               "Bytes written to the connection.");
+    for (int i = 0; i < snapshots.size(); i++)
+        out += "filetrans_sent_bytes_total{" + labels.at(i) + "} " +
+                QByteArray::number(snapshots.at(i).bytes_sent) + "\n";
+
+    add_header(&out, "filetrans_send_rate_bytes_per_second", "gauge",
+               "Bytes per second written to the connection lately.");
+    for (int i = 0; i < snapshots.size(); i++)
+        out += "filetrans_send_rate_bytes_per_second{" + labels.at(i) + "} " +
+                QByteArray::number(snapshots.at(i).rate) + "\n";
+
+    add_header(&out, "filetrans_sent_files_total", "counter",
+               "Files sent completely.");
+    for (int i = 0; i < snapshots.size(); i++)
+        out += "filetrans_sent_files_total{" + labels.at(i) + "} " +
+                QByteArray::number(snapshots.at(i).files_sent) + "\n";
+
+    add_header(&out, "filetrans_dedup_bytes_total", "counter",
+               "File bytes the client copied locally instead.");
+    for (int i = 0; i < snapshots.size(); i++)
+        out += "filetrans_dedup_bytes_total{" + labels.at(i) + "} " +
+                QByteArray::number(snapshots.at(i).dedup_bytes) + "\n";
+
+    add_header(&out, "filetrans_requests_total", "counter",
+               "Requests received.");
+    for (int i = 0; i < snapshots.size(); i++)
+        out += "filetrans_requests_total{" + labels.at(i) + "} " +
+                QByteArray::number(snapshots.at(i).requests) + "\n";
+
+    add_header(&out, "filetrans_queue_items", "gauge",
+               "Items waiting in the send queue.");
+    for (int i = 0; i < snapshots.size(); i++)
+        out += "filetrans_queue_items{" + labels.at(i) + "} " +
+                QByteArray::number(snapshots.at(i).queue_items) + "\n";
+
+    add_header(&out, "filetrans_queue_bytes", "gauge",
+               "Bytes buffered in the socket.");
+    for (int i = 0; i < snapshots.size(); i++)
+        out += "filetrans_queue_bytes{" + labels.at(i) + "} " +
+                QByteArray::number(snapshots.at(i).queue_bytes) + "\n";
+
+    add_header(&out, "filetrans_request_latency_seconds", "histogram",
+               "Time from a request to its first answer frame.");
+    for (int i = 0; i < snapshots.size(); i++) {
+        const SessionStats::Snapshot &s = snapshots.at(i);
+        qint64 count = 0;
+        for (int b = 0; b <= LATENCY_BUCKETS; b++) {
+            count += s.latency_count[b];
+            QByteArray le = b < LATENCY_BUCKETS ?
+                        QByteArray::number(latency_bucket_ms[b] / 1000.0) :
+                        QByteArray("+Inf");
+            out += "filetrans_request_latency_seconds_bucket{" +
+                    labels.at(i) + ",le=\"" + le + "\"} " +
+                    QByteArray::number(count) + "\n";
+        }
+        out += "filetrans_request_latency_seconds_sum{" + labels.at(i) +
+                "} " + QByteArray::number(s.latency_sum_us / 1e6) + "\n";
+        out += "filetrans_request_latency_seconds_count{" + labels.at(i) +
+                "} " + QByteArray::number(count) + "\n";
+    }
+
+    add_header(&out, "filetrans_share_sent_bytes_total", "counter",
+               "File bytes served from each shared directory.");
+    QHash<QString, qint64>::const_iterator it = shares.constBegin();
+    for (; it != shares.constEnd(); ++it)
+        out += "filetrans_share_sent_bytes_total{share=\"" +
+                label(it.key()) + "\"} " + QByteArray::number(it.value()) +
+                "\n";
+
+    return out;
+}
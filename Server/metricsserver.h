@@ -0,0 +1,31 @@
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QTcpServer>
+#include <QByteArray>
+
+class StatsRegistry;
+
+/*
+ * Answers every HTTP request with the session counters in the
+ * Prometheus text format. Meant for a local port: there is no request
+ * parsing and no authentication.
+ */
+class MetricsServer : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    explicit MetricsServer(const StatsRegistry *stats, QObject *parent = 0);
+
+    QByteArray render() const;
+
+private slots:
+    void handle_connect();
+    void handle_request();
+
+private:
+    const StatsRegistry *stats;
+};
+
+#endif // METRICSSERVER_H
@@ -0,0 +1,155 @@
+#include "ratelimit.h"
+#include "sessionstats.h"
+
+void TokenBucket::refill(qint64 now_us)
+{
+    qint64 burst = qMax(rate * RATE_BURST_MS / 1000, (qint64)RATE_MIN_BURST);
+
+    /* a new bucket starts full */
+    if (stamp_us == 0) {
+        tokens = burst;
+        stamp_us = now_us;
+        return;
+    }
+
+    qint64 idle = qMin(now_us - stamp_us, (qint64)RATE_MAX_IDLE_US);
+    qint64 gained = idle * rate / 1000000;
+    /* less than a byte so far, leave the stamp for the next call */
+    if (gained <= 0)
+        return;
+
+    tokens = qMin(burst, tokens + gained);
+    stamp_us = now_us;
+}
+
+qint64 TokenBucket::wait_us() const
+{
+    if (tokens > 0)
+        return 0;
+    return (1 - tokens) * 1000000 / rate + 1;
+}
+
+RateLimiter::RateLimiter() :
+    limited(0),
+    client_rate(0),
+    share_rate(0)
+{
+}
+
+void RateLimiter::set_rates(qint64 global_rate, qint64 per_client,
+                            qint64 per_share)
+{
+    QMutexLocker locker(&lock);
+
+    global.rate = qMax(global_rate, (qint64)0);
+    client_rate = qMax(per_client, (qint64)0);
+    share_rate = qMax(per_share, (qint64)0);
+
+    QHash<QString, Client>::iterator it = clients.begin();
+    for (; it != clients.end(); ++it)
+        it->bucket.rate = client_rate;
+    /* share buckets are made again with the new rate */
+    shares.clear();
+    update_limited();
+}
+
+void RateLimiter::set_share_rate(const QString &share, qint64 rate)
+{
+    QMutexLocker locker(&lock);
+
+    share_rates.insert(share, qMax(rate, (qint64)0));
+    shares.remove(share);
+    update_limited();
+}
+
+void RateLimiter::attach(const QString &client)
+{
+    QMutexLocker locker(&lock);
+
+    Client &entry = clients[client];
+    entry.bucket.rate = client_rate;
+    entry.users++;
+}
+
+void RateLimiter::detach(const QString &client)
+{
+    QMutexLocker locker(&lock);
+
+    QHash<QString, Client>::iterator it = clients.find(client);
+    if (it != clients.end() && --it->users <= 0)
+        clients.erase(it);
+}
+
+qint64 RateLimiter::allowance(const QString &client, const QString &share,
+                              qint64 want, qint64 *wait_us)
+{
+    qint64 now = stats_clock_us();
+    TokenBucket *buckets[3];
+    int count = 0;
+
+    QMutexLocker locker(&lock);
+
+    if (global.rate > 0)
+        buckets[count++] = &global;
+    QHash<QString, Client>::iterator it = clients.find(client);
+    if (it != clients.end() && it->bucket.rate > 0)
+        buckets[count++] = &it->bucket;
+    TokenBucket *bucket = share_bucket(share);
+    if (bucket)
+        buckets[count++] = bucket;
+
+    *wait_us = 0;
+    for (int i = 0; i < count; i++) {
+        buckets[i]->refill(now);
+        if (buckets[i]->tokens <= 0)
+            *wait_us = qMax(*wait_us, buckets[i]->wait_us());
+        else
+            want = qMin(want, buckets[i]->tokens);
+    }
+    return *wait_us > 0 ? 0 : want;
+}
+
+void RateLimiter::charge(const QString &client, const QString &share,
+                         qint64 bytes)
+{
+    if (bytes <= 0)
+        return;
+
+    QMutexLocker locker(&lock);
+
+    if (global.rate > 0)
+        global.tokens -= bytes;
+    QHash<QString, Client>::iterator it = clients.find(client);
+    if (it != clients.end() && it->bucket.rate > 0)
+        it->bucket.tokens -= bytes;
+    TokenBucket *bucket = share_bucket(share);
+    if (bucket)
+        bucket->tokens -= bytes;
+}
+
+/* bucket of share, 0 when it is not limited; lock held */
+TokenBucket *RateLimiter::share_bucket(const QString &share)
+{
+    if (share.isEmpty())
+        return 0;
+
+    qint64 rate = share_rates.value(share, share_rate);
+    if (rate <= 0)
+        return 0;
+
+    TokenBucket &bucket = shares[share];
+    bucket.rate = rate;
+    return &bucket;
+}
+
+/* lock held */
+void RateLimiter::update_limited()
+{
+    bool any = global.rate > 0 || client_rate > 0 || share_rate > 0;
+
+    QHash<QString, qint64>::const_iterator it = share_rates.constBegin();
+    for (; !any && it != share_rates.constEnd(); ++it)
+        any = it.value() > 0;
+
+    limited.store(any ? 1 : 0);
+}
@@ -0,0 +1,88 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+/* a bucket saves up at most this much time worth of its rate */
+#define RATE_BURST_MS       100
+/* and never less than this, so slow limits still move whole blocks */
+#define RATE_MIN_BURST      (64 * 1024)
+/* longest idle time credited, keeps the refill from overflowing */
+#define RATE_MAX_IDLE_US    (10 * 1000 * 1000)
+
+/*
+ * Token bucket of one limit. Tokens may go negative: a sender that was
+ * admitted is charged what it really sent and waits off the debt, so a
+ * block that can't be cut never makes the limit leak.
+ */
+struct TokenBucket
+{
+    TokenBucket() : rate(0), tokens(0), stamp_us(0) {}
+
+    /* bytes per second, 0 for no limit */
+    qint64 rate;
+    qint64 tokens;
+    qint64 stamp_us;
+
+    void refill(qint64 now_us);
+    /* microseconds until tokens is positive again */
+    qint64 wait_us() const;
+};
+
+/*
+ * Egress limits shared by all workers: one bucket for the whole server,
+ * one per client address, whatever the number of its connections, and
+ * one per share. Limits count file data as it is read for the client,
+ * what compression or deltas save on the wire is not handed back.
+ */
+class RateLimiter
+{
+public:
+    RateLimiter();
+
+    /* bytes per second, 0 for no limit */
+    void set_rates(qint64 global_rate, qint64 per_client, qint64 per_share);
+    /* per_share for one share, 0 lifts it for that share only */
+    void set_share_rate(const QString &share, qint64 rate);
+    /* false while no limit is set, nothing needs to be asked then */
+    bool is_limited() const { return limited.load() != 0; }
+
+    /* connections from client come and go */
+    void attach(const QString &client);
+    void detach(const QString &client);
+
+    /*
+     * bytes of share that client may send now, at most want; 0 with
+     * *wait_us set when one of the buckets is in debt
+     */
+    qint64 allowance(const QString &client, const QString &share,
+                     qint64 want, qint64 *wait_us);
+    /* bytes sent after an allowance, any amount */
+    void charge(const QString &client, const QString &share, qint64 bytes);
+
+private:
+    struct Client
+    {
+        Client() : users(0) {}
+
+        TokenBucket bucket;
+        int users;
+    };
+
+    QMutex lock;
+    QAtomicInt limited;
+    qint64 client_rate;
+    qint64 share_rate;
+    QHash<QString, qint64> share_rates;
+    TokenBucket global;
+    QHash<QString, Client> clients;
+    QHash<QString, TokenBucket> shares;
+
+    TokenBucket *share_bucket(const QString &share);
+    void update_limited();
+};
+
+#endif // RATELIMIT_H
@@ -0,0 +1,80 @@
+#include "sendscheduler.h"
+#include "session.h"
+
+SendScheduler::SendScheduler(RateLimiter *limiter, QObject *parent) :
+    QObject(parent),
+    limiter(limiter),
+    serving(0),
+    serving_woken(false),
+    queued(false)
+{
+}
+
+void SendScheduler::wake(Session *session)
+{
+    if (session == serving)
+        serving_woken = true;
+    else if (!deficits.contains(session)) {
+        deficits.insert(session, 0);
+        active.append(session);
+        connect(session, SIGNAL(destroyed(QObject*)),
+                this, SLOT(forget(QObject*)), Qt::UniqueConnection);
+    }
+
+    /* sessions are served from the event loop, never from their caller */
+    if (!queued) {
+        queued = true;
+        QMetaObject::invokeMethod(this, "run", Qt::QueuedConnection);
+    }
+}
+
+/*
+ * One round over the active sessions, cut short after SCHED_SLICE bytes
+ * so requests and control frames of this worker are not held up. The
+ * next call picks up where this one stopped.
+ */
+void SendScheduler::run()
+{
+    queued = false;
+
+    qint64 work = 0;
+    int turns = active.size();
+    while (turns-- > 0 && work < SCHED_SLICE) {
+        Session *session = active.takeFirst();
+        qint64 budget = deficits.value(session) + SCHED_QUANTUM;
+
+        /* still paying off an overdrawn frame */
+        if (budget <= 0) {
+            deficits.insert(session, budget);
+            active.append(session);
+            continue;
+        }
+
+        qint64 sent = 0;
+        serving = session;
+        serving_woken = false;
+        bool more = session->send_bulk(budget, &sent);
+        serving = 0;
+        work += sent;
+        if (more || serving_woken) {
+            deficits.insert(session, budget - sent);
+            active.append(session);
+        } else {
+            deficits.remove(session);
+        }
+    }
+
+    if (!active.isEmpty() && !queued) {
+        queued = true;
+        QMetaObject::invokeMethod(this, "run", Qt::QueuedConnection);
+    }
+}
+
+/* only the address is used, the session is half destroyed already */
+void SendScheduler::forget(QObject *session)
+{
+    Session *key = static_cast<Session *>(session);
+
+    deficits.remove(key);
+    active.removeAll(key);
+}
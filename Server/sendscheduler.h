@@ -0,0 +1,53 @@
+#ifndef SENDSCHEDULER_H
+#define SENDSCHEDULER_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+
+class Session;
+class RateLimiter;
+
+/* file bytes a session may send per round */
+#define SCHED_QUANTUM       (1024 * 1024)
+/* file bytes sent before the worker's event loop gets a turn again */
+#define SCHED_SLICE         (4 * 1024 * 1024)
+
+/*
+ * Deficit round robin over the sessions of one worker that have file
+ * data to send. Every round adds SCHED_QUANTUM to a session's deficit
+ * and lets it send that much; a frame that can't be cut may overdraw
+ * it and is taken off the next turns. A session that runs dry or has
+ * to wait for its socket, the disk or the rate limits leaves the round
+ * and its deficit, and comes back through wake().
+ *
+ * Control frames never go through here, see Session::pump().
+ */
+class SendScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SendScheduler(RateLimiter *limiter, QObject *parent = 0);
+
+    /* session has file data and room for it, give it turns */
+    void wake(Session *session);
+    RateLimiter *get_limiter() const { return limiter; }
+
+private slots:
+    void run();
+    void forget(QObject *session);
+
+private:
+    RateLimiter *limiter;
+    /* sessions in the round, in turn order, and their deficits */
+    QList<Session *> active;
+    QHash<Session *, qint64> deficits;
+    /* session having its turn, and whether it was woken meanwhile */
+    Session *serving;
+    bool serving_woken;
+    /* run() is queued */
+    bool queued;
+};
+
+#endif // SENDSCHEDULER_H
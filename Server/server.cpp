@@ -1,26 +1,35 @@
 #include "server.h"
 #include "ui_server.h"
+#include "transferserver.h"
 #include <QDebug>
-#include <QTcpSocket>
 #include <QFileDialog>
+#include <QTimer>
+
+/* how often the client rows show fresh counters */
+#define STATS_REFRESH_MS    1000
 
 Server::Server(QWidget *parent) :
     QWidget(parent),
-    ui(new Ui::Server),
-    totalsize(0),
-    read_status(STATUS_NONE)
+    ui(new Ui::Server)
 {
     ui->setupUi(this);
 
-    tcp_server = new QTcpServer(this);
+    tcp_server = new TransferServer(&shared_dirs);
     if (!tcp_server->listen(QHostAddress::AnyIPv4, LISTEN_PORT))
     {
         qDebug() << "Listen failed";
         close();
     }
 
-    connect(tcp_server, SIGNAL(newConnection()),
-            this, SLOT(handle_connect()));
+    connect(tcp_server, SIGNAL(session_opened(quint64,QString,quint16)),
+            this, SLOT(handle_connect(quint64,QString,quint16)));
+    connect(tcp_server, SIGNAL(session_closed(quint64)),
+            this, SLOT(handle_disconnect(quint64)));
+
+    QTimer *stats_timer = new QTimer(this);
+    connect(stats_timer, SIGNAL(timeout()),
+            this, SLOT(refresh_stats()));
+    stats_timer->start(STATS_REFRESH_MS);
 }
 
 Server::~Server()
@@ -29,46 +38,44 @@ Server::~Server()
     delete ui;
 }
 
-void Server::handle_connect()
+void Server::handle_connect(quint64 id, QString ip, quint16 port)
 {
-    QTcpSocket *socket = tcp_server->nextPendingConnection();
-    qDebug() << "Client: " << socket->peerAddress().toString()
-             << ":" << socket->peerPort();
-
-    connect(socket, SIGNAL(disconnected()),
-            this, SLOT(handle_disconnect()));
-    connect(socket, SIGNAL(readyRead()),
-            this, SLOT(handle_msg()));
-
-    ClientItem *client_item = new ClientItem(socket, ui->client_list);
-    client_item->SetData(socket->peerAddress().toString(),
-                         QString::number(socket->peerPort()),
+    qDebug() << "Client: " << ip << ":" << port;
+
+    ClientItem *client_item = new ClientItem(id, ui->client_list);
+    client_item->SetData(ip, QString::number(port),
                          tr("Connected"), tr("Disconnect"));
     client_item->Show();
 
-    QString addr = socket->peerAddress().toString() + ":" +
-            QString::number(socket->peerPort());
-    hash_clients.insert(addr, client_item);
+    connect(client_item, SIGNAL(close_requested(quint64)),
+            tcp_server, SLOT(close_session(quint64)));
+
+    hash_clients.insert(id, client_item);
 }
 
-void Server::handle_disconnect()
+void Server::handle_disconnect(quint64 id)
 {
-    QTcpSocket *socket= qobject_cast<QTcpSocket *>(sender());
-    QString addr = socket->peerAddress().toString() + ":" +
-            QString::number(socket->peerPort());
-    qDebug() << "Client: " << addr << " disconnect";
+    QHash<quint64, ClientItem*>::iterator it = hash_clients.find(id);
+    if (it == hash_clients.end())
+        return;
 
-    QHash<QString, ClientItem*>::iterator it = hash_clients.find(addr);
     ClientItem *close_item = (*it);
-    close_item->SetData(socket->peerAddress().toString(),
-                        QString::number(socket->peerPort()),
-                        tr("Disconnected"), tr("Connect"));
-    close_item->Show();
     close_item->RemoveItem();
     delete close_item;
     hash_clients.erase(it);
 }
 
+void Server::refresh_stats()
+{
+    QHash<quint64, ClientItem*>::iterator it = hash_clients.begin();
+    for (; it != hash_clients.end(); ++it) {
+        QSharedPointer<SessionStats> stats =
+                tcp_server->get_stats()->get(it.key());
+        if (stats)
+            (*it)->SetStats(stats->snapshot());
+    }
+}
+
 void Server::on_add_button_clicked()
 {
     QStringList select_file;
@@ -93,6 +100,7 @@ void Server::on_add_button_clicked()
         file_item->Show();
 
         hash_files.insert(file_info.fileName(), file_item);
+        shared_dirs.insert(file_info.fileName(), fname);
     }
 }
 
@@ -111,198 +119,21 @@ void Server::on_delete_button_clicked()
         qDebug() << "Path " << fitem->dirpath;
         QHash<QString, FileItem*>::iterator it = hash_files.find(fitem->name);
         hash_files.erase(it);
+        shared_dirs.remove(fitem->name);
 
         int r = ui->file_list->row(sel);
         ui->file_list->takeItem(r);
     }
 }
 
-void Server::handle_msg()
-{
-    QTcpSocket *socket= qobject_cast<QTcpSocket *>(sender());
-    QDataStream in(socket);
-
-    in.setVersion(QDataStream::Qt_5_5);
-
-    do {
-        switch (read_status) {
-        case STATUS_NONE:
-            /* wait for total data len */
-            if (socket->bytesAvailable() < (int)sizeof(int))
-                return;
-
-            in >> totalsize;
-            read_status = STATUS_READ_TOTAL_SIZE;
-            break;
-        case STATUS_READ_TOTAL_SIZE:
-            /* wait for msg tag ready */
-            if (socket->bytesAvailable() < (int)sizeof(int))
-                return;
-
-            in >> tag;
-            read_status = STATUS_READ_TAG;
-            break;
-        case STATUS_READ_TAG:
-            switch ((int)(tag))
-            {
-            case MSG_TAG_SYNC:
-                send_dir_entry(socket);
-                break;
-            case MSG_TAG_ENTRY:
-                /* wait for msg ready */
-                if (socket->bytesAvailable() < totalsize - 2 * (int)sizeof(int))
-                    return;
-
-                in >> msg;
-                send_files_entry(socket);
-                break;
-            case MSG_TAG_FILE:
-                /* wait for msg ready */
-                if (socket->bytesAvailable() < totalsize - 2 * (int)sizeof(int))
-                    return;
-
-                in >> msg;
-                send_files_data(socket);
-                break;
-            default:
-                qDebug() << tr("IO Error");
-                break;
-            }
-
-            read_status = STATUS_NONE;
-            break;
-        default:
-            break;
-        }
-    } while (read_status != STATUS_NONE || socket->bytesAvailable());
-
-    totalsize = 0;
-    tag = 0;
-}
-
-void Server::send_dir_entry(QTcpSocket *socket)
-{
-    QByteArray block;
-    QDataStream out(&block, QIODevice::WriteOnly);
-
-    out.setVersion(QDataStream::Qt_5_5);
-
-    out << (int)0;
-    out << (int)MSG_TAG_LIST;
-
-    /* dir list data */
-    QString data;
-    QHash<QString, FileItem*>::iterator it = hash_files.begin();
-    for (; it != hash_files.end(); it++)
-    {
-        FileItem *fitem = static_cast<FileItem *>(*it);
-        data += fitem->name + "#";
-    }
-    out << data;
-
-    out.device()->seek(0);
-    out << (int)(block.size() - sizeof(int));
-
-    socket->write(block);
-}
-
-void Server::send_files_entry(QTcpSocket *socket)
-{
-    QHash<QString, FileItem*>::iterator it = hash_files.find(msg);
-    QByteArray block;
-    QDataStream out(&block, QIODevice::WriteOnly);
-
-    out.setVersion(QDataStream::Qt_5_5);
-
-    out << (int)0;
-    out << (int)MSG_TAG_ENTRY;
-
-    /* file entry data */
-    QString data;
-    QDir dir((*it)->dirpath);
-    QFileInfoList list = dir.entryInfoList();
-    for (int i = 0; i < list.size(); i++) {
-        QFileInfo fileinfo = list.at(i);
-        if (fileinfo.fileName() == "." || fileinfo.fileName() == "..")
-            continue;
-        data += fileinfo.fileName() + "#";
-    }
-    out << data;
-
-    out.device()->seek(0);
-    out << (int)(block.size() - sizeof(int));
-
-    socket->write(block);
-}
-
-void Server::send_files_data(QTcpSocket *socket)
-{
-    QHash<QString, FileItem*>::iterator it = hash_files.find(msg);
-
-    QDir dir((*it)->dirpath);
-    QFileInfoList list = dir.entryInfoList();
-    /*
-     * Data layout: TotalSize + TAG + FileNameSize + FileName + FileData
-     */
-    for (int i = 0; i < list.size(); i++) {
-        QFileInfo fileinfo = list.at(i);
-        if (fileinfo.fileName() == "." || fileinfo.fileName() == ".." ||
-                fileinfo.isDir())
-            continue;
-
-        QByteArray block;
-        QDataStream out(&block, QIODevice::WriteOnly);
-        block.resize(0);
-
-        out.setVersion(QDataStream::Qt_5_5);
-
-        QString fname = fileinfo.fileName();
-        /* TotalSize */
-        int total = 0;
-
-        out << (int)0;
-        /* TAG */
-        out << (int)MSG_TAG_FILE;
-        /* FileNameSize */
-        out << (int)0;
-        /* FileName */
-        out << fname;
-
-        out.device()->seek(2 * sizeof(int));
-        out << int(block.size() - 3 * sizeof(int));
-
-        /* FileData */
-        QFile current_file(fileinfo.absoluteFilePath());
-        if (!current_file.open(QFile::ReadOnly)) {
-            qDebug() << "Open file Error";
-            return;
-        }
-
-        total = block.size() + current_file.size();
-
-        /* set TotalSize */
-        out.device()->seek(0);
-        out << total;
-
-        int out_size = (int)total - (int)socket->write(block);
-        block.resize(0);
-        while (out_size > 0) {
-            block = current_file.read(qMin((int)out_size, (int)BLOCK_SIZE));
-            out_size -= socket->write(block);
-            block.resize(0);
-        }
-        current_file.close();
-    }
-}
-
 void ClientItem::Remove()
 {
-    socket->close();
+    emit close_requested(session_id);
 }
 
-ClientItem::ClientItem(QTcpSocket *socket, QListWidget *listwidget) :
+ClientItem::ClientItem(quint64 id, QListWidget *listwidget) :
     QWidget(listwidget),
-    socket(socket),
+    session_id(id),
     listwidget(listwidget)
 {
     layout = new QHBoxLayout(this);
@@ -311,10 +142,12 @@ ClientItem::ClientItem(QTcpSocket *socket, QListWidget *listwidget) :
     ip = new QLabel;
     port = new QLabel;
     status = new QLabel;
+    stats = new QLabel;
     button  = new QPushButton;
     layout->addWidget(ip);
     layout->addWidget(port);
     layout->addWidget(status);
+    layout->addWidget(stats);
     layout->addWidget(button);
 
     item = new QListWidgetItem(listwidget);
@@ -329,6 +162,7 @@ ClientItem::~ClientItem()
     delete ip;
     delete port;
     delete status;
+    delete stats;
     delete button;
     delete layout;
     delete item;
@@ -343,6 +177,43 @@ void ClientItem::SetData(QString ip_str, QString port_str,
     button->setText(button_str);
 }
 
+static QString format_bytes(double bytes)
+{
+    const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    return QString("%1 %2").arg(bytes, 0, 'f', unit ? 1 : 0).arg(units[unit]);
+}
+
+void ClientItem::SetStats(const SessionStats::Snapshot &s)
+{
+    /* bucket bound below which 99% of the requests were answered */
+    qint64 total = 0;
+    for (int i = 0; i <= LATENCY_BUCKETS; i++)
+        total += s.latency_count[i];
+    QString p99 = "-";
+    qint64 seen = 0;
+    for (int i = 0; i <= LATENCY_BUCKETS && total > 0; i++) {
+        seen += s.latency_count[i];
+        if (seen * 100 >= total * 99) {
+            p99 = i < LATENCY_BUCKETS ?
+                        QString("%1 ms").arg(latency_bucket_ms[i]) :
+                        QString("> %1 ms").arg(latency_bucket_ms[i - 1]);
+            break;
+        }
+    }
+
+    stats->setText(tr("%1/s, %2 sent, %3 files, queue %4, p99 %5")
+                   .arg(format_bytes(s.rate))
+                   .arg(format_bytes(s.bytes_sent))
+                   .arg(s.files_sent)
+                   .arg(s.queue_items)
+                   .arg(p99));
+}
+
 void ClientItem::Show()
 {
     item->setSizeHint(QSize(0,50));
@@ -8,25 +8,11 @@
 #include <QPushButton>
 #include <QListWidgetItem>
 #include <QHash>
+#include "shareddirs.h"
+#include "sessionstats.h"
+#include "protocol.h"
 
-class QTcpServer;
-
-/* Server listen port */
-#define LISTEN_PORT 6789
-
-#define MSG_TAG_SYNC    1       // sync file request
-#define MSG_TAG_FILE    2       // download file
-#define MSG_TAG_LIST    3       // dir list
-#define MSG_TAG_ENTRY   4       // list file entry request
-
-#define BLOCK_SIZE      4 * 1024   // 4K
-
-/* handle msg status */
-#define STATUS_NONE             1
-#define STATUS_READ_TOTAL_SIZE  2
-#define STATUS_READ_TAG         3
-#define STATUS_READ_FILE_LEN    4
-#define STATUS_READ_FILE        5
+class TransferServer;
 
 namespace Ui {
 class Server;
@@ -37,11 +23,12 @@ class ClientItem : public QWidget
     Q_OBJECT
 
 private:
-    QTcpSocket *socket;
+    quint64 session_id;
     QListWidget *listwidget;
     QLabel *ip;
     QLabel *port;
     QLabel *status;
+    QLabel *stats;
     QPushButton *button;
     QHBoxLayout *layout;
     QListWidgetItem *item;
@@ -49,11 +36,15 @@ private:
 private slots:
     void Remove();
 
+signals:
+    void close_requested(quint64 id);
+
 public:
-    explicit ClientItem(QTcpSocket *socket, QListWidget *listwidget);
+    explicit ClientItem(quint64 id, QListWidget *listwidget);
     ~ClientItem();
     void SetData(QString ip_str, QString port_str,
                  QString status_str, QString button_str);
+    void SetStats(const SessionStats::Snapshot &s);
     void Show();
     void RemoveItem();
 };
@@ -90,28 +81,19 @@ public:
 
 private slots:
     /* Client new connect tigger */
-    void handle_connect();
-    void handle_disconnect();
+    void handle_connect(quint64 id, QString ip, quint16 port);
+    void handle_disconnect(quint64 id);
     void on_add_button_clicked();
     void on_delete_button_clicked();
-    void handle_msg();
+    void refresh_stats();
 
 private:
     Ui::Server *ui;
-    QTcpServer *tcp_server;
-    QHash<QString, ClientItem *> hash_clients;
+    TransferServer *tcp_server;
+    QHash<quint64, ClientItem *> hash_clients;
     QHash<QString, FileItem *> hash_files;
-
-    int totalsize;
-    int tag;    // recv msg tag
-    QString msg;    // recv msg
-
-    int read_status;
-
-    /* send dir list */
-    void send_dir_entry(QTcpSocket *socket);
-    void send_files_entry(QTcpSocket *socket);
-    void send_files_data(QTcpSocket *socket);
+    /* thread-safe copy of hash_files for the transfer workers */
+    SharedDirs shared_dirs;
 };
 
 #endif // SERVER_H
@@ -0,0 +1,1719 @@
+#include "session.h"
+#include "shareddirs.h"
+#include "contentindex.h"
+#include "protocol.h"
+#include "delta.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "wire.h"
+#include "asyncreader.h"
+#include "sendscheduler.h"
+#include "ratelimit.h"
+#include <QDebug>
+#include <QTcpSocket>
+#include <QHostAddress>
+#include <QDir>
+#include <QTimer>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QPair>
+#include <QScopedValueRollback>
+
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <errno.h>
+#endif
+#include <unistd.h>
+
+Session::Session(quint64 id, QTcpSocket *socket, SharedDirs *dirs,
+                 StreamGroups *groups,
+                 const QSharedPointer<SessionStats> &stats,
+                 DiskReader *disk_reader, SendScheduler *scheduler,
+                 const SessionOptions &options, QObject *parent) :
+    QObject(parent),
+    id(id),
+    socket(socket),
+    shared_dirs(dirs),
+    stream_groups(groups),
+    stats(stats),
+    disk_reader(disk_reader),
+    scheduler(scheduler),
+    limiter(scheduler->get_limiter()),
+    client(socket->peerAddress().toString()),
+    throttled(false),
+    sending(false),
+    body_size(0),
+    tag(0),
+    request_id(0),
+    request_time_us(0),
+    read_status(STATUS_READ_PREFACE),
+    options(options),
+    send_request_id(0),
+    current_file(0),
+    file_offset(0),
+    left_file_size(0),
+    zero_copy_file(false),
+    read_ahead(0),
+    codec(CODEC_NONE),
+    file_codec(CODEC_NONE),
+    crc_offset(0),
+    send_crc(0),
+    send_crc_bad(false),
+    walk_pos(0),
+    walk_tag(0),
+    walk_request_id(0)
+{
+    socket->setParent(this);
+    limiter->attach(client);
+
+    connect(socket, SIGNAL(readyRead()),
+            this, SLOT(handle_msg()));
+    connect(socket, SIGNAL(disconnected()),
+            this, SLOT(handle_disconnect()));
+    connect(socket, SIGNAL(bytesWritten(qint64)),
+            this, SLOT(count_written(qint64)));
+    connect(socket, SIGNAL(bytesWritten(qint64)),
+            this, SLOT(pump()));
+}
+
+Session::~Session()
+{
+    disconnect(socket, 0, this, 0);
+    give_back_items();
+    close_current_file();
+    close_walk();
+    limiter->detach(client);
+}
+
+void Session::handle_disconnect()
+{
+    qDebug() << "Session " << id << " disconnect";
+    give_back_items();
+    emit closed(id);
+}
+
+void Session::handle_msg()
+{
+    do {
+        switch (read_status) {
+        case STATUS_READ_PREFACE:
+            if (!handle_preface())
+                return;
+            break;
+        case STATUS_NONE:
+            /* wait for frame header */
+            if (!read_frame_header(socket, &tag, &body_size, &request_id))
+                return;
+
+            if (body_size < 0 || body_size > MAX_REQUEST_SIZE) {
+                qDebug() << "Bad request size " << body_size;
+                socket->disconnectFromHost();
+                return;
+            }
+            read_status = STATUS_READ_BODY;
+            break;
+        case STATUS_READ_BODY:
+            /* wait for msg ready */
+            if (socket->bytesAvailable() < body_size)
+                return;
+
+            handle_request(socket->read(body_size));
+
+            read_status = STATUS_NONE;
+            body_size = 0;
+            tag = 0;
+            request_id = 0;
+            break;
+        default:
+            break;
+        }
+    } while (socket->bytesAvailable());
+}
+
+bool Session::handle_preface()
+{
+    quint32 magic, version, features;
+
+    /* v1 clients start with a 4 byte frame size, don't wait for more */
+    if (socket->bytesAvailable() >= (int)sizeof(quint32)) {
+        QByteArray head = socket->peek(sizeof(quint32));
+        if (head != make_preface(0).left(sizeof(quint32))) {
+            qDebug() << "Session " << id << " legacy client rejected";
+            socket->disconnectFromHost();
+            return false;
+        }
+    }
+
+    if (!read_preface(socket, &magic, &version, &features))
+        return false;
+
+    quint32 ours = options.compression ? compress_features() : 0;
+    socket->write(make_preface(ours));
+    codec = pick_codec(features & ours);
+    if (version != PROTOCOL_VERSION) {
+        qDebug() << "Session " << id << " version " << version << " rejected";
+        socket->disconnectFromHost();
+        return false;
+    }
+
+    read_status = STATUS_NONE;
+    return true;
+}
+
+/*
+ * Request bodies use the encoding of wire.h; all but MSG_TAG_SYNC, which
+ * has none, and MSG_TAG_JOIN start with DirName.
+ */
+void Session::handle_request(const QByteArray &body)
+{
+    WireReader in(body);
+
+    request_time_us = stats_clock_us();
+    stats->add_request();
+
+    switch (tag)
+    {
+    case MSG_TAG_SYNC:
+        send_dir_entry();
+        break;
+    case MSG_TAG_ENTRY:
+        msg = in.get_name();
+        send_files_entry();
+        break;
+    case MSG_TAG_MANIFEST:
+        msg = in.get_name();
+        send_files_manifest();
+        break;
+    case MSG_TAG_FILE:
+        msg = in.get_name();
+        send_files_data(in);
+        break;
+    case MSG_TAG_DELTA:
+        msg = in.get_name();
+        send_files_delta(in);
+        break;
+    case MSG_TAG_JOIN:
+        join_group(in.get_short_bytes());
+        break;
+    default:
+        qDebug() << tr("IO Error");
+        break;
+    }
+}
+
+void Session::queue_frame(qint32 tag, const QByteArray &body)
+{
+    SendItem item;
+    item.head = make_frame(tag, body, request_id);
+    item.queued_us = request_time_us;
+    control_queue.enqueue(item);
+    pump();
+}
+
+/*
+ * Tell the client name of request id won't come, see MSG_TAG_ERROR.
+ * Written with the control frames, the caller pumps.
+ */
+void Session::queue_error(quint32 id, const QString &name,
+                          const QString &reason, qint64 queued_us)
+{
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_name(name);
+    out.put_name(reason);
+
+    SendItem item;
+    item.head = make_frame(MSG_TAG_ERROR, block, id);
+    item.queued_us = queued_us;
+    control_queue.enqueue(item);
+}
+
+/*
+ * Request body: Token(short bytes)
+ * Connections joined under the same token share their file requests,
+ * see StreamGroup.
+ */
+void Session::join_group(const QByteArray &token)
+{
+    if (group || token.isEmpty())
+        return;
+
+    group = stream_groups->join(token);
+    group->join();
+    connect(group.data(), SIGNAL(work_available()),
+            this, SLOT(pump()), Qt::QueuedConnection);
+
+    /* pick up whatever the other streams queued before we joined */
+    pump();
+}
+
+bool Session::take_group_item(SendItem *item)
+{
+    StreamItem stream_item;
+
+    if (!group || !group->take(&stream_item))
+        return false;
+
+    from_stream_item(stream_item, item);
+    item->from_group = true;
+    return true;
+}
+
+void Session::from_stream_item(const StreamItem &stream_item, SendItem *item)
+{
+    item->request_id = stream_item.request_id;
+    item->queued_us = stream_item.queued_us;
+    item->share = stream_item.share;
+    item->file_path = stream_item.file_path;
+    item->file_name = stream_item.file_name;
+    item->resume_size = stream_item.resume_size;
+    item->file_size = stream_item.file_size;
+    item->range_start = stream_item.range_start;
+    item->range_offset = stream_item.range_offset;
+    item->range_length = stream_item.range_length;
+}
+
+void Session::to_stream_item(const SendItem &item, StreamItem *stream_item)
+{
+    stream_item->request_id = item.request_id;
+    stream_item->share = item.share;
+    stream_item->file_path = item.file_path;
+    stream_item->file_name = item.file_name;
+    stream_item->resume_size = item.resume_size;
+    stream_item->file_size = item.file_size;
+    stream_item->range_start = item.range_start;
+    stream_item->range_offset = item.range_offset;
+    stream_item->range_length = item.range_length;
+}
+
+/*
+ * The connection is gone: the group items it took and did not get out
+ * go back to the group for the other streams, in the order they were
+ * taken, and no more are taken.
+ */
+void Session::give_back_items()
+{
+    if (!group)
+        return;
+
+    QList<SendItem> items = unflushed;
+    items.append(current_item);
+    items += batch_items;
+    items += send_queue;
+
+    QList<StreamItem> list;
+    for (int i = 0; i < items.size(); i++) {
+        if (!items.at(i).from_group)
+            continue;
+        StreamItem stream_item;
+        to_stream_item(items.at(i), &stream_item);
+        list.append(stream_item);
+    }
+    unflushed.clear();
+
+    disconnect(group.data(), 0, this, 0);
+    group->leave();
+    group->give_back(list);
+    group.clear();
+}
+
+/*
+ * Cut a large file into STREAM_CHUNK_SIZE ranges, starting after the
+ * resume prefix that check_resume() accepted.
+ */
+void Session::queue_split_file(const SendItem &item, qint64 file_size,
+                               QList<StreamItem> *list)
+{
+    qint64 start = qMin(item.resume_size, file_size);
+    qint64 offset = start;
+    do {
+        StreamItem range;
+        range.request_id = item.request_id;
+        range.queued_us = offset == start ? item.queued_us : 0;
+        range.share = item.share;
+        range.file_path = item.file_path;
+        range.file_name = item.file_name;
+        range.file_size = file_size;
+        range.range_start = start;
+        range.range_offset = offset;
+        range.range_length = qMin((qint64)STREAM_CHUNK_SIZE,
+                                  file_size - offset);
+        list->append(range);
+        offset += range.range_length;
+    } while (offset < file_size);
+}
+
+/* Body layout: Count(quint32) + Count * Name */
+void Session::send_dir_entry()
+{
+    QByteArray block;
+    WireWriter out(&block);
+
+    QStringList names = shared_dirs->names();
+    out.put_u32(names.size());
+    for (int i = 0; i < names.size(); i++)
+        out.put_name(names.at(i));
+
+    queue_frame(MSG_TAG_LIST, block);
+}
+
+void Session::send_files_entry()
+{
+    queue_walk(MSG_TAG_ENTRY);
+}
+
+void Session::send_files_manifest()
+{
+    queue_walk(MSG_TAG_MANIFEST);
+}
+
+/* walk the whole tree of the shared directory msg, see send_walk_batch() */
+void Session::queue_walk(qint32 tag)
+{
+    QString dirpath = shared_dirs->path(msg);
+    if (dirpath.isEmpty()) {
+        qDebug() << "Unknown dir " << msg;
+        queue_error(request_id, QString(), tr("no such share"),
+                    request_time_us);
+        pump();
+        return;
+    }
+
+    SendItem item;
+    item.file_path = dirpath;
+    item.file_name = msg;
+    item.walk_tag = tag;
+    item.request_id = request_id;
+    item.queued_us = request_time_us;
+    control_queue.enqueue(item);
+
+    pump();
+}
+
+/* false when the index is not built yet, the item is then left queued */
+bool Session::start_walk(const SendItem &item)
+{
+    QSharedPointer<DirIndex> dir_index = shared_dirs->index(item.file_name);
+    if (!dir_index) {
+        qDebug() << "Unknown dir " << item.file_name;
+        queue_error(item.request_id, QString(), tr("no such share"));
+        return true;
+    }
+
+    if (!dir_index->snapshot(&walk_entries)) {
+        /* its wait was counted when it was taken the first time */
+        SendItem retry = item;
+        retry.queued_us = 0;
+        control_queue.prepend(retry);
+        QTimer::singleShot(INDEX_RETRY_MS, this, SLOT(pump()));
+        return false;
+    }
+
+    /* hashes of the manifest come in on the index's hash threads */
+    if (item.walk_tag == MSG_TAG_MANIFEST)
+        connect(dir_index.data(), SIGNAL(hashed()), this, SLOT(pump()),
+                Qt::QueuedConnection);
+    current_walk = dir_index;
+    walk_pos = 0;
+    walk_tag = item.walk_tag;
+    walk_name = item.file_name;
+    return true;
+}
+
+/*
+ * Send the next batch of a directory walk. Paths are relative to the
+ * shared directory and '/' separated. The entries come from the
+ * directory index snapshot taken in start_walk(), so no request touches
+ * the disk. Files the index has no digest for yet are hashed on its
+ * hash threads; the batch stops short before the first of them and the
+ * walk goes on once DirIndex::hashed() says they are in.
+ *
+ * Both bodies start with DirName + Last(quint8) + Count(quint32), in the
+ * encoding of wire.h, followed by Count records:
+ * MSG_TAG_ENTRY:    IsDir(quint8) + Path
+ * MSG_TAG_MANIFEST: Path + Size(quint64) + MTime(quint64 ms) +
+ *                   SHA-256(short bytes), for regular files only
+ *
+ * Returns the bytes of work done (frame and hashed data), -1 when the
+ * walk waits for hashes.
+ */
+qint64 Session::send_walk_batch()
+{
+    QByteArray entries;
+    WireWriter entry_out(&entries);
+
+    quint32 count = 0;
+    qint64 work = 0;
+    int batch = walk_tag == MSG_TAG_ENTRY ? LIST_BATCH : MANIFEST_BATCH;
+    bool waiting = false;
+
+    while (count < batch && walk_pos < walk_entries.size()) {
+        const DirIndex::Entry &entry = walk_entries.at(walk_pos);
+
+        if (walk_tag == MSG_TAG_ENTRY) {
+            entry_out.put_u8(entry.is_dir ? 1 : 0);
+            entry_out.put_name(entry.path);
+        } else {
+            if (entry.is_dir) {
+                walk_pos++;
+                continue;
+            }
+
+            QByteArray hash;
+            if (!current_walk->cached_hash(entry.path, entry.size,
+                                           entry.mtime, &hash)) {
+                request_walk_hashes(batch);
+                waiting = true;
+                break;
+            }
+
+            entry_out.put_name(entry.path);
+            entry_out.put_u64(entry.size);
+            entry_out.put_u64(entry.mtime);
+            entry_out.put_short_bytes(hash);
+            /* charged even on a cache hit, keeps batches bounded */
+            work += BLOCK_SIZE;
+        }
+        walk_pos++;
+        count++;
+    }
+
+    if (waiting && count == 0)
+        return -1;
+
+    bool last = walk_pos >= walk_entries.size();
+
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_name(walk_name);
+    out.put_u8(last ? 1 : 0);
+    out.put_u32(count);
+    block.append(entries);
+
+    socket->write(make_frame(walk_tag, block, walk_request_id));
+
+    if (last)
+        close_walk();
+
+    return waiting ? -1 : work + block.size();
+}
+
+/*
+ * Have the index hash the files of the next count manifest entries it
+ * has no digest for, the walk stopped at the first of them.
+ */
+void Session::request_walk_hashes(int count)
+{
+    for (int i = walk_pos; i < walk_entries.size() && count > 0; i++) {
+        const DirIndex::Entry &entry = walk_entries.at(i);
+        if (entry.is_dir)
+            continue;
+
+        QByteArray hash;
+        if (!current_walk->cached_hash(entry.path, entry.size, entry.mtime,
+                                       &hash))
+            current_walk->request_hash(entry.path, entry.size, entry.mtime);
+        count--;
+    }
+}
+
+void Session::close_walk()
+{
+    if (current_walk)
+        disconnect(current_walk.data(), SIGNAL(hashed()), this, SLOT(pump()));
+    current_walk.clear();
+    walk_entries.clear();
+    walk_pos = 0;
+    walk_tag = 0;
+}
+
+/*
+ * Request body: DirName + WantCount(quint32) + WantCount * Path +
+ *     PartCount(quint32) + PartCount * (Path + Size(quint64) +
+ *                                       SHA-256(short bytes)) +
+ *     HaveCount(quint32) + HaveCount * SHA-256(short bytes)
+ * Only the wanted files are sent. The parts are partial downloads the
+ * client holds for this directory, the hashes content it holds below
+ * its destination.
+ */
+void Session::send_files_data(WireReader &in)
+{
+    QStringList wanted;
+    quint32 count = in.get_u32();
+    for (quint32 i = 0; i < count && in.is_ok(); i++) {
+        QString name = in.get_name();
+        if (in.is_ok())
+            wanted.append(name);
+    }
+
+    QString dirpath = shared_dirs->path(msg);
+    if (dirpath.isEmpty()) {
+        qDebug() << "Unknown dir " << msg;
+        for (int i = 0; i < wanted.size(); i++)
+            queue_error(request_id, wanted.at(i), tr("no such share"),
+                        i == 0 ? request_time_us : 0);
+        pump();
+        return;
+    }
+
+    QHash<QString, QPair<qint64, QByteArray> > partials;
+    count = in.get_u32();
+    for (quint32 i = 0; i < count && in.is_ok(); i++) {
+        QString name = in.get_name();
+        qint64 size = in.get_u64();
+        QByteArray hash = in.get_short_bytes();
+        if (in.is_ok() && size >= 0)
+            partials.insert(name, qMakePair(size, hash));
+    }
+
+    /* content the client holds somewhere below its destination */
+    QSet<QByteArray> held;
+    count = in.get_u32();
+    for (quint32 i = 0; i < count && in.is_ok(); i++) {
+        QByteArray hash = in.get_short_bytes();
+        if (in.is_ok())
+            held.insert(hash);
+    }
+
+    QList<StreamItem> group_items;
+    QSharedPointer<DirIndex> index = shared_dirs->index(msg);
+    ContentIndex *content = shared_dirs->get_content();
+
+    /* the wait of the request is counted on its first frame only */
+    qint64 queued_us = request_time_us;
+    QDir dir(dirpath);
+    for (int i = 0; i < wanted.size(); i++) {
+        QString name = wanted.at(i);
+        QFileInfo fileinfo;
+        if (is_safe_path(name))
+            fileinfo.setFile(dir.absoluteFilePath(name));
+        if (!fileinfo.isFile()) {
+            queue_error(request_id, name, tr("no such file"), queued_us);
+            queued_us = 0;
+            continue;
+        }
+
+        SendItem item;
+        item.request_id = request_id;
+        item.queued_us = queued_us;
+        item.share = msg;
+        item.file_path = fileinfo.absoluteFilePath();
+        item.file_name = name;
+        item.file_size = fileinfo.size();
+        queued_us = 0;
+
+        /* hashed for the manifest the client built this request from */
+        QByteArray hash;
+        if (index)
+            index->cached_hash(name, fileinfo.size(),
+                               fileinfo.lastModified().toMSecsSinceEpoch(),
+                               &hash);
+        if (!hash.isEmpty()) {
+            if (held.contains(hash))
+                item.copy = COPY_HELD;
+            else if (!group && (sent_blobs.contains(hash) ||
+                                sending_blobs.contains(hash)))
+                item.copy = COPY_SENT;
+            /* other streams send group files, their outcome is not seen */
+            if (item.copy != COPY_NONE ||
+                    (!group && content->copies(hash) > 1))
+                item.content_hash = hash;
+            if (item.copy != COPY_NONE) {
+                send_queue.enqueue(item);
+                continue;
+            }
+        }
+
+        QHash<QString, QPair<qint64, QByteArray> >::const_iterator it =
+                partials.constFind(name);
+        if (it != partials.constEnd()) {
+            item.resume_size = it->first;
+            item.resume_hash = it->second;
+        }
+
+        if (item.resume_size > 0)
+            check_resume(item);
+        else
+            queue_file(item, &group_items);
+    }
+
+    if (group)
+        group->add(group_items);
+    pump();
+}
+
+/* item is ready to go: into send_queue, or to the group when joined */
+void Session::queue_file(const SendItem &item, QList<StreamItem> *group_items)
+{
+    if (!group) {
+        send_queue.append(local_items(item));
+    } else if (group->streams() > 1 && item.file_size >= STREAM_SPLIT_SIZE) {
+        queue_split_file(item, item.file_size, group_items);
+    } else {
+        StreamItem stream_item;
+        stream_item.request_id = item.request_id;
+        stream_item.queued_us = item.queued_us;
+        stream_item.share = item.share;
+        stream_item.file_path = item.file_path;
+        stream_item.file_name = item.file_name;
+        stream_item.file_size = item.file_size;
+        stream_item.resume_size = item.resume_size;
+        group_items->append(stream_item);
+    }
+}
+
+/*
+ * The client holds a prefix of item: hash ours on the disk threads and
+ * queue the item once the sums are compared, see take_resumed(); files
+ * behind it that need no check may go out first. Every range of a split
+ * file depends on the prefix, so it is checked before the split.
+ */
+void Session::check_resume(const SendItem &item)
+{
+    SendItem waiting = item;
+
+    waiting.resume_check = QSharedPointer<HashRequest>(new HashRequest);
+    waiting.resume_check->path = item.file_path;
+    waiting.resume_check->length = item.resume_size;
+    waiting.resume_check->waiter = this;
+    disk_reader->hash(waiting.resume_check);
+    resuming.append(waiting);
+}
+
+/* queue the files whose resume prefix has been hashed meanwhile */
+void Session::take_resumed()
+{
+    QList<StreamItem> group_items;
+
+    QList<SendItem>::iterator it = resuming.begin();
+    while (it != resuming.end()) {
+        if (!it->resume_check->done.loadAcquire()) {
+            ++it;
+            continue;
+        }
+
+        SendItem item = *it;
+        it = resuming.erase(it);
+
+        /* resume only if the client's prefix matches ours */
+        if (item.resume_size > item.file_size ||
+                item.resume_check->result != item.resume_hash)
+            item.resume_size = 0;
+        item.resume_check.clear();
+        queue_file(item, &group_items);
+    }
+
+    if (group && !group_items.isEmpty())
+        group->add(group_items);
+}
+
+/*
+ * item as it goes into send_queue of an unjoined connection: whole, or
+ * in ranges when large, so listings can go out between them. Content
+ * worth a MSG_TAG_COPY later is sending until all of them went out.
+ */
+QList<Session::SendItem> Session::local_items(const SendItem &item)
+{
+    QList<SendItem> items;
+
+    if (item.file_size >= STREAM_SPLIT_SIZE) {
+        QList<StreamItem> ranges;
+        queue_split_file(item, item.file_size, &ranges);
+        for (int i = 0; i < ranges.size(); i++) {
+            SendItem range;
+            from_stream_item(ranges.at(i), &range);
+            range.content_hash = item.content_hash;
+            items.append(range);
+        }
+    } else {
+        items.append(item);
+    }
+
+    if (!item.content_hash.isEmpty())
+        sending_blobs.insert(item.content_hash, items.size());
+    return items;
+}
+
+/*
+ * Name content the client already has instead of sending it again.
+ * False when the earlier send of it on this connection failed, the
+ * file itself goes out then.
+ */
+bool Session::send_copy(const SendItem &item)
+{
+    if (item.copy == COPY_SENT && !sent_blobs.contains(item.content_hash))
+        return false;
+
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_name(item.file_name);
+    out.put_u64(item.file_size);
+    out.put_u64(QFileInfo(item.file_path).lastModified().toMSecsSinceEpoch());
+    out.put_short_bytes(item.content_hash);
+
+    socket->write(make_frame(MSG_TAG_COPY, block, item.request_id));
+    stats->add_dedup_bytes(item.file_size);
+    return true;
+}
+
+/* an item of content in sending_blobs went out, or failed to */
+void Session::blob_done(const QByteArray &hash, bool ok)
+{
+    QHash<QByteArray, int>::iterator it = sending_blobs.find(hash);
+    if (it == sending_blobs.end())
+        return;
+
+    if (ok && --*it > 0)
+        return;
+    sending_blobs.erase(it);
+    if (ok)
+        sent_blobs.insert(hash);
+}
+
+/*
+ * Request body: DirName + FileName + Signature(long bytes)
+ * with the signature of the client's current copy, see delta.h.
+ */
+void Session::send_files_delta(WireReader &in)
+{
+    QString name = in.get_name();
+    QByteArray signature = in.get_long_bytes();
+
+    QString dirpath = shared_dirs->path(msg);
+    QFileInfo fileinfo;
+    if (dirpath.isEmpty())
+        qDebug() << "Unknown dir " << msg;
+    else if (in.is_ok() && is_safe_path(name))
+        fileinfo.setFile(QDir(dirpath).absoluteFilePath(name));
+    if (!fileinfo.isFile()) {
+        queue_error(request_id, name, tr("no such file"), request_time_us);
+        pump();
+        return;
+    }
+
+    SendItem item;
+    item.request_id = request_id;
+    item.queued_us = request_time_us;
+    item.share = msg;
+    item.file_path = fileinfo.absoluteFilePath();
+    item.file_name = name;
+    item.delta_signature = signature;
+    send_queue.enqueue(item);
+
+    pump();
+}
+
+/* whole file small enough to go into a MSG_TAG_BATCH */
+bool Session::is_small_file(const SendItem &item) const
+{
+    return !item.file_path.isEmpty() && !item.walk_tag &&
+            item.copy == COPY_NONE && item.delta_signature.isEmpty() &&
+            item.range_length < 0 &&
+            item.resume_size == 0 && item.file_size <= BATCH_FILE_MAX &&
+            item.file_name.size() < BATCH_FILE_MAX / 4;
+}
+
+/*
+ * Gather first and the small files queued right behind it for the same
+ * request into one MSG_TAG_BATCH frame, see protocol.h, and read them
+ * one after the other on the disk pool. send_batch() writes the frame
+ * once they are in. One buffer, one frame and one socket write for up
+ * to BATCH_MAX_FILES files instead of a frame, a trailer and a read
+ * per file.
+ */
+void Session::start_batch(const SendItem &first)
+{
+    QSharedPointer<BatchRequest> request(new BatchRequest);
+    qint64 size = 0;
+
+    SendItem item = first;
+    for (;;) {
+        BatchFile file;
+        file.path = item.file_path;
+        file.max_size = BATCH_FILE_MAX;
+        request->files.append(file);
+        batch_items.append(item);
+
+        size += BATCH_RECORD_HEAD + item.file_name.size() * 3 +
+                item.file_size;
+        if (batch_items.size() >= BATCH_MAX_FILES)
+            break;
+
+        qint64 room = BATCH_MAX_SIZE - size - BATCH_RECORD_HEAD;
+        if (!send_queue.isEmpty()) {
+            const SendItem &next = send_queue.head();
+            if (!is_small_file(next) || next.request_id != first.request_id ||
+                    next.file_size + next.file_name.size() * 3 > room)
+                break;
+            item = send_queue.dequeue();
+        } else {
+            StreamItem stream_item;
+            if (!group || room <= 0 ||
+                    !group->take_small(first.request_id,
+                                       qMin(room / 2, (qint64)BATCH_FILE_MAX),
+                                       &stream_item))
+                break;
+            item = SendItem();
+            item.request_id = stream_item.request_id;
+            item.share = stream_item.share;
+            item.file_path = stream_item.file_path;
+            item.file_name = stream_item.file_name;
+            item.file_size = stream_item.file_size;
+            item.from_group = true;
+        }
+    }
+
+    request->waiter = this;
+    batch_read = request;
+    disk_reader->read_batch(request);
+}
+
+/*
+ * Write the batch start_batch() read as one frame.
+ * Returns the payload size, -1 while the files are still being read.
+ */
+qint64 Session::send_batch()
+{
+    if (!batch_read->done.loadAcquire())
+        return -1;
+
+    QSharedPointer<BatchRequest> request = batch_read;
+    QList<SendItem> items;
+    batch_read.clear();
+    items.swap(batch_items);
+
+    QByteArray payload;
+    quint32 count = 0;
+
+    payload.reserve(BATCH_MAX_SIZE);
+    for (int i = 0; i < items.size(); i++) {
+        if (add_batch_record(items.at(i), request->files.at(i), &payload))
+            count++;
+        /* the ones queued again are handed back from send_queue */
+        if (items.at(i).from_group &&
+                request->files.at(i).status != READ_TOO_LARGE)
+            unflushed.append(items.at(i));
+    }
+
+    int batch_codec = codec;
+    QByteArray data;
+    if (batch_codec == CODEC_NONE ||
+            !compress_block(batch_codec, payload.constData(), payload.size(),
+                            &data) ||
+            data.size() >= payload.size()) {
+        batch_codec = CODEC_NONE;
+        data = payload;
+    }
+
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_u32(batch_codec);
+    out.put_u32(payload.size());
+    out.put_u32(count);
+
+    socket->write(make_frame_header(MSG_TAG_BATCH, block.size() + data.size(),
+                                    send_request_id));
+    socket->write(block + data);
+
+    stats->add_files(count);
+    stats->add_share_bytes(items.first().share, payload.size());
+
+    return payload.size();
+}
+
+/*
+ * Append the record of item as the pool read it. A file that grew past
+ * BATCH_FILE_MAX is queued again to go out on its own.
+ */
+bool Session::add_batch_record(const SendItem &item, const BatchFile &file,
+                               QByteArray *payload)
+{
+    if (file.status == READ_OPEN_FAILED) {
+        qDebug() << "Open file Error " << item.file_path;
+        queue_error(item.request_id, item.file_name, tr("can't open file"));
+        blob_done(item.content_hash, false);
+        return false;
+    }
+
+    if (file.status == READ_TOO_LARGE) {
+        SendItem large = item;
+        large.file_size = file.size;
+        large.queued_us = 0;
+        send_queue.prepend(large);
+        return false;
+    }
+
+    if (file.status != READ_OK) {
+        qDebug() << "Short read " << item.file_path;
+        queue_error(item.request_id, item.file_name, tr("short read"));
+        blob_done(item.content_hash, false);
+        return false;
+    }
+
+    WireWriter out(payload);
+
+    out.put_name(item.file_name);
+    out.put_u32(file.size);
+    out.put_u64(file.mtime);
+    out.put_bytes(file.data.constData(), file.size);
+    out.put_u32(file.crc);
+    blob_done(item.content_hash, true);
+    return true;
+}
+
+/* FileName + FileSize + MTime, the start of every file frame's meta */
+QByteArray Session::file_meta(const QString &name, qint64 file_size) const
+{
+    QByteArray meta;
+    WireWriter out(&meta);
+
+    out.put_name(name);
+    out.put_u64(file_size);
+    out.put_u64(QFileInfo(*current_file).lastModified().toMSecsSinceEpoch());
+    return meta;
+}
+
+/* MetaSize(quint32) + meta, the head of a file frame's body */
+static QByteArray meta_block(const QByteArray &meta)
+{
+    QByteArray block;
+    WireWriter out(&block);
+
+    out.put_u32(meta.size());
+    out.put_bytes(meta.constData(), meta.size());
+    return block;
+}
+
+/*
+ * Open the file of a queued item and write its frame header.
+ *
+ * Body layout: MetaSize(quint32) + Meta + FileData
+ * Meta: FileName + FileSize(quint64) + MTime(quint64 ms) +
+ *       Offset(quint64)
+ * in the encoding of wire.h. FileData holds the bytes from Offset to
+ * FileSize.
+ *
+ * A chunk of a split file goes out as MSG_TAG_RANGE instead:
+ * Meta: FileName + FileSize(quint64) + MTime(quint64 ms) +
+ *       Start(quint64) + Offset(quint64)
+ * FileData holds the frame's bytes from Offset, Start is where the
+ * transfer of the whole file began (its resume offset).
+ */
+bool Session::start_file(const SendItem &item)
+{
+    current_file = new QFile(item.file_path);
+    if (!current_file->open(QFile::ReadOnly)) {
+        qDebug() << "Open file Error";
+        queue_error(item.request_id, item.file_name, tr("can't open file"));
+        close_current_file();
+        return false;
+    }
+
+    if (item.range_length >= 0)
+        return start_range(item);
+
+    /* the prefix was checked by check_resume() */
+    qint64 file_size = current_file->size();
+    qint64 offset = item.resume_size <= file_size ? item.resume_size : 0;
+
+    QByteArray meta = file_meta(item.file_name, file_size);
+    WireWriter out(&meta);
+
+    out.put_u64(offset);
+
+    QByteArray block = meta_block(meta);
+    QByteArray head = make_frame_header(MSG_TAG_FILE,
+                                        block.size() + file_size - offset,
+                                        send_request_id) + block;
+    if (start_compressed(item, file_size, offset, offset, file_size - offset,
+                         head))
+        return true;
+    socket->write(head);
+
+    file_offset = offset;
+    left_file_size = file_size - offset;
+#ifdef Q_OS_LINUX
+    zero_copy_file = options.zero_copy;
+#endif
+    return true;
+}
+
+/* current_file is open, write the MSG_TAG_RANGE header of item */
+bool Session::start_range(const SendItem &item)
+{
+    QByteArray meta = file_meta(item.file_name, item.file_size);
+    WireWriter out(&meta);
+
+    out.put_u64(item.range_start);
+    out.put_u64(item.range_offset);
+
+    QByteArray block = meta_block(meta);
+    QByteArray head = make_frame_header(MSG_TAG_RANGE,
+                                        block.size() + item.range_length,
+                                        send_request_id) + block;
+    if (start_compressed(item, item.file_size, item.range_start,
+                         item.range_offset, item.range_length, head))
+        return true;
+    socket->write(head);
+
+    file_offset = item.range_offset;
+    left_file_size = item.range_length;
+#ifdef Q_OS_LINUX
+    zero_copy_file = options.zero_copy;
+#endif
+    return true;
+}
+
+/*
+ * Send [offset, offset + length) as MSG_TAG_ZRANGE chunks if its start
+ * shrinks, as the raw frame that head begins otherwise. Nothing is
+ * written here: the first chunk is the sample, send_compressed_block()
+ * decides once it is read.
+ */
+bool Session::start_compressed(const SendItem &item, qint64 file_size,
+                               qint64 start, qint64 offset, qint64 length,
+                               const QByteArray &head)
+{
+    if (codec == CODEC_NONE || length < COMPRESS_MIN_SIZE)
+        return false;
+
+    chunk_meta = file_meta(item.file_name, file_size);
+    WireWriter out(&chunk_meta);
+
+    out.put_u64(start);
+
+    raw_head = head;
+    file_codec = codec;
+    file_offset = offset;
+    left_file_size = length;
+    return true;
+}
+
+/*
+ * Compress the next COMPRESS_CHUNK_SIZE bytes of the current file into
+ * one frame. Chunks that don't shrink go out raw with CODEC_NONE.
+ * The chunks are read ahead, one per read.
+ *
+ * Body layout: MetaSize(quint32) + Meta + Data
+ * Meta: FileName + FileSize(quint64) + MTime(quint64 ms) +
+ *       Start(quint64) + Offset(quint64) + RawSize(quint32) +
+ *       Codec(quint32)
+ *
+ * Returns the raw bytes consumed, -1 while the chunk is still being read.
+ */
+qint64 Session::send_compressed_block()
+{
+    qint64 len = qMin(left_file_size, (qint64)COMPRESS_CHUNK_SIZE);
+
+    if (!read_ahead)
+        read_ahead = new ReadAhead(disk_reader, this, current_file->handle(),
+                                   file_offset, left_file_size,
+                                   COMPRESS_CHUNK_SIZE);
+
+    QByteArray raw;
+    if (read_ahead->take(&raw) == 0)
+        return -1;
+    if (raw.size() < len) {
+        /* file shrank since it was queued, keep the promised size */
+        qDebug() << "Short read " << current_file->fileName();
+        raw.append(QByteArray(len - raw.size(), '\0'));
+        send_crc_bad = true;
+    }
+    send_crc = crc32c(send_crc, raw.constData(), raw.size());
+
+    if (!raw_head.isEmpty()) {
+        QByteArray head;
+        head.swap(raw_head);
+        if (!is_compressible(file_codec, raw.left(COMPRESS_SAMPLE_SIZE))) {
+            /* the rest goes out raw, zero copy again if allowed */
+            socket->write(head);
+            write_data(raw.constData(), raw.size());
+            delete read_ahead;
+            read_ahead = 0;
+            file_codec = CODEC_NONE;
+            chunk_meta.clear();
+#ifdef Q_OS_LINUX
+            zero_copy_file = options.zero_copy;
+#endif
+            file_offset += len;
+            left_file_size -= len;
+            return len;
+        }
+    }
+
+    int chunk_codec = file_codec;
+    const QByteArray *data = &packed;
+    if (!compress_block(chunk_codec, raw.constData(), raw.size(), &packed) ||
+            packed.size() >= raw.size()) {
+        chunk_codec = CODEC_NONE;
+        data = &raw;
+    }
+
+    QByteArray meta = chunk_meta;
+    WireWriter out(&meta);
+
+    out.put_u64(file_offset);
+    out.put_u32(raw.size());
+    out.put_u32(chunk_codec);
+
+    QByteArray block = meta_block(meta);
+    QByteArray frame = make_frame_header(MSG_TAG_ZRANGE,
+                                         block.size() + data->size(),
+                                         send_request_id) + block;
+    write_data(frame.constData(), frame.size());
+    write_data(data->constData(), data->size());
+
+    file_offset += len;
+    left_file_size -= len;
+    return len;
+}
+
+/*
+ * Open the file of a queued delta item. The ops are sent as a run of
+ * MSG_TAG_DELTA frames, each holding whole ops:
+ *
+ * Body layout: MetaSize(quint32) + Meta + Ops
+ * Meta: FileName + FileSize(quint64) + MTime(quint64 ms) +
+ *       BlockSize(quint32) + Last(quint8)
+ */
+bool Session::start_delta(const SendItem &item)
+{
+    current_delta = QSharedPointer<DeltaEncoder>(
+                new DeltaEncoder(item.delta_signature));
+    current_file = new QFile(item.file_path);
+    if (!current_delta->is_valid() || !current_file->open(QFile::ReadOnly)) {
+        qDebug() << "Delta Error " << item.file_name;
+        queue_error(item.request_id, item.file_name, tr("can't send delta"));
+        close_current_file();
+        return false;
+    }
+
+    file_offset = 0;
+    left_file_size = current_file->size();
+    delta_meta = file_meta(item.file_name, left_file_size);
+    WireWriter out(&delta_meta);
+
+    out.put_u32(current_delta->get_block_size());
+
+    scan_delta(QSharedPointer<ReadFile>(
+                   new ReadFile(::dup(current_file->handle()))));
+    return true;
+}
+
+/* scan the next DELTA_READ_SIZE bytes of current_file on the disk pool */
+void Session::scan_delta(const QSharedPointer<ReadFile> &file)
+{
+    QSharedPointer<DeltaRequest> step(new DeltaRequest);
+
+    step->file = file;
+    step->encoder = current_delta;
+    step->offset = file_offset;
+    step->length = qMin(left_file_size, (qint64)DELTA_READ_SIZE);
+    step->last = step->length >= left_file_size;
+    step->waiter = this;
+    delta_scan = step;
+    disk_reader->scan(step);
+}
+
+/*
+ * Take the scan step that is done, start the next one and flush the
+ * pending ops once there are enough of them or the file is done.
+ * Returns the bytes scanned, -1 while the step is still running.
+ */
+qint64 Session::send_delta_block()
+{
+    if (!delta_scan->done.loadAcquire())
+        return -1;
+
+    QSharedPointer<DeltaRequest> step = delta_scan;
+    bool last = step->last;
+    bool flush = last || current_delta->output_size() >= DELTA_FRAME_SIZE;
+    QByteArray ops;
+    if (flush)
+        ops = current_delta->take_output();
+
+    if (!last) {
+        file_offset += step->result;
+        left_file_size -= step->result;
+        scan_delta(step->file);
+    }
+
+    if (flush) {
+        QByteArray meta = delta_meta;
+        WireWriter out(&meta);
+
+        out.put_u8(last ? 1 : 0);
+
+        QByteArray head = meta_block(meta);
+        socket->write(make_frame_header(MSG_TAG_DELTA,
+                                        head.size() + ops.size(),
+                                        send_request_id));
+        socket->write(head + ops);
+    }
+
+    if (last) {
+        stats->add_files(1);
+        close_current_file();
+    }
+
+    return qMax(step->result, (qint64)0);
+}
+
+/* bytes the socket handed to the kernel, sendfile() counts its own */
+void Session::count_written(qint64 bytes)
+{
+    if (socket->bytesToWrite() == 0)
+        unflushed.clear();
+    stats->add_bytes(bytes);
+    stats->set_queue(control_queue.size() + send_queue.size() +
+                     resuming.size(), socket->bytesToWrite());
+}
+
+/*
+ * Control frames go out right here, ahead of any file data still
+ * queued; file data is sent in the turns SendScheduler hands out.
+ */
+void Session::pump()
+{
+    /* a flush inside send_bulk() emits bytesWritten(), come back later */
+    if (sending) {
+        QMetaObject::invokeMethod(this, "pump", Qt::QueuedConnection);
+        return;
+    }
+
+    if (!resuming.isEmpty())
+        take_resumed();
+    send_control();
+
+    if (!throttled && has_bulk())
+        scheduler->wake(this);
+}
+
+void Session::end_throttle()
+{
+    throttled = false;
+    pump();
+}
+
+/*
+ * Write the queued listings and walk batches, up to high_water bytes in
+ * the socket. Only between frames: a file body that is partly written
+ * has to be finished first, which is why large files go out in ranges.
+ */
+void Session::send_control()
+{
+    qint64 work_done = 0;
+
+    while (!in_file_body() && socket->bytesToWrite() < options.high_water) {
+        if (!current_walk) {
+            if (control_queue.isEmpty())
+                return;
+
+            SendItem item = control_queue.dequeue();
+            if (item.queued_us)
+                stats->add_latency(stats_clock_us() - item.queued_us);
+
+            if (!item.walk_tag) {
+                socket->write(item.head);
+                continue;
+            }
+
+            walk_request_id = item.request_id;
+            if (!start_walk(item))
+                return;
+            if (!current_walk)
+                continue;
+        }
+
+        qint64 work = send_walk_batch();
+        /* pumped again by DirIndex::hashed() */
+        if (work < 0)
+            return;
+        work_done += work;
+        if (current_walk && work_done >= options.high_water) {
+            QMetaObject::invokeMethod(this, "pump", Qt::QueuedConnection);
+            return;
+        }
+    }
+}
+
+/* the body of a FILE or RANGE frame is only partly written */
+bool Session::in_file_body() const
+{
+    return current_file && !current_delta && file_codec == CODEC_NONE;
+}
+
+bool Session::has_bulk() const
+{
+    return current_file || batch_read || !send_queue.isEmpty() ||
+            (group && !group->is_empty());
+}
+
+/* share the next file bytes are read from, empty if not known yet */
+QString Session::next_share() const
+{
+    if (current_file || batch_read)
+        return current_share;
+    if (!send_queue.isEmpty())
+        return send_queue.head().share;
+    return QString();
+}
+
+/* wait wait_us for the rate limits, the scheduler is woken after */
+void Session::throttle(qint64 wait_us)
+{
+    if (throttled)
+        return;
+
+    throttled = true;
+    QTimer::singleShot(qMax((qint64)1, (wait_us + 999) / 1000), this,
+                       SLOT(end_throttle()));
+}
+
+bool Session::send_bulk(qint64 budget, qint64 *sent)
+{
+    QScopedValueRollback<bool> guard(sending, true);
+    qint64 work_done = 0;
+
+    *sent = 0;
+    while (work_done < budget) {
+        /* listings that came in meanwhile go first */
+        if (!in_file_body() &&
+                (current_walk || !control_queue.isEmpty()))
+            send_control();
+        if (socket->bytesToWrite() >= options.high_water)
+            return false;
+
+        qint64 allowed = budget - work_done;
+        QString share = next_share();
+        if (limiter->is_limited()) {
+            qint64 wait_us;
+            allowed = limiter->allowance(client, share, allowed, &wait_us);
+            if (allowed <= 0) {
+                throttle(wait_us);
+                return false;
+            }
+        }
+
+        if (batch_read) {
+            qint64 len = send_batch();
+            if (len < 0)
+                return false;
+            limiter->charge(client, current_share, len);
+            work_done += len;
+            *sent = work_done;
+            continue;
+        }
+
+        if (!current_file) {
+            SendItem item;
+            if (!send_queue.isEmpty())
+                item = send_queue.dequeue();
+            else if (!take_group_item(&item))
+                return false;
+
+            if (item.queued_us)
+                stats->add_latency(stats_clock_us() - item.queued_us);
+
+            if (item.file_path.isEmpty()) {
+                socket->write(item.head);
+                continue;
+            }
+
+            if (item.copy != COPY_NONE) {
+                if (send_copy(item))
+                    continue;
+                /* the content did not make it earlier, send it here */
+                item.copy = COPY_NONE;
+                item.queued_us = 0;
+                QList<SendItem> items = local_items(item);
+                for (int i = items.size() - 1; i >= 0; i--)
+                    send_queue.prepend(items.at(i));
+                continue;
+            }
+
+            send_request_id = item.request_id;
+            current_share = item.share;
+            if (is_small_file(item)) {
+                start_batch(item);
+                continue;
+            }
+
+            current_item = item;
+            if (!item.delta_signature.isEmpty()) {
+                if (!start_delta(item))
+                    continue;
+            } else if (!start_file(item)) {
+                blob_done(item.content_hash, false);
+                continue;
+            } else {
+                current_hash = item.content_hash;
+                crc_name = item.file_name;
+                crc_offset = file_offset;
+                send_crc = 0;
+                send_crc_bad = false;
+            }
+            /* the share is known now, ask the limits again */
+            continue;
+        }
+
+        /* file bytes read for the client in this step */
+        qint64 len = 0;
+
+        if (current_delta) {
+            len = send_delta_block();
+            if (len < 0)
+                return false;
+        } else if (file_codec != CODEC_NONE) {
+            if (left_file_size > 0) {
+                len = send_compressed_block();
+                if (len < 0)
+                    return false;
+            }
+            if (left_file_size <= 0)
+                finish_current_file();
+        } else {
+            qint64 left = left_file_size;
+            bool waiting = false;
+
+            if (left_file_size > 0 && zero_copy_file) {
+                qint64 n = send_file_zero_copy(allowed);
+                if (n == 0) {
+                    /* kernel buffer full, a cached block arms bytesWritten() */
+                    if (socket->bytesToWrite() == 0)
+                        send_cached_block();
+                    waiting = true;
+                } else if (n < 0) {
+                    zero_copy_file = false;
+                }
+            } else if (left_file_size > 0) {
+                waiting = !send_file_block();
+            }
+
+            len = left - left_file_size;
+            if (left_file_size <= 0)
+                finish_current_file();
+            if (waiting) {
+                limiter->charge(client, share, len);
+                *sent = work_done + len;
+                return false;
+            }
+        }
+
+        limiter->charge(client, share, len);
+        work_done += len;
+        *sent = work_done;
+    }
+    return true;
+}
+
+/*
+ * Queue the next read-ahead block of the current file in the socket.
+ * Returns false while that block is still being read, the reader calls
+ * pump() once it is in.
+ */
+bool Session::send_file_block()
+{
+    qint64 len = qMin(left_file_size, (qint64)options.chunk_size);
+
+    if (!read_ahead)
+        read_ahead = new ReadAhead(disk_reader, this, current_file->handle(),
+                                   file_offset, left_file_size,
+                                   options.chunk_size);
+
+    QByteArray block;
+    if (read_ahead->take(&block) == 0)
+        return false;
+
+    send_crc = crc32c(send_crc, block.constData(), block.size());
+    if (block.size() < len) {
+        /* file shrank since the header was sent, keep framing intact */
+        qDebug() << "Short read " << current_file->fileName();
+        block.append(QByteArray(len - block.size(), '\0'));
+        send_crc_bad = true;
+    }
+
+    write_data(block.constData(), block.size());
+    file_offset += len;
+    left_file_size -= len;
+    return true;
+}
+
+/*
+ * Write from the caller's buffer straight to the kernel when nothing is
+ * queued in the socket before it. Only what the kernel can't take now
+ * is copied into the socket buffer, and that arms bytesWritten().
+ */
+void Session::write_data(const char *data, qint64 len)
+{
+#ifdef Q_OS_LINUX
+    if (socket->bytesToWrite() > 0)
+        socket->flush();
+    if (socket->bytesToWrite() == 0) {
+        ssize_t n = ::send(socket->socketDescriptor(), data, len,
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            stats->add_bytes(n);
+            data += n;
+            len -= n;
+        }
+    }
+#endif
+    if (len > 0)
+        socket->write(data, len);
+}
+
+/*
+ * Copy one BLOCK_SIZE chunk of the current file into the socket buffer.
+ * Only used right behind sendfile(), those bytes are in the page cache.
+ */
+void Session::send_cached_block()
+{
+    qint64 len = qMin(left_file_size, (qint64)BLOCK_SIZE);
+
+    if (current_file->pos() != file_offset)
+        current_file->seek(file_offset);
+
+    QByteArray block = current_file->read(len);
+    if (block.isEmpty()) {
+        /* file shrank since the header was sent, keep framing intact */
+        qDebug() << "Short read " << current_file->fileName();
+        block.fill('\0', len);
+        send_crc_bad = true;
+    } else {
+        send_crc = crc32c(send_crc, block.constData(), block.size());
+    }
+
+    qint64 written = socket->write(block);
+    if (written > 0) {
+        file_offset += written;
+        left_file_size -= written;
+    }
+}
+
+/*
+ * Push file data from the page cache straight into the socket.
+ * Returns the bytes sent, 0 when the socket can't take more right now
+ * and -1 when the caller has to fall back to buffered reads.
+ */
+qint64 Session::send_file_zero_copy(qint64 max_len)
+{
+#ifdef Q_OS_LINUX
+    /* anything already in the socket buffer has to go out first */
+    if (socket->bytesToWrite() > 0) {
+        socket->flush();
+        if (socket->bytesToWrite() > 0)
+            return 0;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    off_t offset = file_offset;
+    ssize_t n = ::sendfile(socket->socketDescriptor(), current_file->handle(),
+                           &offset, qMin(qMin(left_file_size, max_len),
+                                         (qint64)SENDFILE_CHUNK));
+    if (n > 0) {
+        /* the socket never blocks us, the disk did: read the rest ahead */
+        if (timer.elapsed() >= SLOW_SENDFILE_MS)
+            zero_copy_file = false;
+
+        stats->add_bytes(n);
+        update_crc(file_offset, n);
+        file_offset += n;
+        left_file_size -= n;
+        return n;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+#endif
+    return -1;
+}
+
+/*
+ * Add bytes the kernel sent for us to send_crc. They are still in the
+ * page cache, mapping them costs one pass over memory and no copy.
+ */
+void Session::update_crc(qint64 offset, qint64 len)
+{
+    uchar *data = current_file->map(offset, len);
+    if (data) {
+        send_crc = crc32c(send_crc, data, len);
+        current_file->unmap(data);
+        return;
+    }
+
+    current_file->seek(offset);
+    QByteArray block = current_file->read(len);
+    if (block.size() != len)
+        send_crc_bad = true;
+    send_crc = crc32c(send_crc, block.constData(), block.size());
+}
+
+/*
+ * All data of the current file item is out, follow it with its trailer:
+ *
+ * Body layout: FileName + Offset(quint64) + Length(quint64) +
+ *              CRC32C(quint32)
+ * in the encoding of wire.h, covering the item's bytes from Offset,
+ * across all of its frames.
+ */
+void Session::finish_current_file()
+{
+    if (current_file && !current_delta) {
+        QByteArray block;
+        WireWriter out(&block);
+
+        out.put_name(crc_name);
+        out.put_u64(crc_offset);
+        out.put_u64(file_offset - crc_offset);
+        /* never let made up bytes verify */
+        out.put_u32(send_crc_bad ? ~send_crc : send_crc);
+
+        socket->write(make_frame(MSG_TAG_CHECKSUM, block, send_request_id));
+
+        stats->add_share_bytes(current_share, file_offset - crc_offset);
+        if (file_offset >= current_file->size())
+            stats->add_files(1);
+        blob_done(current_hash, !send_crc_bad);
+        if (current_item.from_group && socket->bytesToWrite() > 0)
+            unflushed.append(current_item);
+    }
+
+    close_current_file();
+}
+
+void Session::close_current_file()
+{
+    current_delta.clear();
+    if (delta_scan) {
+        /* a step still running finishes on its own */
+        delta_scan->waiter = 0;
+        delta_scan.clear();
+    }
+    delta_meta.clear();
+    delete read_ahead;
+    read_ahead = 0;
+    current_hash.clear();
+    current_item = SendItem();
+
+    if (!current_file)
+        return;
+
+    current_file->close();
+    delete current_file;
+    current_file = 0;
+    file_offset = 0;
+    left_file_size = 0;
+    zero_copy_file = false;
+    file_codec = CODEC_NONE;
+    chunk_meta.clear();
+    raw_head.clear();
+}
@@ -0,0 +1,348 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QQueue>
+#include <QSet>
+#include <QString>
+#include <QByteArray>
+#include <QMetaType>
+#include <QVector>
+#include <QSharedPointer>
+#include "dirindex.h"
+#include "streamgroup.h"
+#include "sessionstats.h"
+
+class QTcpSocket;
+class QFile;
+class QFileInfo;
+class WireReader;
+class SharedDirs;
+class DeltaEncoder;
+class DiskReader;
+class ReadAhead;
+class SendScheduler;
+class RateLimiter;
+struct HashRequest;
+struct DeltaRequest;
+struct BatchRequest;
+struct BatchFile;
+struct ReadFile;
+
+/* handle msg status */
+#define STATUS_READ_PREFACE     0
+#define STATUS_NONE             1
+#define STATUS_READ_BODY        2
+
+/* largest request body accepted from a client */
+#define MAX_REQUEST_SIZE    (16 * 1024 * 1024)
+
+#define BLOCK_SIZE      4 * 1024   // 4K
+
+/* default limit of bytes queued in one socket before reading more from disk */
+#define SEND_HIGH_WATER     (4 * 1024 * 1024)
+/* entries per MSG_TAG_ENTRY / MSG_TAG_MANIFEST frame of a directory walk */
+#define LIST_BATCH          1000
+#define MANIFEST_BATCH      256
+/* retry interval while a directory index is still being built */
+#define INDEX_RETRY_MS      100
+
+/* file bytes read per delta scan step */
+#define DELTA_READ_SIZE     (256 * 1024)
+/* delta ops are flushed into a frame once this many are pending */
+#define DELTA_FRAME_SIZE    (64 * 1024)
+
+/* default file bytes per disk read and write of the buffered path */
+#define SEND_CHUNK_SIZE     (256 * 1024)
+#define MIN_CHUNK_SIZE      (4 * 1024)
+#define MAX_CHUNK_SIZE      (16 * 1024 * 1024)
+
+/* largest single sendfile() call */
+#define SENDFILE_CHUNK      (1024 * 1024)
+/* a sendfile() call this slow waited for the disk, read ahead instead */
+#define SLOW_SENDFILE_MS    20
+
+/* SendItem::copy, answer with a MSG_TAG_COPY instead of the data */
+#define COPY_NONE       0
+/* the client said it holds the content */
+#define COPY_HELD       1
+/* the content goes out earlier on this connection, or the file does */
+#define COPY_SENT       2
+
+/* per-connection tunables, set on TransferServer */
+struct SessionOptions
+{
+    SessionOptions() :
+        high_water(SEND_HIGH_WATER),
+        chunk_size(SEND_CHUNK_SIZE),
+        zero_copy(true),
+        compression(true)
+    {
+    }
+
+    qint64 high_water;
+    /* read-ahead block size when file data is not sent with sendfile() */
+    int chunk_size;
+    /* sendfile() file bodies where the platform supports it */
+    bool zero_copy;
+    /* compress file data when the client supports a common codec */
+    bool compression;
+};
+
+Q_DECLARE_METATYPE(SessionOptions)
+
+/*
+ * Protocol state of one client connection.
+ *
+ * Every accepted socket gets its own Session, so the framing state
+ * machine and the outgoing queue are never shared between clients.
+ */
+class Session : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit Session(quint64 id, QTcpSocket *socket, SharedDirs *dirs,
+                     StreamGroups *groups,
+                     const QSharedPointer<SessionStats> &stats,
+                     DiskReader *disk_reader, SendScheduler *scheduler,
+                     const SessionOptions &options = SessionOptions(),
+                     QObject *parent = 0);
+    ~Session();
+
+    quint64 get_id() const { return id; }
+    QTcpSocket *get_socket() const { return socket; }
+
+    /*
+     * Turn of the worker's SendScheduler: send up to about budget file
+     * bytes, *sent gets what was sent. False when there is nothing left
+     * or the session waits for its socket, the disk or the rate limits,
+     * it wakes the scheduler again itself then.
+     */
+    bool send_bulk(qint64 budget, qint64 *sent);
+
+signals:
+    void closed(quint64 id);
+
+private slots:
+    void handle_msg();
+    void handle_disconnect();
+    /* write pending control frames, hand file data to the scheduler */
+    void pump();
+    void count_written(qint64 bytes);
+    void end_throttle();
+
+private:
+    /*
+     * queued outgoing frame: a ready control frame, a file whose header
+     * is built when it reaches the head of the queue, or a directory
+     * walk (walk_tag set) streamed in batches
+     */
+    struct SendItem {
+        SendItem() :
+            request_id(0),
+            queued_us(0),
+            resume_size(0),
+            walk_tag(0),
+            copy(COPY_NONE),
+            file_size(0),
+            range_start(0),
+            range_offset(0),
+            range_length(-1),
+            from_group(false)
+        {
+        }
+
+        QByteArray head;
+        /* request answered by the frames of a file or walk item */
+        quint32 request_id;
+        /*
+         * stats_clock_us() when the request came in, on the first item
+         * of a request only, 0 on the rest; and its share
+         */
+        qint64 queued_us;
+        QString share;
+        QString file_path;
+        QString file_name;
+        /*
+         * prefix the client already holds, 0 unless check_resume() found
+         * it matches; the hash of it the client sent, and ours
+         */
+        qint64 resume_size;
+        QByteArray resume_hash;
+        QSharedPointer<HashRequest> resume_check;
+        /* send a delta against this signature instead of the file */
+        QByteArray delta_signature;
+        qint32 walk_tag;
+        /* content of the file, when it is worth a MSG_TAG_COPY */
+        QByteArray content_hash;
+        qint32 copy;
+        /* MSG_TAG_RANGE chunk of a split file, see StreamItem */
+        qint64 file_size;
+        qint64 range_start;
+        qint64 range_offset;
+        qint64 range_length;
+        /* taken from the group, handed back if the connection drops */
+        bool from_group;
+    };
+
+    quint64 id;
+    QTcpSocket *socket;
+    SharedDirs *shared_dirs;
+    StreamGroups *stream_groups;
+    /* set once the client joined this connection to a group */
+    QSharedPointer<StreamGroup> group;
+    QSharedPointer<SessionStats> stats;
+    /* asynchronous reads of this worker thread */
+    DiskReader *disk_reader;
+    /* turns at sending file data, and the egress limits they obey */
+    SendScheduler *scheduler;
+    RateLimiter *limiter;
+    /* peer address, the key of the per-client limit */
+    QString client;
+    /* a rate limit is in debt, end_throttle() is pending */
+    bool throttled;
+    /* inside send_bulk() */
+    bool sending;
+
+    qint64 body_size;
+    qint32 tag;    // recv msg tag
+    quint32 request_id;    // recv msg request id
+    QString msg;    // recv msg
+    qint64 request_time_us;    // recv msg arrival, stats_clock_us()
+
+    int read_status;
+
+    /* listings and walks, written between the frames of file data */
+    QQueue<SendItem> control_queue;
+    /* files, deltas and copies, in request order */
+    QQueue<SendItem> send_queue;
+    /* files waiting for their resume prefix to be hashed */
+    QList<SendItem> resuming;
+    SessionOptions options;
+    /* request id of the file, delta or walk being streamed */
+    quint32 send_request_id;
+    /* file body being streamed, with bytes still owed to the frame */
+    QFile *current_file;
+    QString current_share;
+    qint64 file_offset;
+    qint64 left_file_size;
+    bool zero_copy_file;
+    /* blocks of current_file being read from file_offset on */
+    ReadAhead *read_ahead;
+    /* codec agreed in the preface, and the one current_file is sent with */
+    int codec;
+    int file_codec;
+    /* MSG_TAG_ZRANGE meta shared by all chunks of current_file */
+    QByteArray chunk_meta;
+    /*
+     * raw frame head to send instead if the first chunk, read ahead as
+     * the sample, does not compress; empty once that is decided
+     */
+    QByteArray raw_head;
+    /* compressed chunk, its storage is reused from chunk to chunk */
+    QByteArray packed;
+    /* CRC-32C of the current_file bytes sent so far, from crc_offset */
+    QString crc_name;
+    qint64 crc_offset;
+    quint32 send_crc;
+    /* some bytes were made up after a short read */
+    bool send_crc_bad;
+    /*
+     * delta being encoded from current_file on the disk pool, the scan
+     * step in flight and the bytes left to scan from file_offset on are
+     * kept in left_file_size
+     */
+    QSharedPointer<DeltaEncoder> current_delta;
+    QSharedPointer<DeltaRequest> delta_scan;
+    QByteArray delta_meta;
+    /* small files read on the disk pool, to go out as one batch */
+    QSharedPointer<BatchRequest> batch_read;
+    QList<SendItem> batch_items;
+    /*
+     * content sent in full on this connection that other shared files
+     * hold too, later requests for it get a MSG_TAG_COPY; and content
+     * on its way, with the number of its items still to go out
+     */
+    QSet<QByteArray> sent_blobs;
+    QHash<QByteArray, int> sending_blobs;
+    /* content_hash of the file being streamed */
+    QByteArray current_hash;
+    /*
+     * item of the file being streamed, and group items whose frames
+     * are still in the socket buffer
+     */
+    SendItem current_item;
+    QList<SendItem> unflushed;
+    /* directory walk in progress over a snapshot of the shared index */
+    QSharedPointer<DirIndex> current_walk;
+    QVector<DirIndex::Entry> walk_entries;
+    int walk_pos;
+    qint32 walk_tag;
+    QString walk_name;
+    quint32 walk_request_id;
+
+    bool handle_preface();
+    void handle_request(const QByteArray &body);
+    void queue_frame(qint32 tag, const QByteArray &body);
+    void queue_error(quint32 id, const QString &name, const QString &reason,
+                     qint64 queued_us = 0);
+    void join_group(const QByteArray &token);
+    bool take_group_item(SendItem *item);
+    static void from_stream_item(const StreamItem &stream_item,
+                                 SendItem *item);
+    static void to_stream_item(const SendItem &item,
+                               StreamItem *stream_item);
+    void give_back_items();
+    void queue_split_file(const SendItem &item, qint64 file_size,
+                          QList<StreamItem> *list);
+    void queue_file(const SendItem &item, QList<StreamItem> *group_items);
+    void check_resume(const SendItem &item);
+    void take_resumed();
+    void send_control();
+    bool in_file_body() const;
+    bool has_bulk() const;
+    QString next_share() const;
+    void throttle(qint64 wait_us);
+
+    /* send dir list */
+    void send_dir_entry();
+    void send_files_entry();
+    void send_files_manifest();
+    void queue_walk(qint32 tag);
+    bool start_walk(const SendItem &item);
+    qint64 send_walk_batch();
+    void request_walk_hashes(int count);
+    void close_walk();
+    void send_files_data(WireReader &in);
+    QList<SendItem> local_items(const SendItem &item);
+    bool send_copy(const SendItem &item);
+    void blob_done(const QByteArray &hash, bool ok);
+    void send_files_delta(WireReader &in);
+    bool is_small_file(const SendItem &item) const;
+    void start_batch(const SendItem &first);
+    qint64 send_batch();
+    bool add_batch_record(const SendItem &item, const BatchFile &file,
+                          QByteArray *payload);
+    QByteArray file_meta(const QString &name, qint64 file_size) const;
+    bool start_file(const SendItem &item);
+    bool start_range(const SendItem &item);
+    bool start_compressed(const SendItem &item, qint64 file_size,
+                          qint64 start, qint64 offset, qint64 length,
+                          const QByteArray &head);
+    qint64 send_compressed_block();
+    bool start_delta(const SendItem &item);
+    void scan_delta(const QSharedPointer<ReadFile> &file);
+    qint64 send_delta_block();
+    bool send_file_block();
+    void send_cached_block();
+    void write_data(const char *data, qint64 len);
+    qint64 send_file_zero_copy(qint64 max_len);
+    void update_crc(qint64 offset, qint64 len);
+    void finish_current_file();
+    void close_current_file();
+};
+
+#endif // SESSION_H
@@ -0,0 +1,149 @@
+#include "sessionstats.h"
+#include <QElapsedTimer>
+
+const int latency_bucket_ms[LATENCY_BUCKETS] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+
+static QElapsedTimer started_clock()
+{
+    QElapsedTimer clock;
+    clock.start();
+    return clock;
+}
+
+qint64 stats_clock_us()
+{
+    /* initialized once, on first use from any thread */
+    static const QElapsedTimer clock = started_clock();
+
+    return clock.nsecsElapsed() / 1000;
+}
+
+SessionStats::SessionStats(quint64 id, const QString &peer) :
+    id(id),
+    peer(peer),
+    bytes_sent(0),
+    files_sent(0),
+    dedup_bytes(0),
+    requests(0),
+    queue_items(0),
+    queue_bytes(0),
+    latency_sum_us(0),
+    rate_bytes(0),
+    rate_time_us(stats_clock_us()),
+    rate(0)
+{
+    for (int i = 0; i <= LATENCY_BUCKETS; i++)
+        latency_count[i].store(0);
+}
+
+void SessionStats::add_latency(qint64 us)
+{
+    int i = 0;
+    while (i < LATENCY_BUCKETS && us > latency_bucket_ms[i] * 1000LL)
+        i++;
+    latency_count[i].store(latency_count[i].load() + 1);
+    latency_sum_us.store(latency_sum_us.load() + us);
+}
+
+void SessionStats::set_queue(int items, qint64 bytes)
+{
+    queue_items.store(items);
+    queue_bytes.store(bytes);
+}
+
+void SessionStats::add_share_bytes(const QString &share, qint64 n)
+{
+    if (share.isEmpty() || n <= 0)
+        return;
+
+    QMutexLocker locker(&share_lock);
+    share_bytes[share] += n;
+}
+
+SessionStats::Snapshot SessionStats::snapshot() const
+{
+    Snapshot s;
+
+    s.bytes_sent = bytes_sent.load();
+    s.files_sent = files_sent.load();
+    s.dedup_bytes = dedup_bytes.load();
+    s.requests = requests.load();
+    s.queue_items = queue_items.load();
+    s.queue_bytes = queue_bytes.load();
+    for (int i = 0; i <= LATENCY_BUCKETS; i++)
+        s.latency_count[i] = latency_count[i].load();
+    s.latency_sum_us = latency_sum_us.load();
+
+    /* readers polling faster than RATE_INTERVAL_US share one sample */
+    {
+        QMutexLocker locker(&rate_lock);
+        qint64 now = stats_clock_us();
+        if (now - rate_time_us >= RATE_INTERVAL_US) {
+            rate = (s.bytes_sent - rate_bytes) * 1000000 /
+                    (now - rate_time_us);
+            rate_bytes = s.bytes_sent;
+            rate_time_us = now;
+        }
+        s.rate = rate;
+    }
+
+    QMutexLocker locker(&share_lock);
+    s.share_bytes = share_bytes;
+    return s;
+}
+
+StatsRegistry::StatsRegistry() :
+    closed_bytes(0)
+{
+}
+
+void StatsRegistry::add(const QSharedPointer<SessionStats> &stats)
+{
+    QWriteLocker locker(&lock);
+    open.insert(stats->get_id(), stats);
+}
+
+void StatsRegistry::remove(quint64 id)
+{
+    QWriteLocker locker(&lock);
+    QSharedPointer<SessionStats> stats = open.take(id);
+    if (!stats)
+        return;
+
+    SessionStats::Snapshot s = stats->snapshot();
+    closed_bytes += s.bytes_sent;
+    QHash<QString, qint64>::const_iterator it = s.share_bytes.constBegin();
+    for (; it != s.share_bytes.constEnd(); ++it)
+        closed_shares[it.key()] += it.value();
+}
+
+QSharedPointer<SessionStats> StatsRegistry::get(quint64 id) const
+{
+    QReadLocker locker(&lock);
+    return open.value(id);
+}
+
+QList<QSharedPointer<SessionStats> > StatsRegistry::sessions() const
+{
+    QReadLocker locker(&lock);
+    return open.values();
+}
+
+QHash<QString, qint64> StatsRegistry::closed_share_bytes() const
+{
+    QReadLocker locker(&lock);
+    return closed_shares;
+}
+
+qint64 StatsRegistry::total_bytes_sent() const
+{
+    QReadLocker locker(&lock);
+    qint64 total = closed_bytes;
+    QHash<quint64, QSharedPointer<SessionStats> >::const_iterator it =
+            open.constBegin();
+    for (; it != open.constEnd(); ++it)
+        total += (*it)->snapshot().bytes_sent;
+    return total;
+}
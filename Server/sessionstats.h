@@ -0,0 +1,114 @@
+#ifndef SESSIONSTATS_H
+#define SESSIONSTATS_H
+
+#include <QAtomicInteger>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QString>
+
+/* request latency buckets, upper bounds in ms, plus one for the rest */
+#define LATENCY_BUCKETS     12
+extern const int latency_bucket_ms[LATENCY_BUCKETS];
+/* the current send rate is averaged over at least this long */
+#define RATE_INTERVAL_US    (1000 * 1000)
+
+/* microseconds on a monotonic clock shared by all threads */
+qint64 stats_clock_us();
+
+/*
+ * Counters of one connection.
+ *
+ * Only the session's worker thread writes them, so the hot path is a
+ * plain load and store with no locked instruction; the window and the
+ * metrics endpoint read them from other threads. The per share byte
+ * counts are updated once per file, under a mutex.
+ */
+class SessionStats
+{
+public:
+    SessionStats(quint64 id, const QString &peer);
+
+    quint64 get_id() const { return id; }
+    QString get_peer() const { return peer; }
+
+    /* writer side */
+    void add_bytes(qint64 n) { bytes_sent.store(bytes_sent.load() + n); }
+    void add_files(int n) { files_sent.store(files_sent.load() + n); }
+    /* file bytes the client copied locally after a MSG_TAG_COPY */
+    void add_dedup_bytes(qint64 n)
+    {
+        dedup_bytes.store(dedup_bytes.load() + n);
+    }
+    void add_request() { requests.store(requests.load() + 1); }
+    void add_latency(qint64 us);
+    void set_queue(int items, qint64 bytes);
+    void add_share_bytes(const QString &share, qint64 n);
+
+    /* reader side */
+    struct Snapshot
+    {
+        qint64 bytes_sent;
+        qint64 files_sent;
+        qint64 dedup_bytes;
+        qint64 requests;
+        qint64 queue_items;
+        qint64 queue_bytes;
+        /* latency_count[i] requests took at most latency_bucket_ms[i] */
+        qint64 latency_count[LATENCY_BUCKETS + 1];
+        qint64 latency_sum_us;
+        QHash<QString, qint64> share_bytes;
+        /* bytes per second sent lately, see RATE_INTERVAL_US */
+        qint64 rate;
+    };
+    Snapshot snapshot() const;
+
+private:
+    quint64 id;
+    QString peer;
+    QAtomicInteger<qint64> bytes_sent;
+    QAtomicInteger<qint64> files_sent;
+    QAtomicInteger<qint64> dedup_bytes;
+    QAtomicInteger<qint64> requests;
+    QAtomicInteger<qint64> queue_items;
+    QAtomicInteger<qint64> queue_bytes;
+    QAtomicInteger<qint64> latency_count[LATENCY_BUCKETS + 1];
+    QAtomicInteger<qint64> latency_sum_us;
+    mutable QMutex share_lock;
+    QHash<QString, qint64> share_bytes;
+    /* bytes_sent at rate_time_us, and the rate up to then */
+    mutable QMutex rate_lock;
+    mutable qint64 rate_bytes;
+    mutable qint64 rate_time_us;
+    mutable qint64 rate;
+};
+
+/*
+ * Stats of the open sessions, shared by all workers. Byte counts of
+ * closed sessions are kept as totals so they never go backwards.
+ */
+class StatsRegistry
+{
+public:
+    StatsRegistry();
+
+    void add(const QSharedPointer<SessionStats> &stats);
+    void remove(quint64 id);
+    /* null when id is not open */
+    QSharedPointer<SessionStats> get(quint64 id) const;
+    QList<QSharedPointer<SessionStats> > sessions() const;
+    /* bytes served per share by closed sessions */
+    QHash<QString, qint64> closed_share_bytes() const;
+    /* bytes written to the sockets of all sessions, open or closed */
+    qint64 total_bytes_sent() const;
+
+private:
+    mutable QReadWriteLock lock;
+    QHash<quint64, QSharedPointer<SessionStats> > open;
+    QHash<QString, qint64> closed_shares;
+    qint64 closed_bytes;
+};
+
+#endif // SESSIONSTATS_H
@@ -0,0 +1,56 @@
+#include "shareddirs.h"
+#include "dirindex.h"
+
+SharedDirs::SharedDirs()
+{
+    index_thread.start(QThread::LowPriority);
+}
+
+SharedDirs::~SharedDirs()
+{
+    {
+        QWriteLocker locker(&lock);
+        indexes.clear();
+    }
+    /* pending deleteLater()s run as the thread finishes */
+    index_thread.quit();
+    index_thread.wait();
+}
+
+void SharedDirs::insert(const QString &name, const QString &path)
+{
+    DirIndex *dir_index = new DirIndex(path, &content);
+    dir_index->moveToThread(&index_thread);
+    QMetaObject::invokeMethod(dir_index, "rebuild", Qt::QueuedConnection);
+
+    QWriteLocker locker(&lock);
+    dirs.insert(name, path);
+    /* sessions still walking the old index keep their reference */
+    indexes.insert(name, QSharedPointer<DirIndex>(dir_index,
+                                                  &QObject::deleteLater));
+}
+
+void SharedDirs::remove(const QString &name)
+{
+    QWriteLocker locker(&lock);
+    content.forget(dirs.take(name));
+    indexes.remove(name);
+}
+
+QString SharedDirs::path(const QString &name) const
+{
+    QReadLocker locker(&lock);
+    return dirs.value(name);
+}
+
+QStringList SharedDirs::names() const
+{
+    QReadLocker locker(&lock);
+    return dirs.keys();
+}
+
+QSharedPointer<DirIndex> SharedDirs::index(const QString &name) const
+{
+    QReadLocker locker(&lock);
+    return indexes.value(name);
+}
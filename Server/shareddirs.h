@@ -0,0 +1,45 @@
+#ifndef SHAREDDIRS_H
+#define SHAREDDIRS_H
+
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QThread>
+#include "contentindex.h"
+
+class DirIndex;
+
+/*
+ * Registry of shared directories (name -> absolute path).
+ *
+ * Written by the main thread when directories are added or removed and
+ * read concurrently by the transfer workers. Every shared directory
+ * also gets a DirIndex, maintained on a dedicated indexer thread.
+ */
+class SharedDirs
+{
+public:
+    SharedDirs();
+    ~SharedDirs();
+
+    void insert(const QString &name, const QString &path);
+    void remove(const QString &name);
+    /* empty string when name is not shared */
+    QString path(const QString &name) const;
+    QStringList names() const;
+    /* null when name is not shared */
+    QSharedPointer<DirIndex> index(const QString &name) const;
+    /* hashes of all shared directories */
+    ContentIndex *get_content() { return &content; }
+
+private:
+    mutable QReadWriteLock lock;
+    QHash<QString, QString> dirs;
+    QHash<QString, QSharedPointer<DirIndex> > indexes;
+    ContentIndex content;
+    QThread index_thread;
+};
+
+#endif // SHAREDDIRS_H
@@ -0,0 +1,105 @@
+#include "streamgroup.h"
+
+StreamGroup::StreamGroup() :
+    QObject(0),
+    stream_count(0)
+{
+}
+
+void StreamGroup::join()
+{
+    QMutexLocker locker(&lock);
+    stream_count++;
+}
+
+void StreamGroup::leave()
+{
+    QMutexLocker locker(&lock);
+    stream_count--;
+}
+
+int StreamGroup::streams() const
+{
+    QMutexLocker locker(&lock);
+    return stream_count;
+}
+
+void StreamGroup::add(const QList<StreamItem> &list)
+{
+    if (list.isEmpty())
+        return;
+
+    {
+        QMutexLocker locker(&lock);
+        for (int i = 0; i < list.size(); i++)
+            items.enqueue(list.at(i));
+    }
+    emit work_available();
+}
+
+void StreamGroup::give_back(const QList<StreamItem> &list)
+{
+    if (list.isEmpty())
+        return;
+
+    {
+        QMutexLocker locker(&lock);
+        for (int i = list.size() - 1; i >= 0; i--)
+            items.prepend(list.at(i));
+    }
+    emit work_available();
+}
+
+bool StreamGroup::take(StreamItem *item)
+{
+    QMutexLocker locker(&lock);
+    if (items.isEmpty())
+        return false;
+
+    *item = items.dequeue();
+    return true;
+}
+
+bool StreamGroup::is_empty() const
+{
+    QMutexLocker locker(&lock);
+    return items.isEmpty();
+}
+
+bool StreamGroup::take_small(quint32 request_id, qint64 max_size,
+                             StreamItem *item)
+{
+    QMutexLocker locker(&lock);
+    if (items.isEmpty())
+        return false;
+
+    const StreamItem &head = items.head();
+    if (head.request_id != request_id || head.range_length >= 0 ||
+            head.resume_size > 0 || head.file_size > max_size)
+        return false;
+
+    *item = items.dequeue();
+    return true;
+}
+
+QSharedPointer<StreamGroup> StreamGroups::join(const QByteArray &token)
+{
+    QMutexLocker locker(&lock);
+
+    /* drop groups whose last stream is gone */
+    QHash<QByteArray, QWeakPointer<StreamGroup> >::iterator it =
+            groups.begin();
+    while (it != groups.end()) {
+        if (it->isNull())
+            it = groups.erase(it);
+        else
+            ++it;
+    }
+
+    QSharedPointer<StreamGroup> group = groups.value(token).toStrongRef();
+    if (!group) {
+        group = QSharedPointer<StreamGroup>(new StreamGroup);
+        groups.insert(token, group.toWeakRef());
+    }
+    return group;
+}
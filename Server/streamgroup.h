@@ -0,0 +1,100 @@
+#ifndef STREAMGROUP_H
+#define STREAMGROUP_H
+
+#include <QObject>
+#include <QQueue>
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QWeakPointer>
+
+/* files at least this large are split over the streams of a group */
+#define STREAM_SPLIT_SIZE   (16 * 1024 * 1024)
+/* size of one MSG_TAG_RANGE chunk of a split file */
+#define STREAM_CHUNK_SIZE   (4 * 1024 * 1024)
+
+/* unit of work any stream of a group can pick up */
+struct StreamItem
+{
+    StreamItem() :
+        request_id(0),
+        queued_us(0),
+        resume_size(0),
+        file_size(0),
+        range_start(0),
+        range_offset(0),
+        range_length(-1)
+    {
+    }
+
+    /* FILE request of the member that asked for it */
+    quint32 request_id;
+    /* stats_clock_us() when the request came in, and its share */
+    qint64 queued_us;
+    QString share;
+    QString file_path;
+    QString file_name;
+    /* prefix of the file the client holds, checked already */
+    qint64 resume_size;
+    /* chunk of a split file, range_length -1 sends the whole file */
+    qint64 file_size;
+    qint64 range_start;
+    qint64 range_offset;
+    qint64 range_length;
+};
+
+/*
+ * Connections of one client joined under the same token.
+ *
+ * Files requested on any member are queued here and each member pulls
+ * the next item whenever its socket has room, so faster streams take
+ * more of the work. Members live on different workers, work_available()
+ * is emitted from whichever thread queued the items.
+ */
+class StreamGroup : public QObject
+{
+    Q_OBJECT
+
+public:
+    StreamGroup();
+
+    void join();
+    void leave();
+    int streams() const;
+
+    void add(const QList<StreamItem> &list);
+    /* items a stream took and did not get out, they go first */
+    void give_back(const QList<StreamItem> &list);
+    /* false when there is nothing left to send */
+    bool take(StreamItem *item);
+    /*
+     * take the next item only if it is a whole file of request_id of at
+     * most max_size bytes, for packing into a batch
+     */
+    bool take_small(quint32 request_id, qint64 max_size, StreamItem *item);
+    /* nothing queued right now */
+    bool is_empty() const;
+
+signals:
+    void work_available();
+
+private:
+    mutable QMutex lock;
+    QQueue<StreamItem> items;
+    int stream_count;
+};
+
+/* token -> group registry shared by all workers */
+class StreamGroups
+{
+public:
+    QSharedPointer<StreamGroup> join(const QByteArray &token);
+
+private:
+    QMutex lock;
+    QHash<QByteArray, QWeakPointer<StreamGroup> > groups;
+};
+
+#endif // STREAMGROUP_H
@@ -0,0 +1,133 @@
+#include "transferserver.h"
+#include "asyncreader.h"
+#include "sendscheduler.h"
+#include <QDebug>
+#include <QThread>
+#include <QTcpSocket>
+#include <QHostAddress>
+
+Worker::Worker(SharedDirs *dirs, StreamGroups *groups, StatsRegistry *stats,
+               RateLimiter *limiter) :
+    QObject(0),
+    shared_dirs(dirs),
+    stream_groups(groups),
+    stats(stats),
+    disk_reader(new DiskReader(this)),
+    scheduler(new SendScheduler(limiter, this))
+{
+}
+
+void Worker::add_connection(quint64 id, qintptr descriptor,
+                            SessionOptions options)
+{
+    QTcpSocket *socket = new QTcpSocket;
+    if (!socket->setSocketDescriptor(descriptor)) {
+        qDebug() << "Socket setup failed: " << socket->errorString();
+        delete socket;
+        emit session_closed(id);
+        return;
+    }
+
+    QSharedPointer<SessionStats> session_stats(new SessionStats(
+            id, QString("%1:%2").arg(socket->peerAddress().toString())
+            .arg(socket->peerPort())));
+    stats->add(session_stats);
+
+    Session *session = new Session(id, socket, shared_dirs, stream_groups,
+                                   session_stats, disk_reader, scheduler,
+                                   options, this);
+    connect(session, SIGNAL(closed(quint64)),
+            this, SLOT(handle_disconnect(quint64)));
+    hash_sessions.insert(id, session);
+
+    emit session_opened(id, socket->peerAddress().toString(),
+                        socket->peerPort());
+}
+
+void Worker::close_session(quint64 id)
+{
+    Session *session = hash_sessions.value(id);
+    if (session)
+        session->get_socket()->close();
+}
+
+void Worker::handle_disconnect(quint64 id)
+{
+    Session *session = hash_sessions.take(id);
+    if (!session)
+        return;
+
+    session->deleteLater();
+    stats->remove(id);
+    emit session_closed(id);
+}
+
+TransferServer::TransferServer(SharedDirs *dirs, int workers_num,
+                               QObject *parent) :
+    QTcpServer(parent),
+    next_id(1),
+    next_worker(0)
+{
+    qRegisterMetaType<qintptr>("qintptr");
+    qRegisterMetaType<SessionOptions>("SessionOptions");
+
+    if (workers_num <= 0)
+        workers_num = qMax(1, QThread::idealThreadCount());
+
+    for (int i = 0; i < workers_num; i++) {
+        QThread *thread = new QThread(this);
+        Worker *worker = new Worker(dirs, &stream_groups, &stats, &limiter);
+        worker->moveToThread(thread);
+
+        connect(thread, SIGNAL(finished()), worker, SLOT(deleteLater()));
+        connect(worker, SIGNAL(session_opened(quint64,QString,quint16)),
+                this, SIGNAL(session_opened(quint64,QString,quint16)));
+        connect(worker, SIGNAL(session_closed(quint64)),
+                this, SLOT(forget_session(quint64)));
+
+        thread->start();
+        threads.append(thread);
+        workers.append(worker);
+    }
+}
+
+TransferServer::~TransferServer()
+{
+    close();
+    for (int i = 0; i < threads.size(); i++) {
+        threads[i]->quit();
+        threads[i]->wait();
+    }
+}
+
+void TransferServer::incomingConnection(qintptr descriptor)
+{
+    quint64 id = next_id++;
+    int index = next_worker;
+
+    next_worker = (next_worker + 1) % workers.size();
+    session_worker.insert(id, index);
+
+    QMetaObject::invokeMethod(workers[index], "add_connection",
+                              Qt::QueuedConnection,
+                              Q_ARG(quint64, id),
+                              Q_ARG(qintptr, descriptor),
+                              Q_ARG(SessionOptions, options));
+}
+
+void TransferServer::close_session(quint64 id)
+{
+    QHash<quint64, int>::iterator it = session_worker.find(id);
+    if (it == session_worker.end())
+        return;
+
+    QMetaObject::invokeMethod(workers[*it], "close_session",
+                              Qt::QueuedConnection,
+                              Q_ARG(quint64, id));
+}
+
+void TransferServer::forget_session(quint64 id)
+{
+    session_worker.remove(id);
+    emit session_closed(id);
+}
@@ -0,0 +1,111 @@
+#ifndef TRANSFERSERVER_H
+#define TRANSFERSERVER_H
+
+#include <QTcpServer>
+#include <QHash>
+#include <QVector>
+#include "session.h"
+#include "ratelimit.h"
+
+class QThread;
+class SharedDirs;
+class DiskReader;
+class SendScheduler;
+
+/*
+ * Transfer worker: owns an event loop thread and every Session that
+ * was handed to it. All socket and file I/O of those sessions runs
+ * on the worker thread.
+ */
+class Worker : public QObject
+{
+    Q_OBJECT
+
+public:
+    Worker(SharedDirs *dirs, StreamGroups *groups, StatsRegistry *stats,
+           RateLimiter *limiter);
+
+public slots:
+    void add_connection(quint64 id, qintptr descriptor,
+                        SessionOptions options);
+    void close_session(quint64 id);
+
+signals:
+    void session_opened(quint64 id, QString ip, quint16 port);
+    void session_closed(quint64 id);
+
+private slots:
+    void handle_disconnect(quint64 id);
+
+private:
+    SharedDirs *shared_dirs;
+    StreamGroups *stream_groups;
+    StatsRegistry *stats;
+    /* file reads of all sessions on this thread */
+    DiskReader *disk_reader;
+    /* fair share of the file data they send */
+    SendScheduler *scheduler;
+    QHash<quint64, Session *> hash_sessions;
+};
+
+/*
+ * Listening socket that distributes accepted connections round-robin
+ * over a pool of Worker threads instead of serving them on the thread
+ * that owns the listener.
+ */
+class TransferServer : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    explicit TransferServer(SharedDirs *dirs, int workers = 0,
+                            QObject *parent = 0);
+    ~TransferServer();
+
+    /* per-connection send buffer limit, see Session::pump() */
+    void set_high_water_mark(qint64 bytes) { options.high_water = bytes; }
+    /* disk read size of file data not sent with sendfile() */
+    void set_chunk_size(int bytes) { options.chunk_size = bytes; }
+    /* sendfile() file bodies on Linux, buffered reads otherwise */
+    void set_zero_copy(bool enable) { options.zero_copy = enable; }
+    /* compress file data for clients that support it */
+    void set_compression(bool enable) { options.compression = enable; }
+    /* egress limits in bytes per second, 0 for none, see RateLimiter */
+    void set_rate_limits(qint64 global, qint64 per_client, qint64 per_share)
+    {
+        limiter.set_rates(global, per_client, per_share);
+    }
+    void set_share_rate(const QString &share, qint64 rate)
+    {
+        limiter.set_share_rate(share, rate);
+    }
+    /* counters of the open sessions, readable from any thread */
+    const StatsRegistry *get_stats() const { return &stats; }
+
+public slots:
+    void close_session(quint64 id);
+
+signals:
+    void session_opened(quint64 id, QString ip, quint16 port);
+    void session_closed(quint64 id);
+
+protected:
+    void incomingConnection(qintptr descriptor);
+
+private slots:
+    void forget_session(quint64 id);
+
+private:
+    QVector<QThread *> threads;
+    QVector<Worker *> workers;
+    /* session id -> worker index, only touched on the listener thread */
+    QHash<quint64, int> session_worker;
+    quint64 next_id;
+    int next_worker;
+    SessionOptions options;
+    StreamGroups stream_groups;
+    StatsRegistry stats;
+    RateLimiter limiter;
+};
+
+#endif // TRANSFERSERVER_H